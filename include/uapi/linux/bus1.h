@@ -48,6 +48,14 @@
 
 #define BUS1_VEC_MAX		(512) /* UIO_MAXIOV is 1024 */
 #define BUS1_FD_MAX		(256)
+#define BUS1_DEST_SET_MAX	(1024)
+#define BUS1_PEER_SET_MAX	(1024)
+#define BUS1_BATCH_MAX		(256)
+#define BUS1_BUFFER_SIZE_MAX	(64ULL * 1024ULL * 1024ULL)
+#define BUS1_SLICES_MAX		(64)
+#define BUS1_HEADER_SIZE_MAX	(4096)
+#define BUS1_NODE_ALLOCATE_MAX	(1024)
+#define BUS1_NODE_DESTROY_MAX	(1024)
 
 #define BUS1_IOCTL_MAGIC		0x96
 #define BUS1_HANDLE_INVALID		((__u64)-1)
@@ -58,6 +66,13 @@ enum {
 	BUS1_NODE_FLAG_ALLOCATE		= 1ULL <<  1,
 };
 
+enum {
+	BUS1_PEER_FLAG_SCATTER		= 1ULL <<  0,
+	BUS1_PEER_FLAG_SHARED_POOL	= 1ULL <<  1,
+	BUS1_PEER_FLAG_UNORDERED	= 1ULL <<  2,
+	BUS1_PEER_FLAG_AGGREGATE	= 1ULL <<  3,
+};
+
 struct bus1_cmd_peer_init {
 	__u64 flags;
 	__u64 pool_size;
@@ -79,6 +94,16 @@ enum {
 	BUS1_SEND_FLAG_CONTINUE		= 1ULL <<  0,
 	BUS1_SEND_FLAG_SILENT		= 1ULL <<  1,
 	BUS1_SEND_FLAG_SEED		= 1ULL <<  2,
+	BUS1_SEND_FLAG_DEST_SET		= 1ULL <<  3,
+	BUS1_SEND_FLAG_BUFFERS		= 1ULL <<  4,
+	BUS1_SEND_FLAG_PAGE_ALIGNED	= 1ULL <<  5,
+	BUS1_SEND_FLAG_COALESCE		= 1ULL <<  6,
+	BUS1_SEND_FLAG_SHARED		= 1ULL <<  7,
+	BUS1_SEND_FLAG_PULL		= 1ULL <<  8,
+	BUS1_SEND_FLAG_HEADERS		= 1ULL <<  9,
+	BUS1_SEND_FLAG_UNORDERED	= 1ULL << 10,
+	BUS1_SEND_FLAG_MOVE_HANDLES	= 1ULL << 11,
+	BUS1_SEND_FLAG_MOVE_FDS		= 1ULL << 12,
 };
 
 struct bus1_cmd_send {
@@ -91,6 +116,62 @@ struct bus1_cmd_send {
 	__u64 n_handles;
 	__u64 ptr_fds;
 	__u64 n_fds;
+	__u64 dest_set;
+	__u64 coalesce_key;
+	__u64 deadline;
+	__u64 ptr_headers;
+	__u64 header_size;
+} __attribute__((__aligned__(8)));
+
+struct bus1_cmd_dest_set {
+	__u64 flags;
+	__u64 id;
+	__u64 ptr_destinations;
+	__u64 n_destinations;
+} __attribute__((__aligned__(8)));
+
+struct bus1_cmd_peer_set {
+	__u64 flags;
+	__u64 id;
+	__u64 ptr_fds;
+	__u64 n_fds;
+} __attribute__((__aligned__(8)));
+
+struct bus1_cmd_node_allocate {
+	__u64 flags;
+	__u64 ptr_ids;
+	__u64 n_ids;
+} __attribute__((__aligned__(8)));
+
+struct bus1_cmd_reply_reserve {
+	__u64 flags;
+	__u64 id;
+	__u64 size;
+} __attribute__((__aligned__(8)));
+
+struct bus1_batch_cmd {
+	__u64 cmd;
+	__u64 ptr_arg;
+	__s64 result;
+} __attribute__((__aligned__(8)));
+
+struct bus1_cmd_batch {
+	__u64 flags;
+	__u64 ptr_cmds;
+	__u64 n_cmds;
+} __attribute__((__aligned__(8)));
+
+struct bus1_cmd_buffer {
+	__u64 flags;
+	__u64 id;
+	__u64 ptr;
+	__u64 size;
+} __attribute__((__aligned__(8)));
+
+struct bus1_buffer_vec {
+	__u64 buffer;
+	__u64 offset;
+	__u64 length;
 } __attribute__((__aligned__(8)));
 
 enum {
@@ -109,15 +190,26 @@ struct bus1_msg_data {
 	__u64 n_bytes;
 	__u64 n_handles;
 	__u64 n_fds;
+	__u64 n_slices;
+	__u64 timestamp;
+} __attribute__((__aligned__(8)));
+
+struct bus1_msg_slice {
+	__u64 offset;
+	__u64 n_bytes;
 } __attribute__((__aligned__(8)));
 
 struct bus1_msg_node_destroy {
 	__u64 handle;
+	__u64 offset;
+	__u64 n_handles;
 } __attribute__((__aligned__(8)));
 
 enum {
 	BUS1_RECV_FLAG_PEEK		= 1ULL <<  0,
 	BUS1_RECV_FLAG_SEED		= 1ULL <<  1,
+	BUS1_RECV_FLAG_PEER_SET		= 1ULL <<  2,
+	BUS1_RECV_FLAG_WAIT		= 1ULL <<  3,
 };
 
 struct bus1_cmd_recv {
@@ -128,6 +220,9 @@ struct bus1_cmd_recv {
 		struct bus1_msg_data data;
 		struct bus1_msg_node_destroy node_destroy;
 	};
+	__u64 n_expired;
+	__u64 peer_set;
+	__u64 peer_index;
 } __attribute__((__aligned__(8)));
 
 enum {
@@ -149,6 +244,24 @@ enum {
 						struct bus1_cmd_send),
 	BUS1_CMD_RECV			= _IOWR(BUS1_IOCTL_MAGIC, 0x08,
 						struct bus1_cmd_recv),
+	BUS1_CMD_DEST_SET_REGISTER	= _IOWR(BUS1_IOCTL_MAGIC, 0x09,
+						struct bus1_cmd_dest_set),
+	BUS1_CMD_DEST_SET_RELEASE	= _IOWR(BUS1_IOCTL_MAGIC, 0x0a,
+						__u64),
+	BUS1_CMD_BUFFER_REGISTER	= _IOWR(BUS1_IOCTL_MAGIC, 0x0b,
+						struct bus1_cmd_buffer),
+	BUS1_CMD_BUFFER_RELEASE		= _IOWR(BUS1_IOCTL_MAGIC, 0x0c,
+						__u64),
+	BUS1_CMD_PEER_SET_REGISTER	= _IOWR(BUS1_IOCTL_MAGIC, 0x0d,
+						struct bus1_cmd_peer_set),
+	BUS1_CMD_PEER_SET_RELEASE	= _IOWR(BUS1_IOCTL_MAGIC, 0x0e,
+						__u64),
+	BUS1_CMD_BATCH			= _IOWR(BUS1_IOCTL_MAGIC, 0x0f,
+						struct bus1_cmd_batch),
+	BUS1_CMD_NODE_ALLOCATE		= _IOWR(BUS1_IOCTL_MAGIC, 0x10,
+						struct bus1_cmd_node_allocate),
+	BUS1_CMD_REPLY_RESERVE		= _IOWR(BUS1_IOCTL_MAGIC, 0x11,
+						struct bus1_cmd_reply_reserve),
 };
 
 #endif /* _UAPI_LINUX_BUS1_H */
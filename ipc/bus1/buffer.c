@@ -0,0 +1,474 @@
+/*
+ * Copyright (C) 2013-2016 Red Hat, Inc.
+ *
+ * bus1 is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2.1 of the License, or (at
+ * your option) any later version.
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+#include <linux/capability.h>
+#include <linux/err.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/kref.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/rbtree.h>
+#include <linux/rwsem.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/vmalloc.h>
+#include <uapi/linux/bus1.h>
+#include "buffer.h"
+#include "main.h"
+#include "message.h"
+#include "peer.h"
+
+static int bus1_buffer_account(struct mm_struct *mm, size_t n_pages)
+{
+	unsigned long limit;
+	int r = 0;
+
+	/*
+	 * Pinned pages are charged on the address space of the registering
+	 * process, just like any other long-term pin. This way, the limit
+	 * covers all peers of a process, rather than each of them on its own.
+	 */
+	limit = rlimit(RLIMIT_MEMLOCK) >> PAGE_SHIFT;
+
+	down_write(&mm->mmap_sem);
+	if (mm->pinned_vm + n_pages > limit && !capable(CAP_IPC_LOCK))
+		r = -EDQUOT;
+	else
+		mm->pinned_vm += n_pages;
+	up_write(&mm->mmap_sem);
+
+	return r;
+}
+
+static void bus1_buffer_unaccount(struct mm_struct *mm, size_t n_pages)
+{
+	down_write(&mm->mmap_sem);
+	mm->pinned_vm -= n_pages;
+	up_write(&mm->mmap_sem);
+}
+
+static void bus1_buffer_free(struct kref *ref)
+{
+	struct bus1_buffer *buffer = container_of(ref, struct bus1_buffer, ref);
+	size_t i;
+
+	WARN_ON(!RB_EMPTY_NODE(&buffer->rb));
+
+	for (i = 0; i < buffer->n_pages; ++i)
+		put_page(buffer->bvecs[i].bv_page);
+	if (buffer->mm) {
+		bus1_buffer_unaccount(buffer->mm, buffer->n_pages);
+		mmdrop(buffer->mm);
+	}
+	kvfree(buffer->bvecs);
+	kfree(buffer);
+}
+
+/**
+ * bus1_buffer_unref() - release buffer reference
+ * @buffer:		buffer to release, or NULL
+ *
+ * This drops a reference to a registered buffer. If it was the last
+ * reference, the pinned pages are released and the buffer is freed.
+ *
+ * If NULL is passed, this is a no-op.
+ *
+ * This might take the mmap_sem of the registering process, hence, it must not
+ * be called with a peer lock held.
+ *
+ * Return: NULL is returned.
+ */
+struct bus1_buffer *bus1_buffer_unref(struct bus1_buffer *buffer)
+{
+	if (buffer)
+		kref_put(&buffer->ref, bus1_buffer_free);
+	return NULL;
+}
+
+static struct bus1_buffer *bus1_buffer_new(unsigned long addr, size_t size)
+{
+	struct bus1_buffer *buffer;
+	struct page **pages;
+	size_t i, n_pages, first, len;
+	int r;
+
+	n_pages = DIV_ROUND_UP(offset_in_page(addr) + size, PAGE_SIZE);
+
+	buffer = kmalloc(sizeof(*buffer), GFP_KERNEL);
+	if (!buffer)
+		return ERR_PTR(-ENOMEM);
+
+	kref_init(&buffer->ref);
+	RB_CLEAR_NODE(&buffer->rb);
+	buffer->id = 0;
+	buffer->size = size;
+	buffer->n_pages = 0;
+	buffer->mm = NULL;
+
+	buffer->bvecs = kmalloc(n_pages * sizeof(*buffer->bvecs),
+				GFP_KERNEL | __GFP_NOWARN);
+	if (!buffer->bvecs)
+		buffer->bvecs = vmalloc(n_pages * sizeof(*buffer->bvecs));
+	if (!buffer->bvecs) {
+		kfree(buffer);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	/*
+	 * Temporarily use the tail of the vector array as page array. A page
+	 * pointer is never bigger than a vector, so if we fill the vectors
+	 * front to back, we never overwrite a page pointer we still need.
+	 */
+	BUILD_BUG_ON(sizeof(*pages) > sizeof(*buffer->bvecs));
+	pages = (struct page **)(buffer->bvecs + n_pages) - n_pages;
+
+	/*
+	 * Pin the pages writable, even though we only ever read them. This
+	 * breaks COW before pinning, hence, we are guaranteed to see any
+	 * future write of the caller to this region.
+	 */
+	r = bus1_buffer_account(current->mm, n_pages);
+	if (r < 0) {
+		kvfree(buffer->bvecs);
+		kfree(buffer);
+		return ERR_PTR(r);
+	}
+
+	r = get_user_pages_fast(addr & PAGE_MASK, n_pages, 1, pages);
+	if (r < 0) {
+		i = 0;
+		goto error;
+	} else if (r != n_pages) {
+		i = r;
+		r = -EFAULT;
+		goto error;
+	}
+
+	first = offset_in_page(addr);
+	for (i = 0; i < n_pages; ++i) {
+		len = min_t(size_t, size, PAGE_SIZE - first);
+		buffer->bvecs[i].bv_page = pages[i];
+		buffer->bvecs[i].bv_offset = first;
+		buffer->bvecs[i].bv_len = len;
+		size -= len;
+		first = 0;
+	}
+	buffer->n_pages = n_pages;
+
+	/* the charge is dropped once the last page is unpinned */
+	atomic_inc(&current->mm->mm_count);
+	buffer->mm = current->mm;
+
+	return buffer;
+
+error:
+	while (i > 0)
+		put_page(pages[--i]);
+	bus1_buffer_unaccount(current->mm, n_pages);
+	kvfree(buffer->bvecs);
+	kfree(buffer);
+	return ERR_PTR(r);
+}
+
+/**
+ * bus1_buffer_register() - register a new send buffer
+ * @peer_info:		peer to operate on
+ * @addr:		user-space address of the buffer
+ * @size:		size of the buffer in bytes
+ * @idp:		output storage for the ID of the new buffer
+ *
+ * This pins the pages backing [@addr, @addr + @size) and registers them as
+ * send buffer on @peer_info. The region must be mapped writable. The pinned
+ * pages are charged on the calling process, and checked against its
+ * RLIMIT_MEMLOCK, unless it has CAP_IPC_LOCK.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int bus1_buffer_register(struct bus1_peer_info *peer_info,
+			 unsigned long addr,
+			 size_t size,
+			 u64 *idp)
+{
+	struct bus1_buffer *buffer, *iter;
+	struct rb_node *n, **slot;
+	u64 id;
+	int r;
+
+	if (size < 1 || size > BUS1_BUFFER_SIZE_MAX)
+		return -EMSGSIZE;
+	if (addr + size < addr ||
+	    !access_ok(VERIFY_WRITE, (void __user *)addr, size))
+		return -EFAULT;
+
+	buffer = bus1_buffer_new(addr, size);
+	if (IS_ERR(buffer))
+		return PTR_ERR(buffer);
+
+	mutex_lock(&peer_info->lock);
+	if (peer_info->n_buffers >= BUS1_BUFFERS_MAX) {
+		mutex_unlock(&peer_info->lock);
+		r = -EDQUOT;
+		goto error;
+	}
+
+	id = ++peer_info->buffer_ids;
+	buffer->id = id;
+
+	n = NULL;
+	slot = &peer_info->map_buffers.rb_node;
+	while (*slot) {
+		n = *slot;
+		iter = container_of(n, struct bus1_buffer, rb);
+		WARN_ON(id == iter->id);
+		if (id < iter->id)
+			slot = &n->rb_left;
+		else /* if (id > iter->id) */
+			slot = &n->rb_right;
+	}
+	rb_link_node(&buffer->rb, n, slot);
+	rb_insert_color(&buffer->rb, &peer_info->map_buffers);
+	++peer_info->n_buffers;
+	mutex_unlock(&peer_info->lock);
+
+	/* the map owns the initial reference now, @buffer must not be used */
+	*idp = id;
+	return 0;
+
+error:
+	bus1_buffer_unref(buffer);
+	return r;
+}
+
+static struct bus1_buffer *
+bus1_buffer_lookup(struct bus1_peer_info *peer_info, u64 id)
+{
+	struct bus1_buffer *buffer;
+	struct rb_node *n;
+
+	lockdep_assert_held(&peer_info->lock);
+
+	n = peer_info->map_buffers.rb_node;
+	while (n) {
+		buffer = container_of(n, struct bus1_buffer, rb);
+		if (id == buffer->id)
+			return buffer;
+		else if (id < buffer->id)
+			n = n->rb_left;
+		else /* if (id > buffer->id) */
+			n = n->rb_right;
+	}
+
+	return NULL;
+}
+
+static void bus1_buffer_unlink(struct bus1_buffer *buffer,
+			       struct bus1_peer_info *peer_info)
+{
+	lockdep_assert_held(&peer_info->lock);
+
+	rb_erase(&buffer->rb, &peer_info->map_buffers);
+	RB_CLEAR_NODE(&buffer->rb);
+	--peer_info->n_buffers;
+}
+
+/**
+ * bus1_buffer_release_by_id() - release send buffer
+ * @peer_info:		peer to operate on
+ * @id:			buffer ID
+ *
+ * This unregisters the send buffer with ID @id from @peer_info. The pages are
+ * unpinned once all transactions that use the buffer have finished.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int bus1_buffer_release_by_id(struct bus1_peer_info *peer_info, u64 id)
+{
+	struct bus1_buffer *buffer;
+
+	mutex_lock(&peer_info->lock);
+	buffer = bus1_buffer_lookup(peer_info, id);
+	if (buffer)
+		bus1_buffer_unlink(buffer, peer_info);
+	mutex_unlock(&peer_info->lock);
+
+	if (!buffer)
+		return -ENXIO;
+
+	bus1_buffer_unref(buffer);
+	return 0;
+}
+
+/**
+ * bus1_buffer_flush_all() - release all send buffers
+ * @peer_info:		peer to operate on
+ *
+ * This unregisters all send buffers of @peer_info.
+ */
+void bus1_buffer_flush_all(struct bus1_peer_info *peer_info)
+{
+	struct bus1_buffer *buffer;
+	struct rb_node *n;
+
+	for (;;) {
+		mutex_lock(&peer_info->lock);
+		n = rb_first(&peer_info->map_buffers);
+		if (n) {
+			buffer = container_of(n, struct bus1_buffer, rb);
+			bus1_buffer_unlink(buffer, peer_info);
+		}
+		mutex_unlock(&peer_info->lock);
+
+		if (!n)
+			break;
+
+		bus1_buffer_unref(buffer);
+	}
+}
+
+/**
+ * bus1_buffer_import_ranges() - import buffer vectors from user
+ * @peer_info:		peer to operate on
+ * @out_ranges:		kernel memory to store ranges, preallocated
+ * @out_length:		output storage for sum of all range lengths
+ * @vecs:		user pointer for buffer vectors
+ * @n_vecs:		number of vectors to import
+ *
+ * This is the equivalent of bus1_import_vecs() for registered buffers. Each
+ * vector is resolved to a registered buffer of @peer_info, which is pinned in
+ * the respective range.
+ *
+ * @out_ranges must be zeroed by the caller. Regardless whether this function
+ * fails, the caller must release the ranges via bus1_buffer_release_ranges().
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int bus1_buffer_import_ranges(struct bus1_peer_info *peer_info,
+			      struct bus1_buffer_range *out_ranges,
+			      size_t *out_length,
+			      const struct bus1_buffer_vec __user *vecs,
+			      size_t n_vecs)
+{
+	struct bus1_buffer_vec *kvecs, vec;
+	struct bus1_buffer *buffer;
+	size_t i, length = 0;
+	int r = 0;
+
+	if (n_vecs == 0) {
+		*out_length = 0;
+		return 0;
+	}
+
+	/* never fault on user memory while holding the peer lock */
+	kvecs = kmalloc(n_vecs * sizeof(*kvecs), GFP_TEMPORARY);
+	if (!kvecs)
+		return -ENOMEM;
+
+	if (copy_from_user(kvecs, vecs, n_vecs * sizeof(*kvecs))) {
+		kfree(kvecs);
+		return -EFAULT;
+	}
+
+	mutex_lock(&peer_info->lock);
+	for (i = 0; i < n_vecs; ++i) {
+		vec = kvecs[i];
+
+		buffer = bus1_buffer_lookup(peer_info, vec.buffer);
+		if (!buffer) {
+			r = -ENXIO;
+			break;
+		}
+
+		if (unlikely(vec.offset > buffer->size ||
+			     vec.length > buffer->size - vec.offset)) {
+			r = -EFAULT;
+			break;
+		}
+		if (unlikely(vec.length > MAX_RW_COUNT - length)) {
+			r = -EMSGSIZE;
+			break;
+		}
+
+		kref_get(&buffer->ref);
+		out_ranges[i].buffer = buffer;
+		out_ranges[i].offset = vec.offset;
+		out_ranges[i].length = vec.length;
+		length += vec.length;
+	}
+	mutex_unlock(&peer_info->lock);
+
+	kfree(kvecs);
+	if (r < 0)
+		return r;
+
+	*out_length = length;
+	return 0;
+}
+
+/**
+ * bus1_buffer_release_ranges() - release imported ranges
+ * @ranges:		ranges to release
+ * @n_ranges:		number of ranges
+ *
+ * This releases the buffers pinned by bus1_buffer_import_ranges(). Ranges
+ * without a pinned buffer are skipped.
+ */
+void bus1_buffer_release_ranges(struct bus1_buffer_range *ranges,
+				size_t n_ranges)
+{
+	size_t i;
+
+	for (i = 0; i < n_ranges; ++i)
+		ranges[i].buffer = bus1_buffer_unref(ranges[i].buffer);
+}
+
+/**
+ * bus1_buffer_write_ranges() - copy buffer ranges into a message
+ * @ranges:		ranges to copy
+ * @n_ranges:		number of ranges
+ * @message:		message to write to
+ * @peer_info:		destination peer
+ *
+ * This copies the data of all ranges consecutively into the payload of
+ * @message, starting at its front.
+ *
+ * Return: Number of bytes copied, negative error code on failure.
+ */
+ssize_t bus1_buffer_write_ranges(struct bus1_buffer_range *ranges,
+				 size_t n_ranges,
+				 struct bus1_message *message,
+				 struct bus1_peer_info *peer_info)
+{
+	struct bus1_buffer *buffer;
+	struct iov_iter iter;
+	ssize_t len, total = 0;
+	size_t i;
+
+	for (i = 0; i < n_ranges; ++i) {
+		buffer = ranges[i].buffer;
+		if (!ranges[i].length)
+			continue;
+
+		iov_iter_bvec(&iter, WRITE | ITER_BVEC, buffer->bvecs,
+			      buffer->n_pages,
+			      ranges[i].offset + ranges[i].length);
+		iov_iter_advance(&iter, ranges[i].offset);
+
+		len = bus1_message_write(message, peer_info, total, &iter);
+		if (len < 0)
+			return len;
+
+		total += len;
+	}
+
+	return total;
+}
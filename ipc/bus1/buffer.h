@@ -0,0 +1,94 @@
+#ifndef __BUS1_BUFFER_H
+#define __BUS1_BUFFER_H
+
+/*
+ * Copyright (C) 2013-2016 Red Hat, Inc.
+ *
+ * bus1 is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2.1 of the License, or (at
+ * your option) any later version.
+ */
+
+/**
+ * DOC: Registered Buffers
+ *
+ * A peer can register regions of its own address space as send buffers. The
+ * pages backing such a region are pinned by the kernel, and stay pinned until
+ * the buffer is released again. Messages can then refer to ranges of a
+ * registered buffer, rather than passing iovecs. This allows the kernel to
+ * skip validation of user-supplied vectors on every transaction, and it
+ * copies the payload straight from the pinned pages, so no page-faults can be
+ * taken while writing into the pool of the destination.
+ *
+ * Registered buffers are local to a peer, and are identified by a 64bit ID
+ * that is never reused on the same peer. Pinned pages are charged on the
+ * pinned_vm of the registering process and checked against its
+ * RLIMIT_MEMLOCK, unless the caller has CAP_IPC_LOCK. Hence, a process cannot
+ * exceed its limit by registering buffers on multiple peers.
+ */
+
+#include <linux/blk_types.h>
+#include <linux/kernel.h>
+#include <linux/kref.h>
+#include <linux/rbtree.h>
+#include <uapi/linux/bus1.h>
+
+struct bus1_message;
+struct mm_struct;
+struct bus1_peer_info;
+
+/**
+ * struct bus1_buffer - registered send buffer
+ * @ref:		object ref-count
+ * @rb:			link into owning peer, based on ID
+ * @id:			ID of this buffer
+ * @size:		size of the buffer in bytes
+ * @n_pages:		number of pinned pages
+ * @mm:			address space the pinned pages are charged on
+ * @bvecs:		pinned pages, one vector per page, covering exactly
+ *			the registered region
+ */
+struct bus1_buffer {
+	struct kref ref;
+	struct rb_node rb;
+	u64 id;
+	size_t size;
+	size_t n_pages;
+	struct mm_struct *mm;
+	struct bio_vec *bvecs;
+};
+
+/**
+ * struct bus1_buffer_range - pinned range of a registered buffer
+ * @buffer:		pinned buffer, or NULL
+ * @offset:		offset of the range into @buffer
+ * @length:		length of the range in bytes
+ */
+struct bus1_buffer_range {
+	struct bus1_buffer *buffer;
+	size_t offset;
+	size_t length;
+};
+
+int bus1_buffer_register(struct bus1_peer_info *peer_info,
+			 unsigned long addr,
+			 size_t size,
+			 u64 *idp);
+int bus1_buffer_release_by_id(struct bus1_peer_info *peer_info, u64 id);
+void bus1_buffer_flush_all(struct bus1_peer_info *peer_info);
+struct bus1_buffer *bus1_buffer_unref(struct bus1_buffer *buffer);
+
+int bus1_buffer_import_ranges(struct bus1_peer_info *peer_info,
+			      struct bus1_buffer_range *out_ranges,
+			      size_t *out_length,
+			      const struct bus1_buffer_vec __user *vecs,
+			      size_t n_vecs);
+void bus1_buffer_release_ranges(struct bus1_buffer_range *ranges,
+				size_t n_ranges);
+ssize_t bus1_buffer_write_ranges(struct bus1_buffer_range *ranges,
+				 size_t n_ranges,
+				 struct bus1_message *message,
+				 struct bus1_peer_info *peer_info);
+
+#endif /* __BUS1_BUFFER_H */
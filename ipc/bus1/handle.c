@@ -24,7 +24,10 @@
 #include <linux/wait.h>
 #include <uapi/linux/bus1.h>
 #include "handle.h"
+#include "main.h"
+#include "message.h"
 #include "peer.h"
+#include "pool.h"
 #include "queue.h"
 
 /**
@@ -66,6 +69,7 @@ struct bus1_handle {
  *			destruction is committed
  * @list_handles:	linked list of registered handles
  * @completion:		destruction wait-queue
+ * @reply:		reserved reply slice in the pool of the owner, or NULL
  * @owner:		embedded handle of node owner
  */
 struct bus1_node {
@@ -73,6 +77,7 @@ struct bus1_node {
 	u64 timestamp;
 	struct list_head list_handles;
 	struct completion completion;
+	struct bus1_pool_slice *reply;
 	struct bus1_handle owner;
 };
 
@@ -83,6 +88,7 @@ static void bus1_node_free(struct kref *ref)
 	WARN_ON(rcu_access_pointer(node->owner.holder));
 	WARN_ON(!list_empty(&node->list_handles));
 	WARN_ON(node->timestamp & 1);
+	WARN_ON(node->reply);
 	kfree_rcu(node, owner.qnode.rcu);
 }
 
@@ -173,6 +179,7 @@ static struct bus1_handle *bus1_handle_new_owner(u64 id)
 	INIT_LIST_HEAD(&node->list_handles);
 	init_completion(&node->completion);
 	node->timestamp = 0;
+	node->reply = NULL;
 	bus1_handle_init(&node->owner, node);
 
 	/* node->owner owns a reference to the node, drop the initial one */
@@ -525,6 +532,9 @@ static void bus1_node_stage_relock(struct bus1_node *node,
 	node->timestamp = 3;
 	timestamp = 3;
 
+	/* no message can be sent to the node anymore, drop its reservation */
+	node->reply = bus1_pool_release_kernel(&peer_info->pool, node->reply);
+
 	while ((h = list_first_entry_or_null(&node->list_handles,
 					     struct bus1_handle,
 					     link_node))) {
@@ -1062,6 +1072,115 @@ exit:
 	return r;
 }
 
+/**
+ * bus1_handle_allocate() - allocate new nodes
+ * @peer:		peer to allocate nodes on
+ * @ids:		output array for the IDs of the new nodes
+ * @n_ids:		number of nodes to allocate
+ *
+ * This allocates @n_ids new nodes, owned by @peer, and publishes a user
+ * reference to each of them. The nodes are installed in a single locked pass,
+ * rather than one by one as part of a transaction. Their IDs are stored in
+ * @ids.
+ *
+ * Either all nodes are allocated, or none.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int bus1_handle_allocate(struct bus1_peer *peer, u64 *ids, size_t n_ids)
+{
+	struct bus1_peer_info *peer_info = bus1_peer_dereference(peer);
+	struct bus1_handle **handles;
+	size_t i, n;
+	int r;
+
+	handles = kmalloc(n_ids * sizeof(*handles), GFP_TEMPORARY);
+	if (!handles)
+		return -ENOMEM;
+
+	for (n = 0; n < n_ids; ++n) {
+		handles[n] = bus1_handle_new_owner(BUS1_NODE_FLAG_ALLOCATE |
+						   BUS1_NODE_FLAG_MANAGED);
+		if (IS_ERR(handles[n])) {
+			r = PTR_ERR(handles[n]);
+			goto exit;
+		}
+	}
+
+	mutex_lock(&peer_info->lock);
+	for (i = 0; i < n_ids; ++i) {
+		bus1_handle_attach_owner(handles[i], peer);
+		bus1_handle_install_owner(handles[i]);
+		ids[i] = bus1_handle_userref_publish(handles[i], peer_info,
+						     0, true);
+	}
+	mutex_unlock(&peer_info->lock);
+
+	r = 0;
+
+exit:
+	for (i = 0; i < n; ++i)
+		bus1_handle_unref(handles[i]);
+	kfree(handles);
+	return r;
+}
+
+/**
+ * bus1_handle_reserve_reply() - allocate new node with reserved reply slice
+ * @peer:		peer to allocate the node on
+ * @size:		size of the slice to reserve
+ * @idp:		output storage for the ID of the new node
+ *
+ * This allocates a new node, owned by @peer, and publishes a user reference to
+ * it, just like bus1_handle_allocate() does. Additionally, a slice of @size
+ * bytes is allocated in the pool of @peer and tied to the node. The first
+ * message that is sent to the node consumes the slice, see
+ * bus1_handle_dest_take_reply(). If that message is dropped without being
+ * received, the slice is returned to the node, see
+ * bus1_handle_dest_return_reply(). The reservation is released once the node
+ * is destroyed.
+ *
+ * Like message slices, reservations of at least BUS1_MESSAGE_ALIGN_THRESHOLD
+ * bytes are placed at page-aligned offsets, if the pool has room for it.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int bus1_handle_reserve_reply(struct bus1_peer *peer, size_t size, u64 *idp)
+{
+	struct bus1_peer_info *peer_info = bus1_peer_dereference(peer);
+	struct bus1_pool_slice *slice;
+	struct bus1_handle *handle;
+
+	handle = bus1_handle_new_owner(BUS1_NODE_FLAG_ALLOCATE |
+				       BUS1_NODE_FLAG_MANAGED);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+
+	mutex_lock(&peer_info->lock);
+	if (size >= BUS1_MESSAGE_ALIGN_THRESHOLD) {
+		slice = bus1_pool_alloc_aligned(&peer_info->pool, size);
+		if (IS_ERR(slice) && (PTR_ERR(slice) == -EXFULL ||
+				      PTR_ERR(slice) == -EMSGSIZE))
+			slice = bus1_pool_alloc(&peer_info->pool, size);
+	} else {
+		slice = bus1_pool_alloc(&peer_info->pool, size);
+	}
+	if (IS_ERR(slice)) {
+		mutex_unlock(&peer_info->lock);
+		bus1_handle_unref(handle);
+		return PTR_ERR(slice);
+	}
+
+	bus1_handle_attach_owner(handle, peer);
+	bus1_handle_install_owner(handle);
+	handle->node->reply = slice;
+	*idp = bus1_handle_userref_publish(handle, peer_info, 0, true);
+	mutex_unlock(&peer_info->lock);
+
+	bus1_handle_unref(handle);
+	return 0;
+}
+
 /**
  * bus1_handle_release_by_id() - release a user handle
  * @peer_info:		peer to operate on
@@ -1212,6 +1331,237 @@ void bus1_handle_flush_all(struct bus1_peer_info *peer_info)
 	bus1_handle_notify(&list_notify);
 }
 
+static void bus1_handle_set_free(struct kref *ref)
+{
+	struct bus1_handle_set *set = container_of(ref, struct bus1_handle_set,
+						   ref);
+	size_t i;
+
+	WARN_ON(!RB_EMPTY_NODE(&set->rb));
+
+	for (i = 0; i < set->n_entries; ++i)
+		bus1_handle_unref(set->entries[i].handle);
+	kfree(set);
+}
+
+/**
+ * bus1_handle_set_unref() - release destination set reference
+ * @set:		set to release, or NULL
+ *
+ * This drops a reference to a destination set. If it was the last reference,
+ * the pinned handles are released and the set is freed.
+ *
+ * If NULL is passed, this is a no-op.
+ *
+ * Return: NULL is returned.
+ */
+struct bus1_handle_set *bus1_handle_set_unref(struct bus1_handle_set *set)
+{
+	if (set)
+		kref_put(&set->ref, bus1_handle_set_free);
+	return NULL;
+}
+
+/**
+ * bus1_handle_set_register() - register a new destination set
+ * @peer_info:		peer to operate on
+ * @ids:		user-space array of destination handle IDs
+ * @n_ids:		number of IDs in @ids
+ * @idp:		output storage for the ID of the new set
+ *
+ * This resolves all handle IDs in @ids and registers them as a destination
+ * set on @peer_info. Each ID must refer to a handle that is currently owned by
+ * user-space. Node allocations are not allowed.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int bus1_handle_set_register(struct bus1_peer_info *peer_info,
+			     const u64 __user *ids,
+			     size_t n_ids,
+			     u64 *idp)
+{
+	struct bus1_handle_set *set, *iter;
+	struct bus1_handle *handle;
+	struct rb_node *n, **slot;
+	size_t i;
+	u64 id;
+	int r;
+
+	if (n_ids < 1 || n_ids > BUS1_DEST_SET_MAX)
+		return -EMSGSIZE;
+
+	set = kmalloc(sizeof(*set) + n_ids * sizeof(*set->entries),
+		      GFP_KERNEL);
+	if (!set)
+		return -ENOMEM;
+
+	kref_init(&set->ref);
+	RB_CLEAR_NODE(&set->rb);
+	set->id = 0;
+	set->n_entries = 0;
+
+	for (i = 0; i < n_ids; ++i) {
+		if (get_user(id, ids + i)) {
+			r = -EFAULT;
+			goto error;
+		}
+
+		if (id & BUS1_NODE_FLAG_ALLOCATE) {
+			r = -EINVAL;
+			goto error;
+		}
+
+		handle = bus1_handle_find_by_id(peer_info, id);
+		if (!handle) {
+			r = -ENXIO;
+			goto error;
+		}
+
+		set->entries[set->n_entries].handle = handle;
+		set->entries[set->n_entries].id = id;
+		++set->n_entries;
+
+		if (atomic_read(&handle->n_user) < 0) {
+			r = -ENXIO;
+			goto error;
+		}
+	}
+
+	mutex_lock(&peer_info->lock);
+	if (peer_info->n_dest_sets >= BUS1_DEST_SETS_MAX) {
+		mutex_unlock(&peer_info->lock);
+		r = -EDQUOT;
+		goto error;
+	}
+
+	id = ++peer_info->dest_set_ids;
+	set->id = id;
+
+	/* IDs are strictly increasing, so this always links rightmost */
+	n = NULL;
+	slot = &peer_info->map_dest_sets.rb_node;
+	while (*slot) {
+		n = *slot;
+		iter = container_of(n, struct bus1_handle_set, rb);
+		WARN_ON(id == iter->id);
+		if (id < iter->id)
+			slot = &n->rb_left;
+		else /* if (id > iter->id) */
+			slot = &n->rb_right;
+	}
+	rb_link_node(&set->rb, n, slot);
+	rb_insert_color(&set->rb, &peer_info->map_dest_sets);
+	++peer_info->n_dest_sets;
+	mutex_unlock(&peer_info->lock);
+
+	/* the map owns the initial reference now, @set must not be used */
+	*idp = id;
+	return 0;
+
+error:
+	bus1_handle_set_unref(set);
+	return r;
+}
+
+static struct bus1_handle_set *
+bus1_handle_set_lookup(struct bus1_peer_info *peer_info, u64 id)
+{
+	struct bus1_handle_set *set;
+	struct rb_node *n;
+
+	lockdep_assert_held(&peer_info->lock);
+
+	n = peer_info->map_dest_sets.rb_node;
+	while (n) {
+		set = container_of(n, struct bus1_handle_set, rb);
+		if (id == set->id)
+			return set;
+		else if (id < set->id)
+			n = n->rb_left;
+		else /* if (id > set->id) */
+			n = n->rb_right;
+	}
+
+	return NULL;
+}
+
+/**
+ * bus1_handle_set_find_by_id() - find destination set
+ * @peer_info:		peer to operate on
+ * @id:			set ID
+ *
+ * This looks up the destination set with ID @id on @peer_info and acquires a
+ * reference to it. The caller must release it via bus1_handle_set_unref().
+ *
+ * Return: Pointer to the set, or NULL if not found.
+ */
+struct bus1_handle_set *
+bus1_handle_set_find_by_id(struct bus1_peer_info *peer_info, u64 id)
+{
+	struct bus1_handle_set *set;
+
+	mutex_lock(&peer_info->lock);
+	set = bus1_handle_set_lookup(peer_info, id);
+	if (set)
+		kref_get(&set->ref);
+	mutex_unlock(&peer_info->lock);
+
+	return set;
+}
+
+/**
+ * bus1_handle_set_release_by_id() - release destination set
+ * @peer_info:		peer to operate on
+ * @id:			set ID
+ *
+ * This unregisters the destination set with ID @id from @peer_info. Any
+ * transaction that already acquired the set can still finish.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int bus1_handle_set_release_by_id(struct bus1_peer_info *peer_info, u64 id)
+{
+	struct bus1_handle_set *set;
+
+	mutex_lock(&peer_info->lock);
+	set = bus1_handle_set_lookup(peer_info, id);
+	if (set) {
+		rb_erase(&set->rb, &peer_info->map_dest_sets);
+		RB_CLEAR_NODE(&set->rb);
+		--peer_info->n_dest_sets;
+	}
+	mutex_unlock(&peer_info->lock);
+
+	if (!set)
+		return -ENXIO;
+
+	bus1_handle_set_unref(set);
+	return 0;
+}
+
+/**
+ * bus1_handle_set_flush_all() - release all destination sets
+ * @peer_info:		peer to operate on
+ *
+ * This unregisters all destination sets of @peer_info.
+ */
+void bus1_handle_set_flush_all(struct bus1_peer_info *peer_info)
+{
+	struct bus1_handle_set *set, *t;
+	struct rb_root map;
+
+	mutex_lock(&peer_info->lock);
+	map = peer_info->map_dest_sets;
+	peer_info->map_dest_sets = RB_ROOT;
+	peer_info->n_dest_sets = 0;
+	mutex_unlock(&peer_info->lock);
+
+	rbtree_postorder_for_each_entry_safe(set, t, &map, rb) {
+		RB_CLEAR_NODE(&set->rb);
+		bus1_handle_set_unref(set);
+	}
+}
+
 /**
  * bus1_handle_dest_init() - XXX
  */
@@ -1244,6 +1594,45 @@ void bus1_handle_dest_destroy(struct bus1_handle_dest *dest,
 	}
 }
 
+static int bus1_handle_dest_import_existing(struct bus1_handle_dest *dest,
+					    struct bus1_peer_info *peer_info,
+					    struct bus1_handle *handle)
+{
+	struct bus1_peer *dst_peer;
+
+	/*
+	 * Import an existing handle as destination. This consumes the
+	 * reference to @handle passed by the caller.
+	 *
+	 * Check that user-space knows of the handle and owns a reference. This
+	 * looks racy, but we care for none of the races. We just assume that
+	 * at the time we checked for n_user we also atomically acquired the
+	 * inflight reference. The fact that it is not atomic, does not matter.
+	 */
+	if (atomic_read(&handle->n_user) < 0) {
+		bus1_handle_unref(handle);
+		return -ENXIO;
+	}
+
+	rcu_read_lock();
+	dst_peer = rcu_dereference(handle->node->owner.holder);
+	dst_peer = bus1_peer_acquire(dst_peer);
+	rcu_read_unlock();
+
+	if (!dst_peer || !bus1_handle_acquire(handle, peer_info)) {
+		bus1_peer_release(dst_peer);
+		bus1_handle_unref(handle);
+		return -ENXIO;
+	}
+
+	dest->handle = handle;
+	dest->raw_peer = dst_peer;
+	dest->idp = NULL;
+	bus1_active_lockdep_released(&dst_peer->active);
+
+	return 0;
+}
+
 /**
  * bus1_handle_dest_import() - XXX
  */
@@ -1253,7 +1642,6 @@ int bus1_handle_dest_import(struct bus1_handle_dest *dest,
 {
 	struct bus1_peer_info *peer_info = bus1_peer_dereference(peer);
 	struct bus1_handle *handle;
-	struct bus1_peer *dst_peer;
 	u64 id;
 
 	if (WARN_ON(dest->handle || dest->raw_peer || dest->idp))
@@ -1286,36 +1674,51 @@ int bus1_handle_dest_import(struct bus1_handle_dest *dest,
 		if (!handle)
 			return -ENXIO;
 
-		/*
-		 * Check that user-space knows of the handle and owns a
-		 * reference. This looks racy, but we care for none of the
-		 * races. We just assume that at the time we checked for n_user
-		 * we also atomically acquired the inflight reference. The fact
-		 * that it is not atomic, does not matter.
-		 */
-		if (atomic_read(&handle->n_user) < 0) {
-			bus1_handle_unref(handle);
-			return -ENXIO;
-		}
+		return bus1_handle_dest_import_existing(dest, peer_info,
+							handle);
+	}
 
-		rcu_read_lock();
-		dst_peer = rcu_dereference(handle->node->owner.holder);
-		dst_peer = bus1_peer_acquire(dst_peer);
-		rcu_read_unlock();
+	return 0;
+}
 
-		if (!dst_peer || !bus1_handle_acquire(handle, peer_info)) {
-			bus1_peer_release(dst_peer);
-			bus1_handle_unref(handle);
-			return -ENXIO;
-		}
+/**
+ * bus1_handle_dest_import_from_set() - import destination from set
+ * @dest:		destination context to fill in
+ * @peer:		peer the set belongs to
+ * @set:		destination set
+ * @index:		index of the destination in @set
+ *
+ * This is the equivalent of bus1_handle_dest_import() for a handle that was
+ * pre-resolved in a destination set. No ID lookup is performed, but the
+ * handle must still be owned by user-space under the same ID it was
+ * registered with. Otherwise, -ENXIO is returned, exactly as if the ID was
+ * passed directly.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int bus1_handle_dest_import_from_set(struct bus1_handle_dest *dest,
+				     struct bus1_peer *peer,
+				     struct bus1_handle_set *set,
+				     size_t index)
+{
+	struct bus1_handle *handle;
 
-		dest->handle = handle;
-		dest->raw_peer = dst_peer;
-		dest->idp = NULL;
-		bus1_active_lockdep_released(&dst_peer->active);
-	}
+	if (WARN_ON(dest->handle || dest->raw_peer || dest->idp) ||
+	    WARN_ON(index >= set->n_entries))
+		return -ENOTRECOVERABLE;
 
-	return 0;
+	/*
+	 * Non-owner handles get a new ID if they are re-published after
+	 * user-space dropped them. Make sure the set does not silently revive
+	 * a released entry in that case.
+	 */
+	handle = set->entries[index].handle;
+	if (READ_ONCE(handle->id) != set->entries[index].id)
+		return -ENXIO;
+
+	return bus1_handle_dest_import_existing(dest,
+						bus1_peer_dereference(peer),
+						bus1_handle_ref(handle));
 }
 
 /**
@@ -1348,6 +1751,101 @@ u64 bus1_handle_dest_export(struct bus1_handle_dest *dest,
 	return id;
 }
 
+/**
+ * bus1_handle_dest_take_reply() - take reserved reply slice of destination
+ * @dest:		destination context
+ * @peer_info:		destination peer
+ *
+ * If the destination node has a reply slice reserved, ownership of the slice
+ * is transferred to the caller, and the reservation is gone until the caller
+ * returns it via bus1_handle_dest_return_reply(). That is, only a single
+ * message at a time can use the reservation of a node. The caller must hold
+ * the lock of @peer_info, which must be the owner of the destination.
+ *
+ * Return: Reserved slice, or NULL if there is none.
+ */
+struct bus1_pool_slice *
+bus1_handle_dest_take_reply(struct bus1_handle_dest *dest,
+			    struct bus1_peer_info *peer_info)
+{
+	struct bus1_pool_slice *slice;
+
+	lockdep_assert_held(&peer_info->lock);
+
+	if (WARN_ON(!dest->handle))
+		return NULL;
+
+	slice = dest->handle->node->reply;
+	dest->handle->node->reply = NULL;
+	return slice;
+}
+
+static void bus1_node_return_reply(struct bus1_node *node,
+				   struct bus1_peer_info *peer_info,
+				   struct bus1_pool_slice *slice)
+{
+	lockdep_assert_held(&peer_info->lock);
+
+	/*
+	 * Only live nodes can be reserved for. Once destruction is staged,
+	 * bus1_node_stage_relock() already dropped the reservation and no new
+	 * message can be sent to the node, so release the slice instead.
+	 */
+	if (node->timestamp != 1 || node->reply)
+		bus1_pool_release_kernel(&peer_info->pool, slice);
+	else
+		node->reply = slice;
+}
+
+/**
+ * bus1_handle_dest_return_reply() - return reserved reply slice to destination
+ * @dest:		destination context
+ * @peer_info:		destination peer
+ * @slice:		slice taken via bus1_handle_dest_take_reply(), or NULL
+ *
+ * This is the inverse of bus1_handle_dest_take_reply(). If a message took the
+ * reservation of its destination, but is dropped before it is committed, the
+ * slice is re-attached to the node so the next message can use it. If the
+ * node is no longer live, the slice is released. The caller must hold the
+ * lock of @peer_info, which must be the owner of the destination.
+ */
+void bus1_handle_dest_return_reply(struct bus1_handle_dest *dest,
+				   struct bus1_peer_info *peer_info,
+				   struct bus1_pool_slice *slice)
+{
+	if (!slice)
+		return;
+
+	if (WARN_ON(!dest->handle))
+		bus1_pool_release_kernel(&peer_info->pool, slice);
+	else
+		bus1_node_return_reply(dest->handle->node, peer_info, slice);
+}
+
+/**
+ * bus1_handle_return_reply_by_id() - return reserved reply slice to node
+ * @peer_info:		peer to operate on
+ * @id:			handle ID of the owner handle of the node
+ * @slice:		reserved slice to return
+ *
+ * This is like bus1_handle_dest_return_reply(), but for committed messages,
+ * which only know the ID of their destination. If @id does not refer to a
+ * node owned by @peer_info, the slice is released. The caller must hold the
+ * lock of @peer_info.
+ */
+void bus1_handle_return_reply_by_id(struct bus1_peer_info *peer_info, u64 id,
+				    struct bus1_pool_slice *slice)
+{
+	struct bus1_handle *handle;
+
+	handle = bus1_handle_find_by_id(peer_info, id);
+	if (handle && bus1_handle_is_owner(handle))
+		bus1_node_return_reply(handle->node, peer_info, slice);
+	else
+		bus1_pool_release_kernel(&peer_info->pool, slice);
+	bus1_handle_unref(handle);
+}
+
 /*
  * Handle Lists
  *
@@ -1360,9 +1858,48 @@ u64 bus1_handle_dest_export(struct bus1_handle_dest *dest,
  * bus1_handle_list_new() allocates a new list with space for @n entries. Such
  * lists can be released via bus1_handle_list_free().
  *
+ * All list nodes, including a shorter trailing node, are allocated from a
+ * dedicated cache of full-sized nodes. A full node is slightly bigger than a
+ * power of two, so kmalloc() would round each of them up to twice the size.
+ *
  * Entries are initially uninitialized. The caller has to fill them in.
  */
 
+static struct kmem_cache *bus1_handle_list_cache;
+
+/**
+ * bus1_handle_cache_create() - create handle list cache
+ *
+ * This creates the cache all handle list nodes are allocated from. It must be
+ * called once on module initialization.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int bus1_handle_cache_create(void)
+{
+	size_t size;
+
+	size = sizeof(union bus1_handle_entry) * (BUS1_HANDLE_BATCH_SIZE + 1);
+	bus1_handle_list_cache = kmem_cache_create(KBUILD_MODNAME "-handles",
+						   size, 0, 0, NULL);
+	if (!bus1_handle_list_cache)
+		return -ENOMEM;
+
+	return 0;
+}
+
+/**
+ * bus1_handle_cache_destroy() - destroy handle list cache
+ *
+ * This destroys the cache created by bus1_handle_cache_create(). No handle
+ * list must be alive when this is called.
+ */
+void bus1_handle_cache_destroy(void)
+{
+	kmem_cache_destroy(bus1_handle_list_cache);
+	bus1_handle_list_cache = NULL;
+}
+
 static void bus1_handle_list_free(union bus1_handle_entry *list, size_t n)
 {
 	union bus1_handle_entry *t;
@@ -1370,10 +1907,11 @@ static void bus1_handle_list_free(union bus1_handle_entry *list, size_t n)
 	while (list && n > BUS1_HANDLE_BATCH_SIZE) {
 		t = list;
 		list = list[BUS1_HANDLE_BATCH_SIZE].next;
-		kfree(t);
+		kmem_cache_free(bus1_handle_list_cache, t);
 		n -= BUS1_HANDLE_BATCH_SIZE;
 	}
-	kfree(list);
+	if (list)
+		kmem_cache_free(bus1_handle_list_cache, list);
 }
 
 static union bus1_handle_entry *bus1_handle_list_new(size_t n)
@@ -1386,8 +1924,7 @@ static union bus1_handle_entry *bus1_handle_list_new(size_t n)
 	remaining = n;
 
 	while (remaining >= BUS1_HANDLE_BATCH_SIZE) {
-		e = kmalloc(sizeof(*e) * (BUS1_HANDLE_BATCH_SIZE + 1),
-			    GFP_KERNEL);
+		e = kmem_cache_alloc(bus1_handle_list_cache, GFP_KERNEL);
 		if (!e)
 			goto error;
 
@@ -1399,7 +1936,8 @@ static union bus1_handle_entry *bus1_handle_list_new(size_t n)
 	}
 
 	if (remaining > 0) {
-		slot->next = kmalloc(sizeof(*e) * remaining, GFP_KERNEL);
+		slot->next = kmem_cache_alloc(bus1_handle_list_cache,
+					      GFP_KERNEL);
 		if (!slot->next)
 			goto error;
 	}
@@ -1721,12 +2259,17 @@ void bus1_handle_transfer_install(struct bus1_handle_transfer *transfer,
  * @peer_info:		owning peer of @transfer
  * @ids:		user pointer to store IDs to
  * @n_ids:		number of IDs
+ * @move:		whether to release the user references of the caller
  *
  * For every node that is created as part of an handle transfer, we have to
  * publish a single user reference to the node and provide it back to the
  * caller. This function both publishes those user-refs *and* directly copies
  * them over into the user-provided buffers.
  *
+ * If @move is true, a single user reference of the caller is dropped for each
+ * pre-existing handle, as if it was released via bus1_handle_release_by_id()
+ * right after the transfer. Newly created nodes are not affected.
+ *
  * This calls releases all handles after they have been processes. Hence, this
  * must be the last operation on a transfer object, before it is destroyed.
  *
@@ -1737,7 +2280,8 @@ void bus1_handle_transfer_install(struct bus1_handle_transfer *transfer,
 int bus1_handle_transfer_export(struct bus1_handle_transfer *transfer,
 				struct bus1_peer_info *peer_info,
 				u64 __user *ids,
-				size_t n_ids)
+				size_t n_ids,
+				bool move)
 {
 	union bus1_handle_entry *entry;
 	LIST_HEAD(list_notify);
@@ -1751,6 +2295,16 @@ int bus1_handle_transfer_export(struct bus1_handle_transfer *transfer,
 		WARN_ON(!entry->handle);
 		if (entry->handle->id != BUS1_HANDLE_INVALID) {
 			WARN_ON(!bus1_handle_was_attached(entry->handle));
+			/*
+			 * The user-ref can only drop to -1 under the peer
+			 * lock, and we still pin an inflight ref. Hence, the
+			 * release below cannot be the last one.
+			 */
+			if (move && atomic_read(&entry->handle->n_user) >= 0 &&
+			    atomic_dec_return(&entry->handle->n_user) < 0)
+				bus1_handle_release_relock(entry->handle,
+							   peer_info,
+							   &list_notify);
 			bus1_handle_release_relock(entry->handle, peer_info,
 						   &list_notify);
 			entry->handle = bus1_handle_unref(entry->handle);
@@ -1881,21 +2435,109 @@ int bus1_handle_inflight_import(struct bus1_handle_inflight *inflight,
 }
 
 /**
- * bus1_handle_inflight_install() - install inflight handles
+ * bus1_handle_attach_init() - initialize attach context
+ * @attach:		attach context to initialize
+ *
+ * This initializes an attach-context, used to attach the handles of multiple
+ * inflight-contexts in one go. See bus1_handle_inflight_attach() for details.
+ */
+void bus1_handle_attach_init(struct bus1_handle_attach *attach)
+{
+	attach->owner = NULL;
+	attach->owner_info = NULL;
+}
+
+/**
+ * bus1_handle_attach_destroy() - destroy attach context
+ * @attach:		attach context to destroy
+ *
+ * This unlocks the owner that is still locked by @attach, if any. It is safe
+ * to call this multiple times.
+ */
+void bus1_handle_attach_destroy(struct bus1_handle_attach *attach)
+{
+	attach->owner = bus1_handle_unlock_peer(attach->owner,
+						attach->owner_info);
+	attach->owner_info = NULL;
+}
+
+/**
+ * bus1_handle_inflight_attach() - attach inflight handles
  * @inflight:		instantiated inflight context
  * @dst:		peer @inflight is for
+ * @attach:		attach context to use
+ *
+ * After an inflight context was successfully instantiated, this attaches all
+ * its new handles to their nodes, with @dst as holder. Handles whose node was
+ * already destroyed are dropped.
+ *
+ * Attaching a handle requires the owner of its node to be locked. Rather than
+ * locking it for each handle, the last owner stays locked in @attach, and is
+ * re-used as long as consecutive handles share their owner. Usually, all
+ * destinations of a multicast get the same set of nodes transferred, so a
+ * single lock operation per owner covers all of them. Since peer locks must
+ * not be nested, the caller must not hold any peer lock, and must call
+ * bus1_handle_attach_destroy() before locking a peer.
+ *
+ * Once attached, the handles are installed via bus1_handle_inflight_install().
+ */
+void bus1_handle_inflight_attach(struct bus1_handle_inflight *inflight,
+				 struct bus1_peer *dst,
+				 struct bus1_handle_attach *attach)
+{
+	union bus1_handle_entry *e;
+	struct bus1_handle *h;
+	size_t pos, n_attaches;
+	bool locked;
+
+	if (inflight->n_new < 1)
+		return;
+
+	n_attaches = inflight->n_new;
+
+	BUS1_HANDLE_BATCH_FOREACH_HANDLE(e, pos, &inflight->batch) {
+		h = e->handle;
+		if (!h || bus1_handle_was_attached(h))
+			continue;
+
+		/* the owner pointer is stable while it is locked */
+		rcu_read_lock();
+		locked = attach->owner && attach->owner ==
+				rcu_dereference(h->node->owner.holder);
+		rcu_read_unlock();
+
+		if (!locked) {
+			bus1_handle_attach_destroy(attach);
+			attach->owner = bus1_handle_lock_owner(h,
+							&attach->owner_info);
+		}
+
+		if (!attach->owner || !bus1_handle_attach_holder(h, dst)) {
+			e->handle = bus1_handle_unref(h);
+			--inflight->n_new;
+		}
+
+		if (--n_attaches < 1)
+			break;
+	}
+	WARN_ON(n_attaches > 0);
+}
+
+/**
+ * bus1_handle_inflight_install() - install inflight handles
+ * @inflight:		attached inflight context
+ * @dst:		peer @inflight is for
  *
- * After an inflight context was successfully instantiated, this will install
- * the handles into the peer @dst. The caller must provide the used transfer
- * context and the origin peer as @transfer and @src.
+ * After the new handles of an inflight context were attached via
+ * bus1_handle_inflight_attach(), this will install the handles into the peer
+ * @dst. The caller must not hold any peer lock.
  */
 void bus1_handle_inflight_install(struct bus1_handle_inflight *inflight,
 				  struct bus1_peer *dst)
 {
-	struct bus1_peer_info *dst_info, *owner_info;
+	struct bus1_peer_info *dst_info;
 	union bus1_handle_entry *e;
 	struct bus1_handle *h, *t;
-	struct bus1_peer *owner;
 	size_t pos, n_installs;
 	LIST_HEAD(list_notify);
 
@@ -1904,25 +2546,7 @@ void bus1_handle_inflight_install(struct bus1_handle_inflight *inflight,
 
 	dst_info = bus1_peer_dereference(dst);
 	n_installs = inflight->n_new;
-
-	if (inflight->n_new > 0) {
-		BUS1_HANDLE_BATCH_FOREACH_HANDLE(e, pos, &inflight->batch) {
-			h = e->handle;
-			if (!h || bus1_handle_was_attached(h))
-				continue;
-
-			owner = bus1_handle_lock_owner(h, &owner_info);
-			if (!owner || !bus1_handle_attach_holder(h, dst)) {
-				e->handle = bus1_handle_unref(h);
-				--n_installs;
-			}
-			bus1_handle_unlock_peer(owner, owner_info);
-
-			if (--inflight->n_new < 1)
-				break;
-		}
-		WARN_ON(inflight->n_new > 0);
-	}
+	inflight->n_new = 0;
 
 	if (n_installs > 0) {
 		mutex_lock(&dst_info->lock);
@@ -75,11 +75,13 @@
  */
 
 #include <linux/kernel.h>
+#include <linux/kref.h>
 #include <linux/rbtree.h>
 
 struct bus1_handle;
 struct bus1_peer;
 struct bus1_peer_info;
+struct bus1_pool_slice;
 struct bus1_queue_node;
 
 /**
@@ -94,6 +96,34 @@ struct bus1_handle_dest {
 	u64 __user *idp;
 };
 
+/**
+ * struct bus1_handle_set - registered destination set
+ * @ref:		object ref-count
+ * @rb:			link into owning peer, based on ID
+ * @id:			ID of this set
+ * @n_entries:		number of destinations in this set
+ * @entries:		destination handles, and the handle IDs they were
+ *			registered with
+ *
+ * A destination set is a pre-resolved list of destination handles of a peer.
+ * It can be used instead of a list of handle IDs when sending messages, and
+ * thus avoids the ID lookup and validation of each destination on every
+ * transaction. The set only pins the memory of its handles, it neither owns
+ * inflight nor user-visible references. Hence, once user-space releases a
+ * handle, or its node is destroyed, the respective entry becomes invalid and
+ * is treated like an unknown handle ID on SEND.
+ */
+struct bus1_handle_set {
+	struct kref ref;
+	struct rb_node rb;
+	u64 id;
+	size_t n_entries;
+	struct {
+		struct bus1_handle *handle;
+		u64 id;
+	} entries[0];
+};
+
 /**
  * BUS1_HANDLE_BATCH_SIZE - number of handles per set in a batch
  *
@@ -188,7 +218,25 @@ struct bus1_handle_inflight {
 	/* @batch must be last */
 };
 
+/**
+ * struct bus1_handle_attach - handle attach context
+ * @owner:		currently locked owner peer, or NULL
+ * @owner_info:		peer info of @owner
+ *
+ * The bus1_handle_attach object carries the owner peer that is currently
+ * locked while attaching inflight handles. It allows attaching the handles of
+ * all destinations of a transaction, without re-locking the owner of each node
+ * for every single destination.
+ */
+struct bus1_handle_attach {
+	struct bus1_peer *owner;
+	struct bus1_peer_info *owner_info;
+};
+
 /* api */
+int bus1_handle_cache_create(void);
+void bus1_handle_cache_destroy(void);
+
 u64 bus1_handle_from_queue(struct bus1_queue_node *node,
 			   struct bus1_peer_info *peer_info,
 			   bool drop);
@@ -196,10 +244,23 @@ int bus1_handle_pair(struct bus1_peer *clone,
 		     struct bus1_peer *peer,
 		     u64 *node_idp,
 		     u64 *handle_idp);
+int bus1_handle_allocate(struct bus1_peer *peer, u64 *ids, size_t n_ids);
+int bus1_handle_reserve_reply(struct bus1_peer *peer, size_t size, u64 *idp);
 int bus1_handle_release_by_id(struct bus1_peer_info *peer_info, u64 id);
 int bus1_handle_destroy_by_id(struct bus1_peer_info *peer_info, u64 id);
 void bus1_handle_flush_all(struct bus1_peer_info *peer_info);
 
+/* destination sets */
+int bus1_handle_set_register(struct bus1_peer_info *peer_info,
+			     const u64 __user *ids,
+			     size_t n_ids,
+			     u64 *idp);
+int bus1_handle_set_release_by_id(struct bus1_peer_info *peer_info, u64 id);
+void bus1_handle_set_flush_all(struct bus1_peer_info *peer_info);
+struct bus1_handle_set *
+bus1_handle_set_find_by_id(struct bus1_peer_info *peer_info, u64 id);
+struct bus1_handle_set *bus1_handle_set_unref(struct bus1_handle_set *set);
+
 /* destination context */
 void bus1_handle_dest_init(struct bus1_handle_dest *dest);
 void bus1_handle_dest_destroy(struct bus1_handle_dest *dest,
@@ -207,10 +268,22 @@ void bus1_handle_dest_destroy(struct bus1_handle_dest *dest,
 int bus1_handle_dest_import(struct bus1_handle_dest *dest,
 			    struct bus1_peer *peer,
 			    u64 __user *idp);
+int bus1_handle_dest_import_from_set(struct bus1_handle_dest *dest,
+				     struct bus1_peer *peer,
+				     struct bus1_handle_set *set,
+				     size_t index);
 u64 bus1_handle_dest_export(struct bus1_handle_dest *dest,
 			    struct bus1_peer_info *peer_info,
 			    u64 timestamp,
 			    bool commit);
+struct bus1_pool_slice *
+bus1_handle_dest_take_reply(struct bus1_handle_dest *dest,
+			    struct bus1_peer_info *peer_info);
+void bus1_handle_dest_return_reply(struct bus1_handle_dest *dest,
+				   struct bus1_peer_info *peer_info,
+				   struct bus1_pool_slice *slice);
+void bus1_handle_return_reply_by_id(struct bus1_peer_info *peer_info, u64 id,
+				    struct bus1_pool_slice *slice);
 
 /* transfer contexts */
 void bus1_handle_transfer_init(struct bus1_handle_transfer *transfer,
@@ -226,7 +299,8 @@ void bus1_handle_transfer_install(struct bus1_handle_transfer *transfer,
 int bus1_handle_transfer_export(struct bus1_handle_transfer *transfer,
 				struct bus1_peer_info *peer_info,
 				u64 __user *ids,
-				size_t n_ids);
+				size_t n_ids,
+				bool move);
 
 /* inflight tracking */
 void bus1_handle_inflight_init(struct bus1_handle_inflight *inflight,
@@ -236,6 +310,11 @@ void bus1_handle_inflight_destroy(struct bus1_handle_inflight *inflight,
 int bus1_handle_inflight_import(struct bus1_handle_inflight *inflight,
 				struct bus1_peer_info *peer_info,
 				struct bus1_handle_transfer *transfer);
+void bus1_handle_attach_init(struct bus1_handle_attach *attach);
+void bus1_handle_attach_destroy(struct bus1_handle_attach *attach);
+void bus1_handle_inflight_attach(struct bus1_handle_inflight *inflight,
+				 struct bus1_peer *dst,
+				 struct bus1_handle_attach *attach);
 void bus1_handle_inflight_install(struct bus1_handle_inflight *inflight,
 				  struct bus1_peer *dst);
 size_t bus1_handle_inflight_walk(struct bus1_handle_inflight *inflight,
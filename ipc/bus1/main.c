@@ -23,10 +23,14 @@
 #include <linux/slab.h>
 #include <uapi/linux/bus1.h>
 #include "active.h"
+#include "handle.h"
 #include "main.h"
+#include "message.h"
 #include "peer.h"
+#include "pool.h"
 #include "queue.h"
 #include "tests.h"
+#include "transaction.h"
 #include "user.h"
 #include "util.h"
 
@@ -103,6 +107,11 @@ static int bus1_fop_mmap(struct file *file, struct vm_area_struct *vma)
 	if (vma->vm_flags & VM_WRITE) {
 		/* deny write access to the pool */
 		r = -EPERM;
+	} else if (((u64)vma->vm_pgoff << PAGE_SHIFT) >=
+		   BUS1_POOL_SHARES_OFFSET) {
+		/* map view of a shared payload, placed beyond any pool */
+		vma->vm_flags &= ~VM_MAYWRITE;
+		r = bus1_pool_share_mmap(pool, vma);
 	} else {
 		/* replace the connection file with our shmem file */
 		if (vma->vm_file)
@@ -137,6 +146,15 @@ static long bus1_fop_ioctl(struct file *file,
 	case BUS1_CMD_SLICE_RELEASE:
 	case BUS1_CMD_SEND:
 	case BUS1_CMD_RECV:
+	case BUS1_CMD_DEST_SET_REGISTER:
+	case BUS1_CMD_DEST_SET_RELEASE:
+	case BUS1_CMD_BUFFER_REGISTER:
+	case BUS1_CMD_BUFFER_RELEASE:
+	case BUS1_CMD_PEER_SET_REGISTER:
+	case BUS1_CMD_PEER_SET_RELEASE:
+	case BUS1_CMD_BATCH:
+	case BUS1_CMD_NODE_ALLOCATE:
+	case BUS1_CMD_REPLY_RESERVE:
 		if (bus1_active_is_new(&peer->active))
 			return -ENOTCONN;
 		if (!bus1_peer_acquire(peer))
@@ -173,14 +191,34 @@ static int __init bus1_init(void)
 {
 	int r;
 
+	r = bus1_handle_cache_create();
+	if (r < 0)
+		return r;
+
+	r = bus1_message_cache_create();
+	if (r < 0)
+		goto error_handle;
+
+	r = bus1_transaction_cache_create();
+	if (r < 0)
+		goto error_message;
+
 	bus1_tests_run();
 
 	r = misc_register(&bus1_misc);
 	if (r < 0)
-		return r;
+		goto error_transaction;
 
 	pr_info("initialized\n");
 	return 0;
+
+error_transaction:
+	bus1_transaction_cache_destroy();
+error_message:
+	bus1_message_cache_destroy();
+error_handle:
+	bus1_handle_cache_destroy();
+	return r;
 }
 
 static void __exit bus1_exit(void)
@@ -189,6 +227,9 @@ static void __exit bus1_exit(void)
 	WARN_ON(!idr_is_empty(&bus1_user_idr));
 
 	misc_deregister(&bus1_misc);
+	bus1_transaction_cache_destroy();
+	bus1_message_cache_destroy();
+	bus1_handle_cache_destroy();
 	ida_destroy(&bus1_user_ida);
 	idr_destroy(&bus1_user_idr);
 }
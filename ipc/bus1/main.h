@@ -106,6 +106,34 @@
  */
 #define BUS1_FDS_MAX (65535)
 
+/**
+ * BUS1_DEST_SETS_MAX - per-peer limit for registered destination sets
+ *
+ * This defines the limit on how many destination sets a single peer can have
+ * registered at a time. Each set pins up to BUS1_DEST_SET_MAX handles of its
+ * peer. Sets are local to a peer and are released with it, so this is merely
+ * a safety net against unbounded kernel memory consumption.
+ */
+#define BUS1_DEST_SETS_MAX (256)
+
+/**
+ * BUS1_PEER_SETS_MAX - per-peer limit for registered peer sets
+ *
+ * This defines the limit on how many peer sets a single peer can have
+ * registered at a time. Each set references up to BUS1_PEER_SET_MAX peers,
+ * but pins neither of them, so this only bounds kernel memory consumption.
+ */
+#define BUS1_PEER_SETS_MAX (256)
+
+/**
+ * BUS1_BUFFERS_MAX - per-peer limit for registered send buffers
+ *
+ * This defines the limit on how many send buffers a single peer can have
+ * registered at a time. The pinned memory itself is charged on the pinned_vm
+ * of the registering process, this limit merely bounds the lookup structures.
+ */
+#define BUS1_BUFFERS_MAX (256)
+
 extern const struct file_operations bus1_fops;
 
 #endif /* __BUS1_MAIN_H */
@@ -8,18 +8,79 @@
  */
 
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+#include <linux/blk_types.h>
 #include <linux/err.h>
 #include <linux/file.h>
 #include <linux/fs.h>
 #include <linux/kernel.h>
+#include <linux/rbtree.h>
 #include <linux/slab.h>
+#include <linux/uio.h>
 #include "handle.h"
 #include "message.h"
 #include "peer.h"
 #include "pool.h"
 #include "queue.h"
+#include "share.h"
 #include "user.h"
 
+/*
+ * Messages with few handles and files are allocated from a dedicated cache.
+ * The only lockless reader of queued messages is bus1_queue_is_readable(),
+ * which merely tests the queue front for NULL via rcu_access_pointer(), and
+ * never dereferences it. Hence, a freed message can be reused right away. The
+ * cache is still created with SLAB_DESTROY_BY_RCU, so the memory behind the
+ * rcu-protected front pointer stays a message until a grace period elapsed,
+ * without an rcu callback for each message. Bigger messages are allocated
+ * via kmalloc() and freed rcu-delayed.
+ */
+#define BUS1_MESSAGE_CACHE_HANDLES (8)
+#define BUS1_MESSAGE_CACHE_FILES (8)
+
+static struct kmem_cache *bus1_message_cache;
+
+static bool bus1_message_is_cached(size_t n_handles, size_t n_files)
+{
+	return n_handles <= BUS1_MESSAGE_CACHE_HANDLES &&
+	       n_files <= BUS1_MESSAGE_CACHE_FILES;
+}
+
+/**
+ * bus1_message_cache_create() - create message cache
+ *
+ * This creates the cache small messages are allocated from. It must be called
+ * once on module initialization.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int bus1_message_cache_create(void)
+{
+	size_t size;
+
+	size = bus1_message_base_size(BUS1_MESSAGE_CACHE_HANDLES) +
+	       BUS1_MESSAGE_CACHE_FILES * sizeof(struct file *);
+
+	bus1_message_cache = kmem_cache_create(KBUILD_MODNAME "-message",
+					       size, 0, SLAB_DESTROY_BY_RCU,
+					       NULL);
+	if (!bus1_message_cache)
+		return -ENOMEM;
+
+	return 0;
+}
+
+/**
+ * bus1_message_cache_destroy() - destroy message cache
+ *
+ * This destroys the cache created by bus1_message_cache_create(). No message
+ * must be alive when this is called.
+ */
+void bus1_message_cache_destroy(void)
+{
+	kmem_cache_destroy(bus1_message_cache);
+	bus1_message_cache = NULL;
+}
+
 /**
  * bus1_message_new() - allocate new message
  * @n_bytes:		number of bytes to transmit
@@ -42,34 +103,48 @@ struct bus1_message *bus1_message_new(size_t n_bytes,
 	struct bus1_message *message;
 	size_t base_size, fds_size;
 
-	base_size = ALIGN(sizeof(*message) +
-			  bus1_handle_batch_inline_size(n_handles), 8);
+	/* make sure the compact counters cannot overflow */
+	BUILD_BUG_ON(BUS1_FD_MAX > U16_MAX);
+	BUILD_BUG_ON(BUS1_SLICES_MAX > U16_MAX);
+
+	base_size = bus1_message_base_size(n_handles);
 	fds_size = n_files * sizeof(struct file *);
 
-	message = kmalloc(base_size + fds_size, GFP_KERNEL);
+	if (bus1_message_is_cached(n_handles, n_files))
+		message = kmem_cache_alloc(bus1_message_cache, GFP_KERNEL);
+	else
+		message = kmalloc(base_size + fds_size, GFP_KERNEL);
 	if (!message)
 		return ERR_PTR(-ENOMEM);
 
 	bus1_queue_node_init(&message->qnode,
 			     silent ? BUS1_QUEUE_NODE_MESSAGE_SILENT :
 				      BUS1_QUEUE_NODE_MESSAGE_NORMAL);
-	message->data.destination = 0;
-	message->data.uid = -1;
-	message->data.gid = -1;
-	message->data.pid = 0;
-	message->data.tid = 0;
-	message->data.offset = BUS1_OFFSET_INVALID;
-	message->data.n_bytes = n_bytes;
-	message->data.n_handles = n_handles;
-	message->data.n_fds = n_files;
-	message->transaction.next = NULL;
-	message->transaction.dest.handle = NULL;
-	message->transaction.dest.raw_peer = NULL;
+	message->next = NULL;
+	RB_CLEAR_NODE(&message->rb_coalesce);
+	RB_CLEAR_NODE(&message->rb_deadline);
+	message->coalesce.sender = 0;
+	message->coalesce.key = 0;
+	message->deadline = 0;
+	message->destination = 0;
+	message->n_bytes = n_bytes;
+	message->n_handles = n_handles;
+	message->uid = -1;
+	message->gid = -1;
+	message->pid = 0;
+	message->tid = 0;
+	message->n_files = n_files;
+	message->n_slices = 0;
+	message->page_aligned = false;
+	message->reserved = false;
 	message->user = NULL;
 	message->slice = NULL;
-	message->files = (void *)((u8 *)message + base_size);
+	message->slices = NULL;
+	message->share = NULL;
+	message->pull = false;
+	message->view = NULL;
 	bus1_handle_inflight_init(&message->handles, n_handles);
-	memset(message->files, 0, n_files * sizeof(*message->files));
+	memset(bus1_message_files(message), 0, n_files * sizeof(struct file *));
 
 	return message;
 }
@@ -89,43 +164,250 @@ struct bus1_message *bus1_message_new(size_t n_bytes,
 struct bus1_message *bus1_message_free(struct bus1_message *message,
 				       struct bus1_peer_info *peer_info)
 {
+	struct file **files;
 	size_t i;
 
 	if (!message)
 		return NULL;
 
 	WARN_ON(message->slice);
+	WARN_ON(message->slices);
+	WARN_ON(message->view);
+	WARN_ON(!RB_EMPTY_NODE(&message->rb_coalesce));
+	WARN_ON(!RB_EMPTY_NODE(&message->rb_deadline));
 	WARN_ON(message->user);
-	WARN_ON(message->transaction.dest.raw_peer);
-	WARN_ON(message->transaction.dest.handle);
-	WARN_ON(message->transaction.next);
+	WARN_ON(message->next);
 
-	for (i = 0; i < message->data.n_fds; ++i)
-		if (message->files[i])
-			fput(message->files[i]);
+	files = bus1_message_files(message);
+	for (i = 0; i < message->n_files; ++i)
+		if (files[i])
+			fput(files[i]);
 
+	bus1_share_unref(message->share);
 	bus1_handle_inflight_destroy(&message->handles, peer_info);
 	bus1_queue_node_destroy(&message->qnode);
-	kfree_rcu(message, qnode.rcu);
+
+	if (bus1_message_is_cached(message->n_handles,
+				   message->n_files))
+		kmem_cache_free(bus1_message_cache, message);
+	else
+		kfree_rcu(message, qnode.rcu);
 
 	return NULL;
 }
 
+static size_t bus1_message_head_size(struct bus1_message *message)
+{
+	/*
+	 * Scattered messages carry the slice list in place of the payload.
+	 * Shared messages carry a single entry, describing their view.
+	 */
+	if (message->n_slices > 0)
+		return message->n_slices * sizeof(struct bus1_msg_slice);
+
+	return ALIGN(message->n_bytes, 8);
+}
+
+static size_t bus1_message_slice_size(struct bus1_message *message)
+{
+	/* cannot overflow as all of those are limited */
+	return bus1_message_head_size(message) +
+	       ALIGN(message->n_handles * sizeof(u64), 8) +
+	       ALIGN(message->n_files * sizeof(int), 8);
+}
+
+static void bus1_message_release_slices(struct bus1_peer_info *peer_info,
+					struct bus1_pool_slice **slices,
+					size_t n_slices)
+{
+	while (n_slices > 0)
+		bus1_pool_release_kernel(&peer_info->pool, slices[--n_slices]);
+	kfree(slices);
+}
+
+static struct bus1_pool_slice *
+bus1_message_allocate_scattered(struct bus1_message *message,
+				struct bus1_peer_info *peer_info)
+{
+	struct bus1_pool_slice **slices, *slice = NULL;
+	struct bus1_msg_slice *entries;
+	size_t i, n_slices = 0, n_bytes;
+	struct kvec vec;
+	int r;
+
+	slices = kmalloc(BUS1_SLICES_MAX * sizeof(*slices), GFP_KERNEL);
+	if (!slices)
+		return ERR_PTR(-ENOMEM);
+
+	/*
+	 * Allocate the main slice first, so the payload slices cannot use up
+	 * the space it needs. The final number of payload slices is not known
+	 * yet, hence, it is provisionally sized for the maximum.
+	 */
+	message->n_slices = BUS1_SLICES_MAX;
+	slice = bus1_pool_alloc(&peer_info->pool,
+				bus1_message_slice_size(message));
+	message->n_slices = 0;
+	if (IS_ERR(slice)) {
+		r = PTR_ERR(slice);
+		slice = NULL;
+		goto error;
+	}
+
+	/*
+	 * Fill the largest holes first, so a message is spread across as few
+	 * slices as possible. If the payload does not fit into the maximum
+	 * number of slices, we give up just like for contiguous messages.
+	 */
+	for (n_bytes = message->n_bytes; n_bytes > 0; ) {
+		if (n_slices >= BUS1_SLICES_MAX) {
+			r = -EXFULL;
+			goto error;
+		}
+
+		slices[n_slices] = bus1_pool_alloc_partial(&peer_info->pool,
+							   n_bytes);
+		if (IS_ERR(slices[n_slices])) {
+			r = PTR_ERR(slices[n_slices]);
+			goto error;
+		}
+
+		n_bytes -= min_t(size_t, n_bytes, slices[n_slices++]->size);
+	}
+
+	/*
+	 * Now that the payload slices are chosen, trade the provisional main
+	 * slice for one of the final size. The space released is at least as
+	 * big, so this can only fail if a new slice object is needed but
+	 * cannot be allocated.
+	 */
+	message->n_slices = n_slices;
+	bus1_pool_release_kernel(&peer_info->pool, slice);
+	slice = bus1_pool_alloc(&peer_info->pool,
+				bus1_message_slice_size(message));
+	if (IS_ERR(slice)) {
+		r = PTR_ERR(slice);
+		slice = NULL;
+		goto error;
+	}
+
+	entries = kmalloc(n_slices * sizeof(*entries), GFP_TEMPORARY);
+	if (!entries) {
+		r = -ENOMEM;
+		goto error;
+	}
+
+	for (i = 0, n_bytes = message->n_bytes; i < n_slices; ++i) {
+		entries[i].offset = slices[i]->offset;
+		entries[i].n_bytes = min_t(size_t, n_bytes, slices[i]->size);
+		n_bytes -= entries[i].n_bytes;
+	}
+
+	vec.iov_base = entries;
+	vec.iov_len = n_slices * sizeof(*entries);
+
+	r = bus1_pool_write_kvec(&peer_info->pool, slice, 0, &vec, 1,
+				 vec.iov_len);
+	kfree(entries);
+	if (r < 0)
+		goto error;
+
+	message->slices = slices;
+	return slice;
+
+error:
+	if (slice)
+		bus1_pool_release_kernel(&peer_info->pool, slice);
+	bus1_message_release_slices(peer_info, slices, n_slices);
+	message->n_slices = 0;
+	return ERR_PTR(r);
+}
+
+static struct bus1_pool_slice *
+bus1_message_allocate_shared(struct bus1_message *message,
+			     struct bus1_peer_info *peer_info)
+{
+	struct bus1_pool_share *view = NULL;
+	struct bus1_pool_slice *slice;
+	struct bus1_msg_slice entry;
+	struct kvec vec;
+	int r;
+
+	message->n_slices = 1;
+	slice = bus1_pool_alloc(&peer_info->pool,
+				bus1_message_slice_size(message));
+	if (IS_ERR(slice)) {
+		r = PTR_ERR(slice);
+		slice = NULL;
+		goto error;
+	}
+
+	view = bus1_pool_share_link(&peer_info->pool, message->share);
+	if (IS_ERR(view)) {
+		r = PTR_ERR(view);
+		view = NULL;
+		goto error;
+	}
+
+	entry.offset = view->offset;
+	entry.n_bytes = message->n_bytes;
+	vec.iov_base = &entry;
+	vec.iov_len = sizeof(entry);
+
+	r = bus1_pool_write_kvec(&peer_info->pool, slice, 0, &vec, 1,
+				 vec.iov_len);
+	if (r < 0)
+		goto error;
+
+	message->view = view;
+	return slice;
+
+error:
+	bus1_pool_share_release_kernel(&peer_info->pool, view);
+	bus1_pool_release_kernel(&peer_info->pool, slice);
+	message->n_slices = 0;
+	return ERR_PTR(r);
+}
+
 /**
  * bus1_message_allocate() - allocate pool slice for message payload
  * @message:		message to allocate slice for
  * @peer_info:		destination peer
  * @user:		user to account in-flight resources on
+ * @reply:		reserved reply slice to consume, or NULL
  *
  * Allocate a pool slice for the given message, and charge the quota of the
  * given user for all the associated in-flight resources. The peer_info lock
  * must be held by the caller.
  *
+ * If @reply is given, and the message fits into it and does not carry a
+ * shared payload, @reply is used as message slice, rather than allocating a
+ * new one, and message->reserved is set. Its payload is not charged on the
+ * quota, as user-space of @peer_info set the memory aside for it. Otherwise,
+ * the message is allocated as usual, and the caller retains ownership of
+ * @reply, so it can return it to its node.
+ *
+ * Large payloads, and payloads sent with BUS1_SEND_FLAG_PAGE_ALIGNED, are
+ * placed at page-aligned offsets, and the slice covers whole pages.
+ *
+ * If no single free slice is big enough to hold the message, but the
+ * destination opted into BUS1_PEER_FLAG_SCATTER, the payload is spread across
+ * multiple slices instead. In that case, the main slice carries an array of
+ * struct bus1_msg_slice in place of the payload, describing the scattered
+ * slices in order.
+ *
+ * If the message carries a shared payload, the payload is not copied into the
+ * pool at all. Instead, a view of the shared payload is linked into the pool,
+ * and the main slice carries a single struct bus1_msg_slice describing it.
+ * Pulled payloads are allocated like any other, but only copied into the pool
+ * by bus1_message_pull().
+ *
  * Return: 0 on success, negative error code on failure.
  */
 int bus1_message_allocate(struct bus1_message *message,
 			  struct bus1_peer_info *peer_info,
-			  struct bus1_user *user)
+			  struct bus1_user *user,
+			  struct bus1_pool_slice *reply)
 {
 	struct bus1_pool_slice *slice;
 	size_t slice_size;
@@ -136,30 +418,54 @@ int bus1_message_allocate(struct bus1_message *message,
 	if (WARN_ON(message->user || message->slice))
 		return -ENOTRECOVERABLE;
 
+	slice_size = bus1_message_slice_size(message);
+	if (reply && (reply->size < slice_size ||
+		      (message->share && !message->pull)))
+		reply = NULL;
+	message->reserved = !!reply;
+
 	r = bus1_user_quota_charge(peer_info, user,
-				   message->data.n_bytes,
-				   message->data.n_handles,
-				   message->data.n_fds);
-	if (r < 0)
+				   message->reserved ? 0 : message->n_bytes,
+				   message->n_handles,
+				   message->n_files);
+	if (r < 0) {
+		message->reserved = false;
 		return r;
+	}
 
-	/* cannot overflow as all of those are limited */
-	slice_size = ALIGN(message->data.n_bytes, 8) +
-		     ALIGN(message->data.n_handles * sizeof(u64), 8) +
-		     ALIGN(message->data.n_fds + sizeof(int), 8);
-
-	slice = bus1_pool_alloc(&peer_info->pool, slice_size);
+	if (reply) {
+		slice = reply;
+	} else if (message->share && !message->pull) {
+		slice = bus1_message_allocate_shared(message, peer_info);
+	} else if (message->page_aligned ||
+		   message->n_bytes >= BUS1_MESSAGE_ALIGN_THRESHOLD) {
+		slice = bus1_pool_alloc_aligned(&peer_info->pool, slice_size);
+		/*
+		 * Implicit alignment is only a hint. If there is no aligned
+		 * hole left, or rounding up to full pages exceeds the slice
+		 * limit, fall back to an unaligned slice. Only an explicit
+		 * BUS1_SEND_FLAG_PAGE_ALIGNED fails the allocation.
+		 */
+		if (!message->page_aligned && IS_ERR(slice) &&
+		    (PTR_ERR(slice) == -EXFULL || PTR_ERR(slice) == -EMSGSIZE))
+			slice = bus1_pool_alloc(&peer_info->pool, slice_size);
+	} else {
+		slice = bus1_pool_alloc(&peer_info->pool, slice_size);
+	}
+	if (IS_ERR(slice) && PTR_ERR(slice) == -EXFULL &&
+	    (peer_info->flags & BUS1_PEER_FLAG_SCATTER) &&
+	    message->n_bytes > 0 && (!message->share || message->pull))
+		slice = bus1_message_allocate_scattered(message, peer_info);
 	if (IS_ERR(slice)) {
 		bus1_user_quota_discharge(peer_info, user,
-					  message->data.n_bytes,
-					  message->data.n_handles,
-					  message->data.n_fds);
+					  message->n_bytes,
+					  message->n_handles,
+					  message->n_files);
 		return PTR_ERR(slice);
 	}
 
 	message->user = bus1_user_ref(user);
 	message->slice = slice;
-	message->data.offset = slice->offset;
 	return 0;
 }
 
@@ -169,32 +475,286 @@ int bus1_message_allocate(struct bus1_message *message,
  * @peer_info:		destination peer
  *
  * If allocated, deallocate the slice for the given peer and discharge the
- * associated user quota. The peer_info lock must be held by the caller.
+ * associated user quota. If linked, the message is also unlinked from the
+ * coalescing map of the peer. The peer_info lock must be held by the caller.
+ *
+ * If the message was committed into a reserved reply slice, but the slice was
+ * never published to user-space (e.g., the message expired or was coalesced),
+ * the reservation is returned to the destination node, rather than released.
  */
 void bus1_message_deallocate(struct bus1_message *message,
 			     struct bus1_peer_info *peer_info)
 {
+	size_t n_bytes;
+
 	lockdep_assert_held(&peer_info->lock);
 
-	if (message->slice) {
+	if (!RB_EMPTY_NODE(&message->rb_coalesce)) {
+		rb_erase(&message->rb_coalesce, &peer_info->map_coalesce);
+		RB_CLEAR_NODE(&message->rb_coalesce);
+	}
+
+	if (!RB_EMPTY_NODE(&message->rb_deadline)) {
+		rb_erase(&message->rb_deadline, &peer_info->map_deadlines);
+		RB_CLEAR_NODE(&message->rb_deadline);
+	}
+
+	if (message->user) {
+		n_bytes = message->reserved ? 0 : message->n_bytes;
 		bus1_user_quota_discharge(peer_info, message->user,
-					  message->data.n_bytes,
-					  message->data.n_handles,
-					  message->data.n_fds);
-		message->slice = bus1_pool_release_kernel(&peer_info->pool,
-							  message->slice);
+					  n_bytes,
+					  message->n_handles,
+					  message->n_files);
+	}
+
+	if (message->slice && message->reserved && message->destination &&
+	    !message->slice->ref_user) {
+		bus1_handle_return_reply_by_id(peer_info, message->destination,
+					       message->slice);
+		message->slice = NULL;
 	}
 
+	message->slice = bus1_pool_release_kernel(&peer_info->pool,
+						  message->slice);
+
+	if (message->slices) {
+		bus1_message_release_slices(peer_info, message->slices,
+					    message->n_slices);
+		message->slices = NULL;
+	}
+
+	message->view = bus1_pool_share_release_kernel(&peer_info->pool,
+						       message->view);
+
 	message->user = bus1_user_unref(message->user);
 }
 
+/**
+ * bus1_message_link_deadline() - link message into deadline map
+ * @message:		message to link
+ * @peer_info:		destination peer
+ *
+ * If @message has a deadline, this links it into the deadline map of
+ * @peer_info, so the reaper finds the messages that expire next without
+ * scanning the queue. Only committed messages are linked, and the link is
+ * dropped again by bus1_message_deallocate().
+ *
+ * The peer_info lock must be held by the caller.
+ */
+void bus1_message_link_deadline(struct bus1_message *message,
+				struct bus1_peer_info *peer_info)
+{
+	struct rb_node **n, *prev = NULL;
+	struct bus1_message *m;
+
+	lockdep_assert_held(&peer_info->lock);
+
+	if (!message->deadline)
+		return;
+
+	n = &peer_info->map_deadlines.rb_node;
+	while (*n) {
+		prev = *n;
+		m = container_of(prev, struct bus1_message, rb_deadline);
+		if (message->deadline < m->deadline)
+			n = &prev->rb_left;
+		else
+			n = &prev->rb_right;
+	}
+
+	rb_link_node(&message->rb_deadline, prev, n);
+	rb_insert_color(&message->rb_deadline, &peer_info->map_deadlines);
+}
+
+/**
+ * bus1_message_coalesce() - replace queued message with the same key
+ * @message:		message to link
+ * @peer_info:		destination peer
+ *
+ * If @message was sent with a coalescing key, this links it into the
+ * coalescing map of @peer_info. If a queued message of the same sender with
+ * the same key is already linked, it is removed from the queue, deallocated
+ * and returned to the caller, which must free it via bus1_message_free()
+ * once the peer_info lock is dropped. Only committed messages are ever
+ * linked, so a sender cannot replace a message the receiver might not have
+ * seen in order, yet.
+ *
+ * The peer_info lock must be held by the caller.
+ *
+ * Return: Replaced message, or NULL.
+ */
+struct bus1_message *bus1_message_coalesce(struct bus1_message *message,
+					   struct bus1_peer_info *peer_info)
+{
+	struct rb_node **n, *prev = NULL;
+	struct bus1_message *m;
+
+	lockdep_assert_held(&peer_info->lock);
+
+	if (!message->coalesce.sender)
+		return NULL;
+
+	n = &peer_info->map_coalesce.rb_node;
+	while (*n) {
+		prev = *n;
+		m = container_of(prev, struct bus1_message, rb_coalesce);
+		if (message->coalesce.sender < m->coalesce.sender) {
+			n = &prev->rb_left;
+		} else if (message->coalesce.sender > m->coalesce.sender) {
+			n = &prev->rb_right;
+		} else if (message->coalesce.key < m->coalesce.key) {
+			n = &prev->rb_left;
+		} else if (message->coalesce.key > m->coalesce.key) {
+			n = &prev->rb_right;
+		} else {
+			rb_replace_node(&m->rb_coalesce, &message->rb_coalesce,
+					&peer_info->map_coalesce);
+			RB_CLEAR_NODE(&m->rb_coalesce);
+			bus1_queue_remove(&peer_info->queue, &m->qnode);
+			bus1_message_deallocate(m, peer_info);
+			return m;
+		}
+	}
+
+	rb_link_node(&message->rb_coalesce, prev, n);
+	rb_insert_color(&message->rb_coalesce, &peer_info->map_coalesce);
+	return NULL;
+}
+
+/**
+ * bus1_message_publish() - publish pool slices of a message
+ * @message:		message to publish
+ * @peer_info:		destination peer
+ *
+ * This publishes the slice of @message, and all its scattered payload slices
+ * or its view of a shared payload, to user-space. Each of them must be
+ * released by user-space separately. The peer_info lock must be held by the
+ * caller.
+ */
+void bus1_message_publish(struct bus1_message *message,
+			  struct bus1_peer_info *peer_info)
+{
+	size_t i;
+
+	lockdep_assert_held(&peer_info->lock);
+
+	bus1_pool_publish(&peer_info->pool, message->slice);
+	for (i = 0; message->slices && i < message->n_slices; ++i)
+		bus1_pool_publish(&peer_info->pool, message->slices[i]);
+	if (message->view)
+		bus1_pool_share_publish(&peer_info->pool, message->view);
+}
+
+/**
+ * bus1_message_write() - copy payload into a message
+ * @message:		message to write to
+ * @peer_info:		destination peer
+ * @offset:		offset into the payload
+ * @iter:		iterator to copy data from
+ *
+ * This copies the remaining data of @iter into the payload of @message,
+ * starting at @offset bytes into the payload. If the message is scattered, the
+ * data is spread across the payload slices as needed. The caller must have
+ * allocated the message via bus1_message_allocate() before.
+ *
+ * Return: Number of bytes copied, negative error code on failure.
+ */
+ssize_t bus1_message_write(struct bus1_message *message,
+			   struct bus1_peer_info *peer_info,
+			   size_t offset,
+			   struct iov_iter *iter)
+{
+	struct bus1_pool_slice *slice;
+	size_t i, len, total = 0;
+	ssize_t r;
+
+	if (WARN_ON(!message->slice) ||
+	    WARN_ON(offset + iov_iter_count(iter) < offset) ||
+	    WARN_ON(offset + iov_iter_count(iter) > message->n_bytes))
+		return -EFAULT;
+
+	if (!message->slices)
+		return bus1_pool_write_iter(&peer_info->pool, message->slice,
+					    offset, iter,
+					    iov_iter_count(iter));
+
+	for (i = 0; i < message->n_slices && iov_iter_count(iter); ++i) {
+		slice = message->slices[i];
+		if (offset >= slice->size) {
+			offset -= slice->size;
+			continue;
+		}
+
+		len = min_t(size_t, slice->size - offset, iov_iter_count(iter));
+		r = bus1_pool_write_iter(&peer_info->pool, slice, offset,
+					 iter, len);
+		if (r < 0)
+			return r;
+
+		total += r;
+		offset = 0;
+	}
+
+	return total;
+}
+
+/**
+ * bus1_message_pull() - copy staged payload into the pool
+ * @message:		message to operate on
+ * @peer_info:		destination peer
+ *
+ * If @message was sent with BUS1_SEND_FLAG_PULL, its payload was copied only
+ * once by the sender, into a staged, kernel-owned copy. This copies it into
+ * the slice of @message and drops the reference to the staged copy. It is
+ * freed once the last destination pulled or dropped its message. The
+ * peer_info lock must be held by the caller.
+ *
+ * This is a no-op if there is nothing to pull.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int bus1_message_pull(struct bus1_message *message,
+		      struct bus1_peer_info *peer_info)
+{
+	struct bus1_share *share = message->share;
+	struct iov_iter iter;
+	struct bio_vec bvec;
+	size_t i, n_bytes;
+	ssize_t r;
+
+	lockdep_assert_held(&peer_info->lock);
+
+	if (!message->pull)
+		return 0;
+	if (WARN_ON(!message->slice))
+		return -ENOTRECOVERABLE;
+
+	for (i = 0; i < share->n_pages; ++i) {
+		n_bytes = min_t(size_t, share->n_bytes - i * PAGE_SIZE,
+				PAGE_SIZE);
+		bvec.bv_page = share->pages[i];
+		bvec.bv_len = n_bytes;
+		bvec.bv_offset = 0;
+		iov_iter_bvec(&iter, WRITE | ITER_BVEC, &bvec, 1, n_bytes);
+
+		r = bus1_message_write(message, peer_info, i * PAGE_SIZE,
+				       &iter);
+		if (r < 0)
+			return r;
+	}
+
+	message->share = bus1_share_unref(message->share);
+	message->pull = false;
+	return 0;
+}
+
 /**
  * bus1_message_install() - install message payload into target process
  * @message:		message to operate on
  * @peer_info:		calling peer
  *
  * This installs the payload FDs and handles of @message into @peer_info and
- * the calling process.
+ * the calling process. A pulled payload is copied into the pool first.
  *
  * Return: 0 on success, negative error code on failure.
  */
@@ -204,6 +764,7 @@ int bus1_message_install(struct bus1_message *message,
 	size_t n, pos, offset, n_fds = 0, n_ids = 0;
 	u64 ts, *ids = NULL;
 	int r, *fds = NULL;
+	struct file **files;
 	struct kvec vec;
 	void *iter;
 
@@ -211,7 +772,12 @@ int bus1_message_install(struct bus1_message *message,
 
 	if (WARN_ON(!message->slice))
 		return -ENOTRECOVERABLE;
-	if (message->data.n_handles == 0 && message->data.n_fds == 0)
+
+	r = bus1_message_pull(message, peer_info);
+	if (r < 0)
+		return r;
+
+	if (message->n_handles == 0 && message->n_files == 0)
 		return 0;
 
 	/*
@@ -225,8 +791,8 @@ int bus1_message_install(struct bus1_message *message,
 	 * the temporary slot we reserved.
 	 */
 
-	if (message->data.n_handles > 0) {
-		n_ids = min_t(size_t, message->data.n_handles,
+	if (message->n_handles > 0) {
+		n_ids = min_t(size_t, message->n_handles,
 				      BUS1_HANDLE_BATCH_SIZE);
 		ids = kmalloc(n_ids * sizeof(*ids), GFP_TEMPORARY);
 		if (!ids) {
@@ -235,7 +801,7 @@ int bus1_message_install(struct bus1_message *message,
 		}
 
 		ts = bus1_queue_node_get_timestamp(&message->qnode);
-		offset = ALIGN(message->data.n_bytes, 8);
+		offset = bus1_message_head_size(message);
 		pos = 0;
 
 		while ((n = bus1_handle_inflight_walk(&message->handles,
@@ -256,15 +822,15 @@ int bus1_message_install(struct bus1_message *message,
 		}
 	}
 
-	if (message->data.n_fds > 0) {
-		fds = kmalloc(message->data.n_fds * sizeof(*fds),
+	if (message->n_files > 0) {
+		fds = kmalloc(message->n_files * sizeof(*fds),
 			      GFP_TEMPORARY);
 		if (!fds) {
 			r = -ENOMEM;
 			goto exit;
 		}
 
-		for ( ; n_fds < message->data.n_fds; ++n_fds) {
+		for ( ; n_fds < message->n_files; ++n_fds) {
 			r = get_unused_fd_flags(O_CLOEXEC);
 			if (r < 0)
 				goto exit;
@@ -274,8 +840,8 @@ int bus1_message_install(struct bus1_message *message,
 
 		vec.iov_base = fds;
 		vec.iov_len = n_fds * sizeof(int);
-		offset = ALIGN(message->data.n_bytes, 8) +
-			 ALIGN(message->data.n_handles * sizeof(u64), 8);
+		offset = bus1_message_head_size(message) +
+			 ALIGN(message->n_handles * sizeof(u64), 8);
 
 		r = bus1_pool_write_kvec(&peer_info->pool, message->slice,
 					 offset, &vec, 1, vec.iov_len);
@@ -288,9 +854,10 @@ int bus1_message_install(struct bus1_message *message,
 		bus1_handle_inflight_commit(&message->handles, peer_info, ts);
 
 	/* commit FDs */
+	files = bus1_message_files(message);
 	while (n_fds > 0) {
 		--n_fds;
-		fd_install(fds[n_fds], get_file(message->files[n_fds]));
+		fd_install(fds[n_fds], get_file(files[n_fds]));
 	}
 
 	r = 0;
@@ -302,3 +869,29 @@ exit:
 	kfree(ids);
 	return r;
 }
+
+/**
+ * bus1_message_export() - export message metadata
+ * @message:		message to export
+ * @data:		output buffer for the metadata
+ *
+ * This fills @data with the metadata of @message, as returned to user-space on
+ * RECV. The message must still have its pool slice allocated, and it must be
+ * called with the lock of the destination held.
+ */
+void bus1_message_export(struct bus1_message *message,
+			 struct bus1_msg_data *data)
+{
+	data->destination = message->destination;
+	data->uid = message->uid;
+	data->gid = message->gid;
+	data->pid = message->pid;
+	data->tid = message->tid;
+	data->offset = message->slice ? message->slice->offset :
+					BUS1_OFFSET_INVALID;
+	data->n_bytes = message->n_bytes;
+	data->n_handles = message->n_handles;
+	data->n_fds = message->n_files;
+	data->n_slices = message->n_slices;
+	data->timestamp = bus1_queue_node_get_timestamp(&message->qnode);
+}
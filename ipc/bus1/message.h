@@ -18,43 +18,108 @@
 
 #include <linux/fs.h>
 #include <linux/kernel.h>
+#include <linux/rbtree.h>
+#include <linux/uio.h>
 #include <uapi/linux/bus1.h>
 #include "handle.h"
 #include "queue.h"
 
+/*
+ * Payloads of at least this size are always placed at page-aligned offsets in
+ * the destination pool, see bus1_pool_alloc_aligned(). Below, the slack of up
+ * to a page per message is not worth it, unless explicitly requested.
+ */
+#define BUS1_MESSAGE_ALIGN_THRESHOLD (16 * PAGE_SIZE)
+
 struct bus1_message;
 struct bus1_peer;
 struct bus1_peer_info;
+struct bus1_pool_share;
 struct bus1_pool_slice;
+struct bus1_share;
 struct bus1_user;
 
 /**
  * struct bus1_message - message
  * @qnode:			embedded queue node
- * @data:			message data
- * @transaction.next:		message list (during transactions)
- * @transaction.dest:		pinned destination (during transactions)
+ * @next:			message list (during transactions and teardown)
+ * @dest:			pinned destination (during transactions)
+ * @rb_coalesce:		link into coalescing map of destination (once
+ *				committed)
+ * @rb_deadline:		link into deadline map of destination (once
+ *				committed with a deadline)
+ * @coalesce.sender:		ID of sending peer, or 0 if not coalescing
+ * @coalesce.key:		coalescing key
+ * @deadline:			CLOCK_MONOTONIC expiry time in ns, or 0
+ * @destination:		handle ID of the destination
+ * @n_bytes:			number of payload bytes
+ * @n_handles:			number of passed handles
+ * @uid:			sender UID, as seen by the destination
+ * @gid:			sender GID, as seen by the destination
+ * @pid:			sender PID, as seen by the destination
+ * @tid:			sender TID, as seen by the destination
+ * @n_files:			number of passed file descriptors
+ * @n_slices:			number of payload slices, or 0 if contiguous
+ * @page_aligned:		place the payload at a page-aligned offset
+ * @reserved:			@slice is a reserved reply slice, its payload is
+ *				not accounted on the quota of @user
+ * @pull:			payload is still in @share, and copied into the
+ *				pool only when the message is received
  * @user:			sending user
  * @slice:			actual message data
- * @files:			passed file descriptors
+ * @slices:			scattered payload slices, or NULL
+ * @share:			shared or staged payload, or NULL
+ * @view:			view of @share in the destination pool, or NULL
  * @handles:			passed handles
+ *
+ * Messages can be queued in large numbers, so this object is kept small.
+ * Transaction state and queue state are never needed at the same time, hence
+ * @dest and @rb_coalesce share their storage. The message metadata is stored
+ * in its compact form, and only expanded into struct bus1_msg_data when
+ * returned to user-space, see bus1_message_export(). The passed files are
+ * stored right after the handles, see bus1_message_files().
  */
 struct bus1_message {
 	struct bus1_queue_node qnode;
-	struct bus1_msg_data data;
+	struct bus1_message *next;
 
-	struct {
-		struct bus1_message *next;
+	union {
 		struct bus1_handle_dest dest;
-	} transaction;
+		struct rb_node rb_coalesce;
+	};
+
+	struct rb_node rb_deadline;
+
+	struct {
+		u64 sender;
+		u64 key;
+	} coalesce;
+
+	u64 deadline;
+	u64 destination;
+	size_t n_bytes;
+	size_t n_handles;
+	u32 uid;
+	u32 gid;
+	u32 pid;
+	u32 tid;
+	u16 n_files;
+	u16 n_slices;
+	bool page_aligned;
+	bool reserved;
+	bool pull;
 
 	struct bus1_user *user;
 	struct bus1_pool_slice *slice;
-	struct file **files;
+	struct bus1_pool_slice **slices;
+	struct bus1_share *share;
+	struct bus1_pool_share *view;
 	struct bus1_handle_inflight handles;
 	/* handles must be last */
 };
 
+int bus1_message_cache_create(void);
+void bus1_message_cache_destroy(void);
 struct bus1_message *bus1_message_new(size_t n_bytes,
 				      size_t n_files,
 				      size_t n_handles,
@@ -63,11 +128,26 @@ struct bus1_message *bus1_message_free(struct bus1_message *message,
 				       struct bus1_peer_info *peer_info);
 int bus1_message_allocate(struct bus1_message *message,
 			  struct bus1_peer_info *peer_info,
-			  struct bus1_user *user);
+			  struct bus1_user *user,
+			  struct bus1_pool_slice *reply);
 void bus1_message_deallocate(struct bus1_message *message,
 			     struct bus1_peer_info *peer_info);
+void bus1_message_link_deadline(struct bus1_message *message,
+				struct bus1_peer_info *peer_info);
+struct bus1_message *bus1_message_coalesce(struct bus1_message *message,
+					   struct bus1_peer_info *peer_info);
+void bus1_message_publish(struct bus1_message *message,
+			  struct bus1_peer_info *peer_info);
+ssize_t bus1_message_write(struct bus1_message *message,
+			   struct bus1_peer_info *peer_info,
+			   size_t offset,
+			   struct iov_iter *iter);
+int bus1_message_pull(struct bus1_message *message,
+		      struct bus1_peer_info *peer_info);
 int bus1_message_install(struct bus1_message *message,
 			 struct bus1_peer_info *peer_info);
+void bus1_message_export(struct bus1_message *message,
+			 struct bus1_msg_data *data);
 
 /**
  * bus1_message_from_node - get parent message of a queue node
@@ -90,4 +170,31 @@ bus1_message_from_node(struct bus1_queue_node *node)
 	return container_of(node, struct bus1_message, qnode);
 }
 
+/**
+ * bus1_message_base_size() - calculate size of message object
+ * @n_handles:		number of handles to embed
+ *
+ * This calculates the size of a message object that embeds @n_handles handles.
+ * The passed files are stored right after it.
+ *
+ * Return: Size of message object, without passed files.
+ */
+static inline size_t bus1_message_base_size(size_t n_handles)
+{
+	return ALIGN(sizeof(struct bus1_message) +
+		     bus1_handle_batch_inline_size(n_handles), 8);
+}
+
+/**
+ * bus1_message_files() - get passed files of a message
+ * @message:		message to operate on
+ *
+ * Return: Pointer to the array of @message->n_files passed files.
+ */
+static inline struct file **bus1_message_files(struct bus1_message *message)
+{
+	return (void *)((u8 *)message +
+			bus1_message_base_size(message->n_handles));
+}
+
 #endif /* __BUS1_MESSAGE_H */
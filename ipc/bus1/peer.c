@@ -14,6 +14,8 @@
 #include <linux/file.h>
 #include <linux/fs.h>
 #include <linux/kernel.h>
+#include <linux/kref.h>
+#include <linux/ktime.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
 #include <linux/pid_namespace.h>
@@ -23,8 +25,12 @@
 #include <linux/slab.h>
 #include <linux/spinlock.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
 #include <linux/wait.h>
+#include <linux/workqueue.h>
 #include <uapi/linux/bus1.h>
+#include "buffer.h"
+#include "handle.h"
 #include "main.h"
 #include "message.h"
 #include "peer.h"
@@ -34,11 +40,381 @@
 #include "user.h"
 #include "util.h"
 
+/* peer IDs are never reused, so they can identify the sender of a message */
+static atomic64_t bus1_peer_info_ids = ATOMIC64_INIT(0);
+
+/**
+ * bus1_peer_info_arm_reaper() - schedule reaper for a message deadline
+ * @peer_info:		peer to operate on
+ * @deadline:		deadline of a queued message, or 0
+ *
+ * This makes sure the reaper of @peer_info runs no later than @deadline, to
+ * reclaim the pool space of the message once it expired. If the reaper is
+ * already armed for an earlier deadline, nothing is done. The reaper then
+ * re-arms itself for the next deadline.
+ *
+ * The caller must hold the peer_info lock.
+ */
+void bus1_peer_info_arm_reaper(struct bus1_peer_info *peer_info, u64 deadline)
+{
+	unsigned long delay;
+	u64 now;
+
+	lockdep_assert_held(&peer_info->lock);
+
+	if (!deadline || (peer_info->reaper_deadline &&
+			  peer_info->reaper_deadline <= deadline))
+		return;
+
+	now = ktime_get_ns();
+	delay = deadline > now ? nsecs_to_jiffies(deadline - now) + 1 : 0;
+	WRITE_ONCE(peer_info->reaper_deadline, deadline);
+	mod_delayed_work(system_wq, &peer_info->reaper, delay);
+}
+
+/*
+ * Drop expired messages from the queue of @peer_info. Messages with a deadline
+ * are kept in a map ordered by deadline, so this only visits expired messages
+ * and stops at the first one that is still alive. The reaper is re-armed for
+ * its deadline, if it is not armed for it, yet, or if @reaper is true (that is,
+ * the caller is the reaper itself).
+ */
+static void bus1_peer_info_expire(struct bus1_peer_info *peer_info,
+				  bool reaper)
+{
+	struct bus1_message *message, *list = NULL;
+	struct rb_node *n;
+	u64 now, next_deadline = 0;
+
+	mutex_lock(&peer_info->lock);
+
+	now = ktime_get_ns();
+	while ((n = rb_first(&peer_info->map_deadlines))) {
+		message = container_of(n, struct bus1_message, rb_deadline);
+		if (message->deadline > now) {
+			next_deadline = message->deadline;
+			break;
+		}
+
+		bus1_queue_remove(&peer_info->queue, &message->qnode);
+		bus1_message_deallocate(message, peer_info);
+		message->next = list;
+		list = message;
+		atomic_inc(&peer_info->n_expired);
+	}
+
+	if (reaper || peer_info->reaper_deadline != next_deadline) {
+		WRITE_ONCE(peer_info->reaper_deadline, 0);
+		bus1_peer_info_arm_reaper(peer_info, next_deadline);
+	}
+
+	mutex_unlock(&peer_info->lock);
+
+	while ((message = list)) {
+		list = message->next;
+		message->next = NULL;
+		bus1_message_free(message, peer_info);
+	}
+}
+
+static void bus1_peer_info_reap(struct work_struct *work)
+{
+	struct bus1_peer_info *peer_info = container_of(to_delayed_work(work),
+							struct bus1_peer_info,
+							reaper);
+
+	bus1_peer_info_expire(peer_info, true);
+}
+
+/*
+ * Protects the member links of all peer sets, that is, bus1_peer.set and
+ * bus1_peer_set.members. Only taken on registration and teardown, receivers
+ * use the per-set lock only.
+ */
+static DEFINE_MUTEX(bus1_peer_set_lock);
+
+static void bus1_peer_set_free(struct kref *ref)
+{
+	struct bus1_peer_set *set = container_of(ref, struct bus1_peer_set,
+						 ref);
+
+	WARN_ON(!RB_EMPTY_NODE(&set->rb));
+	mutex_destroy(&set->lock);
+	kfree_rcu(set, rcu);
+}
+
+static struct bus1_peer_set *bus1_peer_set_unref(struct bus1_peer_set *set)
+{
+	if (set)
+		kref_put(&set->ref, bus1_peer_set_free);
+	return NULL;
+}
+
+static void bus1_peer_set_unlink(struct bus1_peer_set *set)
+{
+	struct bus1_peer *member;
+	size_t i;
+
+	lockdep_assert_held(&bus1_peer_set_lock);
+
+	mutex_lock(&set->lock);
+	for (i = 0; i < set->n_members; ++i) {
+		member = set->members[i];
+		if (member) {
+			RCU_INIT_POINTER(member->set, NULL);
+			set->members[i] = NULL;
+		}
+	}
+	mutex_unlock(&set->lock);
+}
+
+/* unlink all members from @set, must be called before the last unref */
+static void bus1_peer_set_detach(struct bus1_peer_set *set)
+{
+	mutex_lock(&bus1_peer_set_lock);
+	bus1_peer_set_unlink(set);
+	mutex_unlock(&bus1_peer_set_lock);
+
+	/* wake up blocking receivers, so they notice the set is gone */
+	atomic_inc(&set->n_events);
+	wake_up_interruptible(set->waitq);
+}
+
+/* unlink @peer from the set it is member of, if any */
+static void bus1_peer_set_leave(struct bus1_peer *peer)
+{
+	struct bus1_peer_set *set;
+	size_t i;
+
+	mutex_lock(&bus1_peer_set_lock);
+	set = rcu_dereference_protected(peer->set,
+					lockdep_is_held(&bus1_peer_set_lock));
+	if (set) {
+		mutex_lock(&set->lock);
+		for (i = 0; i < set->n_members; ++i)
+			if (set->members[i] == peer)
+				set->members[i] = NULL;
+		mutex_unlock(&set->lock);
+		RCU_INIT_POINTER(peer->set, NULL);
+	}
+	mutex_unlock(&bus1_peer_set_lock);
+}
+
+/**
+ * bus1_peer_set_register() - register a new peer set
+ * @peer:		owning peer
+ * @fds:		user-space array of peer file descriptors
+ * @n_fds:		number of file descriptors in @fds
+ * @idp:		output storage for the ID of the new set
+ *
+ * This resolves all file descriptors in @fds to their peers and registers
+ * them as a peer set on @peer. Each file descriptor must refer to a bus1 peer
+ * that is not member of any other peer set, yet. @peer itself can be part of
+ * the set as well.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+static int bus1_peer_set_register(struct bus1_peer *peer,
+				  const u32 __user *fds,
+				  size_t n_fds,
+				  u64 *idp)
+{
+	struct bus1_peer_info *peer_info = bus1_peer_dereference(peer);
+	struct bus1_peer_set *set, *iter;
+	struct bus1_peer *member;
+	struct rb_node *n, **slot;
+	struct file **files, *f;
+	size_t i, n_files = 0;
+	u32 fd;
+	u64 id;
+	int r;
+
+	if (n_fds < 1 || n_fds > BUS1_PEER_SET_MAX)
+		return -EMSGSIZE;
+
+	files = kmalloc(n_fds * sizeof(*files), GFP_TEMPORARY);
+	if (!files)
+		return -ENOMEM;
+
+	/* pin all members upfront, the global lock covers linking only */
+	for (i = 0; i < n_fds; ++i) {
+		if (get_user(fd, fds + i)) {
+			r = -EFAULT;
+			goto exit;
+		}
+
+		f = fget(fd);
+		if (!f) {
+			r = -EBADF;
+			goto exit;
+		}
+
+		files[n_files++] = f;
+		if (f->f_op != &bus1_fops) {
+			r = -EBADF;
+			goto exit;
+		}
+	}
+
+	set = kmalloc(sizeof(*set) + n_fds * sizeof(*set->members),
+		      GFP_KERNEL);
+	if (!set) {
+		r = -ENOMEM;
+		goto exit;
+	}
+
+	kref_init(&set->ref);
+	RB_CLEAR_NODE(&set->rb);
+	mutex_init(&set->lock);
+	set->waitq = &peer->waitq;
+	atomic_set(&set->n_events, 0);
+	set->id = 0;
+	set->i_next = 0;
+	set->n_members = 0;
+
+	mutex_lock(&bus1_peer_set_lock);
+
+	for (i = 0; i < n_files; ++i) {
+		/* once linked, @member is only freed under the global lock */
+		member = files[i]->private_data;
+		if (rcu_access_pointer(member->set)) {
+			r = -EBUSY;
+			goto error;
+		}
+
+		rcu_assign_pointer(member->set, set);
+		set->members[set->n_members++] = member;
+	}
+
+	mutex_lock(&peer_info->lock);
+	if (peer_info->n_peer_sets >= BUS1_PEER_SETS_MAX) {
+		mutex_unlock(&peer_info->lock);
+		r = -EDQUOT;
+		goto error;
+	}
+
+	id = ++peer_info->peer_set_ids;
+	set->id = id;
+
+	/* IDs are strictly increasing, so this always links rightmost */
+	n = NULL;
+	slot = &peer_info->map_peer_sets.rb_node;
+	while (*slot) {
+		n = *slot;
+		iter = container_of(n, struct bus1_peer_set, rb);
+		WARN_ON(id == iter->id);
+		if (id < iter->id)
+			slot = &n->rb_left;
+		else /* if (id > iter->id) */
+			slot = &n->rb_right;
+	}
+	rb_link_node(&set->rb, n, slot);
+	rb_insert_color(&set->rb, &peer_info->map_peer_sets);
+	++peer_info->n_peer_sets;
+	mutex_unlock(&peer_info->lock);
+
+	mutex_unlock(&bus1_peer_set_lock);
+
+	/* the map owns the initial reference now, @set must not be used */
+	*idp = id;
+	r = 0;
+	goto exit;
+
+error:
+	bus1_peer_set_unlink(set);
+	mutex_unlock(&bus1_peer_set_lock);
+	bus1_peer_set_unref(set);
+exit:
+	while (n_files > 0)
+		fput(files[--n_files]);
+	kfree(files);
+	return r;
+}
+
+static struct bus1_peer_set *
+bus1_peer_set_lookup(struct bus1_peer_info *peer_info, u64 id)
+{
+	struct bus1_peer_set *set;
+	struct rb_node *n;
+
+	lockdep_assert_held(&peer_info->lock);
+
+	n = peer_info->map_peer_sets.rb_node;
+	while (n) {
+		set = container_of(n, struct bus1_peer_set, rb);
+		if (id == set->id)
+			return set;
+		else if (id < set->id)
+			n = n->rb_left;
+		else /* if (id > set->id) */
+			n = n->rb_right;
+	}
+
+	return NULL;
+}
+
+static struct bus1_peer_set *
+bus1_peer_set_find_by_id(struct bus1_peer_info *peer_info, u64 id)
+{
+	struct bus1_peer_set *set;
+
+	mutex_lock(&peer_info->lock);
+	set = bus1_peer_set_lookup(peer_info, id);
+	if (set)
+		kref_get(&set->ref);
+	mutex_unlock(&peer_info->lock);
+
+	return set;
+}
+
+static int bus1_peer_set_release_by_id(struct bus1_peer_info *peer_info,
+				       u64 id)
+{
+	struct bus1_peer_set *set;
+
+	mutex_lock(&peer_info->lock);
+	set = bus1_peer_set_lookup(peer_info, id);
+	if (set) {
+		rb_erase(&set->rb, &peer_info->map_peer_sets);
+		RB_CLEAR_NODE(&set->rb);
+		--peer_info->n_peer_sets;
+	}
+	mutex_unlock(&peer_info->lock);
+
+	if (!set)
+		return -ENXIO;
+
+	bus1_peer_set_detach(set);
+	bus1_peer_set_unref(set);
+	return 0;
+}
+
+static void bus1_peer_set_flush_all(struct bus1_peer_info *peer_info)
+{
+	struct bus1_peer_set *set, *t;
+	struct rb_root map;
+
+	mutex_lock(&peer_info->lock);
+	map = peer_info->map_peer_sets;
+	peer_info->map_peer_sets = RB_ROOT;
+	peer_info->n_peer_sets = 0;
+	mutex_unlock(&peer_info->lock);
+
+	rbtree_postorder_for_each_entry_safe(set, t, &map, rb) {
+		RB_CLEAR_NODE(&set->rb);
+		bus1_peer_set_detach(set);
+		bus1_peer_set_unref(set);
+	}
+}
+
 static void bus1_peer_info_reset(struct bus1_peer_info *peer_info, bool final)
 {
 	struct bus1_queue_node *node, *t;
 	struct bus1_message *message, *list = NULL;
 
+	bus1_buffer_flush_all(peer_info);
+	bus1_handle_set_flush_all(peer_info);
+	bus1_peer_set_flush_all(peer_info);
 	bus1_handle_flush_all(peer_info);
 
 	mutex_lock(&peer_info->lock);
@@ -52,7 +428,7 @@ static void bus1_peer_info_reset(struct bus1_peer_info *peer_info, bool final)
 			RB_CLEAR_NODE(&node->rb); /* mark as dropped */
 			if (bus1_queue_node_is_committed(node)) {
 				bus1_message_deallocate(message, peer_info);
-				message->transaction.next = list;
+				message->next = list;
 				list = message;
 			}
 			break;
@@ -66,13 +442,14 @@ static void bus1_peer_info_reset(struct bus1_peer_info *peer_info, bool final)
 		}
 	}
 	bus1_queue_post_flush(&peer_info->queue);
+	bus1_peer_aggregate_flush(peer_info);
 	bus1_pool_flush(&peer_info->pool);
 
 	mutex_unlock(&peer_info->lock);
 
 	while ((message = list)) {
-		list = message->transaction.next;
-		message->transaction.next = NULL;
+		list = message->next;
+		message->next = NULL;
 		bus1_message_free(message, peer_info);
 	}
 }
@@ -84,6 +461,7 @@ bus1_peer_info_free(struct bus1_peer_info *peer_info)
 		return NULL;
 
 	bus1_peer_info_reset(peer_info, true);
+	cancel_delayed_work_sync(&peer_info->reaper);
 
 	if (peer_info->seed) {
 		mutex_lock(&peer_info->lock);
@@ -102,6 +480,11 @@ bus1_peer_info_free(struct bus1_peer_info *peer_info)
 
 	WARN_ON(!RB_EMPTY_ROOT(&peer_info->map_handles_by_node));
 	WARN_ON(!RB_EMPTY_ROOT(&peer_info->map_handles_by_id));
+	WARN_ON(!RB_EMPTY_ROOT(&peer_info->map_dest_sets));
+	WARN_ON(!RB_EMPTY_ROOT(&peer_info->map_peer_sets));
+	WARN_ON(!RB_EMPTY_ROOT(&peer_info->map_buffers));
+	WARN_ON(!RB_EMPTY_ROOT(&peer_info->map_coalesce));
+	WARN_ON(!RB_EMPTY_ROOT(&peer_info->map_deadlines));
 
 	/*
 	 * Make sure the object is freed in a delayed-manner. Some
@@ -113,7 +496,8 @@ bus1_peer_info_free(struct bus1_peer_info *peer_info)
 	return NULL;
 }
 
-static struct bus1_peer_info *bus1_peer_info_new(size_t pool_size)
+static struct bus1_peer_info *
+bus1_peer_info_new(u64 flags, size_t pool_size, struct bus1_peer_info *parent)
 {
 	struct bus1_peer_info *peer_info;
 	int r;
@@ -128,16 +512,35 @@ static struct bus1_peer_info *bus1_peer_info_new(size_t pool_size)
 	mutex_init(&peer_info->lock);
 	peer_info->cred = get_cred(current_cred());
 	peer_info->pid_ns = get_pid_ns(task_active_pid_ns(current));
+	peer_info->id = atomic64_inc_return(&bus1_peer_info_ids);
+	peer_info->flags = flags;
 	peer_info->user = NULL;
 	peer_info->seed = NULL;
+	peer_info->aggregate = NULL;
+	peer_info->aggregate_ids = NULL;
+	peer_info->n_aggregate = 0;
 	bus1_user_quota_init(&peer_info->quota);
 	peer_info->pool = BUS1_POOL_NULL;
 	bus1_queue_init_for_peer(peer_info);
 	peer_info->map_handles_by_id = RB_ROOT;
 	peer_info->map_handles_by_node = RB_ROOT;
+	peer_info->map_dest_sets = RB_ROOT;
+	peer_info->map_peer_sets = RB_ROOT;
+	peer_info->map_buffers = RB_ROOT;
+	peer_info->map_coalesce = RB_ROOT;
+	peer_info->map_deadlines = RB_ROOT;
+	INIT_DELAYED_WORK(&peer_info->reaper, bus1_peer_info_reap);
+	peer_info->reaper_deadline = 0;
 	seqcount_init(&peer_info->seqcount);
 	atomic_set(&peer_info->n_dropped, 0);
+	atomic_set(&peer_info->n_expired, 0);
 	peer_info->handle_ids = 0;
+	peer_info->dest_set_ids = 0;
+	peer_info->n_dest_sets = 0;
+	peer_info->peer_set_ids = 0;
+	peer_info->n_peer_sets = 0;
+	peer_info->buffer_ids = 0;
+	peer_info->n_buffers = 0;
 
 	peer_info->user = bus1_user_ref_by_uid(peer_info->cred->uid);
 	if (IS_ERR(peer_info->user)) {
@@ -151,7 +554,11 @@ static struct bus1_peer_info *bus1_peer_info_new(size_t pool_size)
 	peer_info->n_handles = atomic_read(&peer_info->user->max_handles);
 	peer_info->n_fds = rlimit(RLIMIT_NOFILE);
 
-	r = bus1_pool_create_for_peer(peer_info, pool_size);
+	if (parent)
+		r = bus1_pool_create_shared_for_peer(peer_info, parent,
+						     pool_size);
+	else
+		r = bus1_pool_create_for_peer(peer_info, pool_size);
 	if (r < 0)
 		goto error;
 
@@ -181,6 +588,7 @@ struct bus1_peer *bus1_peer_new(void)
 	init_waitqueue_head(&peer->waitq);
 	bus1_active_init(&peer->active);
 	rcu_assign_pointer(peer->info, NULL);
+	RCU_INIT_POINTER(peer->set, NULL);
 
 	return peer;
 }
@@ -203,6 +611,7 @@ struct bus1_peer *bus1_peer_free(struct bus1_peer *peer)
 		return NULL;
 
 	WARN_ON(rcu_access_pointer(peer->info));
+	bus1_peer_set_leave(peer);
 	bus1_active_destroy(&peer->active);
 	kfree_rcu(peer, rcu);
 
@@ -244,6 +653,7 @@ int bus1_peer_disconnect(struct bus1_peer *peer)
 {
 	/* deactivate and wait for any outstanding operations */
 	bus1_active_deactivate(&peer->active);
+	bus1_peer_wake(peer); /* kick blocking receivers */
 	bus1_active_drain(&peer->active, &peer->waitq);
 
 	if (!bus1_active_cleanup(&peer->active, &peer->waitq,
@@ -276,7 +686,10 @@ int bus1_peer_ioctl_init(struct bus1_peer *peer, unsigned long arg)
 
 	if (copy_from_user(&param, (void __user *)arg, sizeof(param)))
 		return -EFAULT;
-	if (unlikely(param.flags) || unlikely(param.pool_size == 0))
+	if (unlikely(param.flags & ~(BUS1_PEER_FLAG_SCATTER |
+				     BUS1_PEER_FLAG_UNORDERED |
+				     BUS1_PEER_FLAG_AGGREGATE)) ||
+	    unlikely(param.pool_size == 0))
 		return -EINVAL;
 
 	/*
@@ -288,7 +701,7 @@ int bus1_peer_ioctl_init(struct bus1_peer *peer, unsigned long arg)
 	 * bus1_active_activate() for details). Hence, borrowing the waitq-lock
 	 * is perfectly fine.
 	 */
-	peer_info = bus1_peer_info_new(param.pool_size);
+	peer_info = bus1_peer_info_new(param.flags, param.pool_size, NULL);
 	if (IS_ERR(peer_info))
 		return PTR_ERR(peer_info);
 
@@ -327,7 +740,9 @@ static int bus1_peer_ioctl_query(struct bus1_peer *peer, unsigned long arg)
 
 	peer_info = bus1_peer_dereference(peer);
 
-	if (put_user(peer_info->pool.size, &uparam->pool_size))
+	/* report the size of the mapping needed to access the whole pool */
+	if (put_user(peer_info->pool.base + peer_info->pool.size,
+		     &uparam->pool_size))
 		return -EFAULT;
 
 	return 0;
@@ -359,7 +774,7 @@ static int bus1_peer_ioctl_clone(struct bus1_peer *peer,
 {
 	struct bus1_cmd_peer_clone __user *uparam = (void __user *) arg;
 	struct bus1_cmd_peer_clone param;
-	struct bus1_peer_info *peer_info, *clone_info = NULL;
+	struct bus1_peer_info *peer_info, *parent_info, *clone_info = NULL;
 	struct bus1_peer *clone = NULL;
 	struct file *clone_file = NULL;
 	u64 node_id, handle_id;
@@ -371,7 +786,10 @@ static int bus1_peer_ioctl_clone(struct bus1_peer *peer,
 
 	if (copy_from_user(&param, (void __user *)arg, sizeof(param)))
 		return -EFAULT;
-	if (unlikely(param.flags) ||
+	if (unlikely(param.flags & ~(BUS1_PEER_FLAG_SCATTER |
+				     BUS1_PEER_FLAG_SHARED_POOL |
+				     BUS1_PEER_FLAG_UNORDERED |
+				     BUS1_PEER_FLAG_AGGREGATE)) ||
 	    unlikely(param.pool_size == 0) ||
 	    unlikely(param.node != BUS1_HANDLE_INVALID) ||
 	    unlikely(param.handle != BUS1_HANDLE_INVALID) ||
@@ -401,7 +819,11 @@ static int bus1_peer_ioctl_clone(struct bus1_peer *peer,
 	}
 	clone_file->private_data = clone; /* released via f_op->release() */
 
-	clone_info = bus1_peer_info_new(param.pool_size);
+	/* shared pools are carved out of the pool memory of the parent */
+	parent_info = (param.flags & BUS1_PEER_FLAG_SHARED_POOL) ?
+							peer_info : NULL;
+	clone_info = bus1_peer_info_new(param.flags, param.pool_size,
+					parent_info);
 	if (IS_ERR(clone_info)) {
 		r = PTR_ERR(clone_info);
 		clone_info = NULL;
@@ -488,9 +910,8 @@ static int bus1_peer_ioctl_send(struct bus1_peer *peer, unsigned long arg)
 {
 	struct bus1_peer_info *peer_info = bus1_peer_dereference(peer);
 	struct bus1_transaction *transaction = NULL;
-	/* Use a stack-allocated buffer for the transaction object if it fits */
-	u8 buf[512];
 	struct bus1_cmd_send param;
+	struct bus1_handle_set *set;
 	struct bus1_message *seed;
 	u64 __user *ptr_dest;
 	bool cont;
@@ -505,9 +926,76 @@ static int bus1_peer_ioctl_send(struct bus1_peer *peer, unsigned long arg)
 		return -EFAULT;
 	if (unlikely(param.flags & ~(BUS1_SEND_FLAG_CONTINUE |
 				     BUS1_SEND_FLAG_SILENT |
-				     BUS1_SEND_FLAG_SEED)))
+				     BUS1_SEND_FLAG_SEED |
+				     BUS1_SEND_FLAG_DEST_SET |
+				     BUS1_SEND_FLAG_BUFFERS |
+				     BUS1_SEND_FLAG_PAGE_ALIGNED |
+				     BUS1_SEND_FLAG_COALESCE |
+				     BUS1_SEND_FLAG_SHARED |
+				     BUS1_SEND_FLAG_PULL |
+				     BUS1_SEND_FLAG_HEADERS |
+				     BUS1_SEND_FLAG_UNORDERED |
+				     BUS1_SEND_FLAG_MOVE_HANDLES |
+				     BUS1_SEND_FLAG_MOVE_FDS)))
+		return -EINVAL;
+	/* seeds are never queued, so they cannot skip the queue order */
+	if (unlikely((param.flags & BUS1_SEND_FLAG_SEED) &&
+		     (param.flags & BUS1_SEND_FLAG_UNORDERED)))
+		return -EINVAL;
+	/* handle transfers are ordered against the sender clock */
+	if (unlikely((param.flags & BUS1_SEND_FLAG_UNORDERED) &&
+		     param.n_handles > 0))
+		return -EINVAL;
+	/* shared and pulled payloads are copied from iovecs only */
+	if (unlikely((param.flags & (BUS1_SEND_FLAG_SHARED |
+				     BUS1_SEND_FLAG_PULL)) &&
+		     (param.flags & BUS1_SEND_FLAG_BUFFERS)))
+		return -EINVAL;
+	if (unlikely((param.flags & BUS1_SEND_FLAG_SHARED) &&
+		     (param.flags & BUS1_SEND_FLAG_PULL)))
+		return -EINVAL;
+	if (unlikely(param.coalesce_key &&
+		     !(param.flags & BUS1_SEND_FLAG_COALESCE)))
 		return -EINVAL;
 
+	/* seeds are never delivered, so delivery options do not apply */
+	if (unlikely((param.flags & BUS1_SEND_FLAG_SEED) &&
+		     ((param.flags & (BUS1_SEND_FLAG_SILENT |
+				      BUS1_SEND_FLAG_CONTINUE |
+				      BUS1_SEND_FLAG_DEST_SET |
+				      BUS1_SEND_FLAG_COALESCE |
+				      BUS1_SEND_FLAG_SHARED |
+				      BUS1_SEND_FLAG_PULL |
+				      BUS1_SEND_FLAG_MOVE_HANDLES |
+				      BUS1_SEND_FLAG_MOVE_FDS)) ||
+		      param.deadline ||
+		      param.n_destinations ||
+		      param.ptr_destinations)))
+		return -EINVAL;
+
+	/* per-destination headers are copied in front of the iovecs */
+	if (param.flags & BUS1_SEND_FLAG_HEADERS) {
+		if (unlikely(param.flags & (BUS1_SEND_FLAG_SEED |
+					    BUS1_SEND_FLAG_BUFFERS |
+					    BUS1_SEND_FLAG_SHARED |
+					    BUS1_SEND_FLAG_PULL)))
+			return -EINVAL;
+		if (unlikely(param.header_size == 0))
+			return -EINVAL;
+		if (unlikely(param.header_size > BUS1_HEADER_SIZE_MAX))
+			return -EMSGSIZE;
+	} else if (unlikely(param.ptr_headers || param.header_size)) {
+		return -EINVAL;
+	}
+
+	/* destination sets replace the destination array */
+	if (param.flags & BUS1_SEND_FLAG_DEST_SET) {
+		if (unlikely(param.ptr_destinations || param.n_destinations))
+			return -EINVAL;
+	} else if (unlikely(param.dest_set)) {
+		return -EINVAL;
+	}
+
 	/* check basic limits; avoids integer-overflows later on */
 	if (unlikely(param.n_vecs > BUS1_VEC_MAX) ||
 	    unlikely(param.n_fds > BUS1_FD_MAX))
@@ -521,28 +1009,21 @@ static int bus1_peer_ioctl_send(struct bus1_peer *peer, unsigned long arg)
 	    unlikely(param.ptr_handles !=
 		     (u64)(unsigned long)param.ptr_handles) ||
 	    unlikely(param.ptr_fds !=
-		     (u64)(unsigned long)param.ptr_fds))
+		     (u64)(unsigned long)param.ptr_fds) ||
+	    unlikely(param.ptr_headers !=
+		     (u64)(unsigned long)param.ptr_headers))
 		return -EFAULT;
 
 	cont = param.flags & BUS1_SEND_FLAG_CONTINUE;
 	ptr_dest = (u64 __user *)(unsigned long)param.ptr_destinations;
 
-	transaction = bus1_transaction_new_from_user(buf, sizeof(buf), peer,
-						     &param);
+	transaction = bus1_transaction_new_from_user(peer, &param);
 	if (IS_ERR(transaction))
 		return PTR_ERR(transaction);
 
 	if (param.flags & BUS1_SEND_FLAG_SEED) { /* Special-case: set seed */
-		if (unlikely((param.flags & (BUS1_SEND_FLAG_SILENT |
-					     BUS1_SEND_FLAG_CONTINUE)) ||
-			     param.n_destinations ||
-			     param.ptr_destinations)) {
-			r = -EINVAL;
-			goto exit;
-		}
-
 		seed = bus1_transaction_instantiate_message(transaction,
-							    peer_info);
+							    peer_info, NULL, 0);
 		if (IS_ERR(seed)) {
 			r = PTR_ERR(seed);
 			goto exit;
@@ -555,10 +1036,33 @@ static int bus1_peer_ioctl_send(struct bus1_peer *peer, unsigned long arg)
 		mutex_unlock(&peer_info->lock);
 		seed = bus1_message_free(seed, peer_info);
 
+	} else if (param.flags & BUS1_SEND_FLAG_DEST_SET) { /* Registered set */
+		set = bus1_handle_set_find_by_id(peer_info, param.dest_set);
+		if (!set) {
+			r = -ENXIO;
+			goto exit;
+		}
+
+		for (i = 0; i < set->n_entries; ++i) {
+			r = bus1_transaction_instantiate_for_set(transaction,
+								 set, i);
+			if (r < 0 && (r != -ENXIO || !cont))
+				break;
+			r = 0;
+		}
+
+		bus1_handle_set_unref(set);
+		if (r < 0)
+			goto exit;
+
+		r = bus1_transaction_commit(transaction);
+		if (r < 0)
+			goto exit;
+
 	} else if (param.n_destinations == 1) { /* Fastpath: unicast */
-		r = bus1_transaction_commit_for_id(transaction,
-						   ptr_dest);
-		if (r < 0 && (r != -ENXIO || !cont))
+		r = bus1_transaction_commit_for_id(transaction, ptr_dest,
+						   cont);
+		if (r < 0)
 			goto exit;
 
 	} else { /* Slowpath: any message */
@@ -577,10 +1081,244 @@ static int bus1_peer_ioctl_send(struct bus1_peer *peer, unsigned long arg)
 	r = 0;
 
 exit:
-	bus1_transaction_free(transaction, buf);
+	bus1_transaction_free(transaction);
+	return r;
+}
+
+static int bus1_peer_ioctl_dest_set_register(struct bus1_peer *peer,
+					     unsigned long arg)
+{
+	struct bus1_cmd_dest_set __user *uparam = (void __user *)arg;
+	struct bus1_cmd_dest_set param;
+	const u64 __user *ptr_dest;
+	u64 id;
+	int r;
+
+	lockdep_assert_held(&peer->active);
+
+	BUILD_BUG_ON(_IOC_SIZE(BUS1_CMD_DEST_SET_REGISTER) != sizeof(param));
+
+	if (copy_from_user(&param, (void __user *)arg, sizeof(param)))
+		return -EFAULT;
+	if (unlikely(param.flags) || unlikely(param.id))
+		return -EINVAL;
+	if (unlikely(param.n_destinations > BUS1_DEST_SET_MAX))
+		return -EMSGSIZE;
+
+	/* 32bit pointer validity checks */
+	if (unlikely(param.ptr_destinations !=
+		     (u64)(unsigned long)param.ptr_destinations))
+		return -EFAULT;
+
+	ptr_dest = (const u64 __user *)(unsigned long)param.ptr_destinations;
+	r = bus1_handle_set_register(bus1_peer_dereference(peer), ptr_dest,
+				     param.n_destinations, &id);
+	if (r < 0)
+		return r;
+
+	if (put_user(id, &uparam->id)) {
+		bus1_handle_set_release_by_id(bus1_peer_dereference(peer), id);
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
+static int bus1_peer_ioctl_dest_set_release(struct bus1_peer *peer,
+					    unsigned long arg)
+{
+	u64 id;
+
+	lockdep_assert_held(&peer->active);
+
+	BUILD_BUG_ON(_IOC_SIZE(BUS1_CMD_DEST_SET_RELEASE) != sizeof(id));
+
+	if (get_user(id, (const u64 __user *)arg))
+		return -EFAULT;
+
+	return bus1_handle_set_release_by_id(bus1_peer_dereference(peer), id);
+}
+
+static int bus1_peer_ioctl_buffer_register(struct bus1_peer *peer,
+					   unsigned long arg)
+{
+	struct bus1_cmd_buffer __user *uparam = (void __user *)arg;
+	struct bus1_cmd_buffer param;
+	u64 id;
+	int r;
+
+	lockdep_assert_held(&peer->active);
+
+	BUILD_BUG_ON(_IOC_SIZE(BUS1_CMD_BUFFER_REGISTER) != sizeof(param));
+
+	if (copy_from_user(&param, (void __user *)arg, sizeof(param)))
+		return -EFAULT;
+	if (unlikely(param.flags) || unlikely(param.id))
+		return -EINVAL;
+	if (unlikely(param.size > BUS1_BUFFER_SIZE_MAX))
+		return -EMSGSIZE;
+
+	/* 32bit pointer validity checks */
+	if (unlikely(param.ptr != (u64)(unsigned long)param.ptr))
+		return -EFAULT;
+
+	r = bus1_buffer_register(bus1_peer_dereference(peer),
+				 (unsigned long)param.ptr, param.size, &id);
+	if (r < 0)
+		return r;
+
+	if (put_user(id, &uparam->id)) {
+		bus1_buffer_release_by_id(bus1_peer_dereference(peer), id);
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
+static int bus1_peer_ioctl_buffer_release(struct bus1_peer *peer,
+					  unsigned long arg)
+{
+	u64 id;
+
+	lockdep_assert_held(&peer->active);
+
+	BUILD_BUG_ON(_IOC_SIZE(BUS1_CMD_BUFFER_RELEASE) != sizeof(id));
+
+	if (get_user(id, (const u64 __user *)arg))
+		return -EFAULT;
+
+	return bus1_buffer_release_by_id(bus1_peer_dereference(peer), id);
+}
+
+static int bus1_peer_ioctl_peer_set_register(struct bus1_peer *peer,
+					     unsigned long arg)
+{
+	struct bus1_cmd_peer_set __user *uparam = (void __user *)arg;
+	struct bus1_cmd_peer_set param;
+	const u32 __user *ptr_fds;
+	u64 id;
+	int r;
+
+	lockdep_assert_held(&peer->active);
+
+	BUILD_BUG_ON(_IOC_SIZE(BUS1_CMD_PEER_SET_REGISTER) != sizeof(param));
+
+	if (copy_from_user(&param, (void __user *)arg, sizeof(param)))
+		return -EFAULT;
+	if (unlikely(param.flags) || unlikely(param.id))
+		return -EINVAL;
+	if (unlikely(param.n_fds > BUS1_PEER_SET_MAX))
+		return -EMSGSIZE;
+
+	/* 32bit pointer validity checks */
+	if (unlikely(param.ptr_fds != (u64)(unsigned long)param.ptr_fds))
+		return -EFAULT;
+
+	ptr_fds = (const u32 __user *)(unsigned long)param.ptr_fds;
+	r = bus1_peer_set_register(peer, ptr_fds, param.n_fds, &id);
+	if (r < 0)
+		return r;
+
+	if (put_user(id, &uparam->id)) {
+		bus1_peer_set_release_by_id(bus1_peer_dereference(peer), id);
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
+static int bus1_peer_ioctl_peer_set_release(struct bus1_peer *peer,
+					    unsigned long arg)
+{
+	u64 id;
+
+	lockdep_assert_held(&peer->active);
+
+	BUILD_BUG_ON(_IOC_SIZE(BUS1_CMD_PEER_SET_RELEASE) != sizeof(id));
+
+	if (get_user(id, (const u64 __user *)arg))
+		return -EFAULT;
+
+	return bus1_peer_set_release_by_id(bus1_peer_dereference(peer), id);
+}
+
+static int bus1_peer_ioctl_node_allocate(struct bus1_peer *peer,
+					 unsigned long arg)
+{
+	struct bus1_cmd_node_allocate param;
+	u64 __user *ptr_ids;
+	size_t i;
+	u64 *ids;
+	int r;
+
+	lockdep_assert_held(&peer->active);
+
+	BUILD_BUG_ON(_IOC_SIZE(BUS1_CMD_NODE_ALLOCATE) != sizeof(param));
+
+	if (copy_from_user(&param, (void __user *)arg, sizeof(param)))
+		return -EFAULT;
+	if (unlikely(param.flags) || unlikely(param.n_ids == 0))
+		return -EINVAL;
+	if (unlikely(param.n_ids > BUS1_NODE_ALLOCATE_MAX))
+		return -EMSGSIZE;
+
+	/* 32bit pointer validity checks */
+	if (unlikely(param.ptr_ids != (u64)(unsigned long)param.ptr_ids))
+		return -EFAULT;
+
+	ids = kmalloc(param.n_ids * sizeof(*ids), GFP_TEMPORARY);
+	if (!ids)
+		return -ENOMEM;
+
+	r = bus1_handle_allocate(peer, ids, param.n_ids);
+	if (r < 0)
+		goto exit;
+
+	ptr_ids = (u64 __user *)(unsigned long)param.ptr_ids;
+	if (copy_to_user(ptr_ids, ids, param.n_ids * sizeof(*ids))) {
+		for (i = 0; i < param.n_ids; ++i)
+			bus1_handle_release_by_id(bus1_peer_dereference(peer),
+						  ids[i]);
+		r = -EFAULT;
+	}
+
+exit:
+	kfree(ids);
 	return r;
 }
 
+static int bus1_peer_ioctl_reply_reserve(struct bus1_peer *peer,
+					 unsigned long arg)
+{
+	struct bus1_cmd_reply_reserve __user *uparam = (void __user *)arg;
+	struct bus1_cmd_reply_reserve param;
+	u64 id;
+	int r;
+
+	lockdep_assert_held(&peer->active);
+
+	BUILD_BUG_ON(_IOC_SIZE(BUS1_CMD_REPLY_RESERVE) != sizeof(param));
+
+	if (copy_from_user(&param, (void __user *)arg, sizeof(param)))
+		return -EFAULT;
+	if (unlikely(param.flags) || unlikely(param.id) ||
+	    unlikely(param.size == 0))
+		return -EINVAL;
+	if (unlikely(param.size > BUS1_POOL_SLICE_SIZE_MAX))
+		return -EMSGSIZE;
+
+	r = bus1_handle_reserve_reply(peer, param.size, &id);
+	if (r < 0)
+		return r;
+
+	if (put_user(id, &uparam->id)) {
+		bus1_handle_release_by_id(bus1_peer_dereference(peer), id);
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
 static int bus1_peer_dequeue_message(struct bus1_peer_info *peer_info,
 				     struct bus1_cmd_recv *param,
 				     struct bus1_message *message)
@@ -593,17 +1331,143 @@ static int bus1_peer_dequeue_message(struct bus1_peer_info *peer_info,
 	if (r < 0)
 		return r;
 
+	param->type = BUS1_MSG_DATA;
+	bus1_message_export(message, &param->data);
+
 	if (message == peer_info->seed)
 		peer_info->seed = NULL;
 	else
 		bus1_queue_remove(&peer_info->queue, &message->qnode);
 
-	bus1_pool_publish(&peer_info->pool, message->slice);
+	bus1_message_publish(message, peer_info);
 	bus1_message_deallocate(message, peer_info);
 
 	return 0;
 }
 
+static void bus1_peer_aggregate_flush(struct bus1_peer_info *peer_info)
+{
+	lockdep_assert_held(&peer_info->lock);
+
+	peer_info->aggregate = bus1_pool_release_kernel(&peer_info->pool,
+							peer_info->aggregate);
+	kfree(peer_info->aggregate_ids);
+	peer_info->aggregate_ids = NULL;
+	peer_info->n_aggregate = 0;
+}
+
+static size_t bus1_peer_aggregate(struct bus1_peer_info *peer_info,
+				  struct bus1_queue_node *node)
+{
+	struct bus1_pool_slice *slice;
+	struct bus1_queue_node *iter;
+	size_t i, n = 1;
+	struct kvec vec;
+	u64 *ids;
+	int r;
+
+	lockdep_assert_held(&peer_info->lock);
+
+	/*
+	 * Count the destruction notifications that directly follow @node and
+	 * are ready to be dequeued as well. Nothing can be ordered in between
+	 * them, so they can be returned as a single event without affecting
+	 * the order of anything else on the queue.
+	 */
+	iter = node;
+	while (n < BUS1_NODE_DESTROY_MAX &&
+	       (iter = bus1_queue_peek_next(&peer_info->queue, iter)) &&
+	       bus1_queue_node_get_type(iter) ==
+					BUS1_QUEUE_NODE_HANDLE_DESTRUCTION)
+		++n;
+
+	/* reuse the slice of an earlier PEEK if it lists the same handles */
+	if (n == peer_info->n_aggregate) {
+		for (i = 0, iter = node; i < n; ++i) {
+			if (peer_info->aggregate_ids[i] !=
+			    bus1_handle_from_queue(iter, peer_info, false))
+				break;
+			iter = bus1_queue_peek_next(&peer_info->queue, iter);
+		}
+		if (i == n)
+			return n;
+	}
+
+	bus1_peer_aggregate_flush(peer_info);
+
+	if (n < 2)
+		return 1;
+
+	ids = kmalloc(n * sizeof(*ids), GFP_KERNEL);
+	if (!ids)
+		return 1;
+
+	slice = bus1_pool_alloc(&peer_info->pool, n * sizeof(*ids));
+	if (IS_ERR(slice)) {
+		kfree(ids);
+		return 1;
+	}
+
+	for (i = 0, iter = node; i < n; ++i) {
+		ids[i] = bus1_handle_from_queue(iter, peer_info, false);
+		iter = bus1_queue_peek_next(&peer_info->queue, iter);
+	}
+
+	vec.iov_base = ids;
+	vec.iov_len = n * sizeof(*ids);
+
+	r = bus1_pool_write_kvec(&peer_info->pool, slice, 0, &vec, 1,
+				 vec.iov_len);
+	if (r < 0) {
+		bus1_pool_release_kernel(&peer_info->pool, slice);
+		kfree(ids);
+		return 1;
+	}
+
+	peer_info->aggregate = slice;
+	peer_info->aggregate_ids = ids;
+	peer_info->n_aggregate = n;
+	return n;
+}
+
+static void bus1_peer_dequeue_destruction(struct bus1_peer_info *peer_info,
+					  struct bus1_cmd_recv *param,
+					  struct bus1_queue_node *node)
+{
+	size_t i, n = 1;
+	u64 id;
+
+	lockdep_assert_held(&peer_info->lock);
+
+	/*
+	 * Peers that opted into BUS1_PEER_FLAG_AGGREGATE get all consecutive
+	 * destruction notifications at once, with the handle IDs stored in a
+	 * pool slice. If the slice cannot be allocated, we simply fall back to
+	 * returning a single notification.
+	 */
+	if (peer_info->flags & BUS1_PEER_FLAG_AGGREGATE)
+		n = bus1_peer_aggregate(peer_info, node);
+
+	param->type = BUS1_MSG_NODE_DESTROY;
+	param->node_destroy.offset = BUS1_OFFSET_INVALID;
+	param->node_destroy.n_handles = n;
+
+	for (i = 0; i < n; ++i) {
+		bus1_queue_remove(&peer_info->queue, node);
+		id = bus1_handle_from_queue(node, peer_info, true);
+		if (i == 0)
+			param->node_destroy.handle = id;
+		node = bus1_queue_peek(&peer_info->queue);
+	}
+
+	/* the notifications are gone, hand the slice over to user-space */
+	if (n > 1) {
+		param->node_destroy.offset = peer_info->aggregate->offset;
+		bus1_pool_publish(&peer_info->pool, peer_info->aggregate);
+		bus1_peer_aggregate_flush(peer_info);
+	}
+}
+
 static int bus1_peer_dequeue(struct bus1_peer_info *peer_info,
 			     struct bus1_cmd_recv *param)
 {
@@ -629,18 +1493,11 @@ static int bus1_peer_dequeue(struct bus1_peer_info *peer_info,
 			if (r < 0)
 				return r;
 
-			param->type = BUS1_MSG_DATA;
-			memcpy(&param->data, &message->data,
-			       sizeof(param->data));
-
 			bus1_message_free(message, peer_info);
 			return 0;
 		}
 		case BUS1_QUEUE_NODE_HANDLE_DESTRUCTION:
-			bus1_queue_remove(&peer_info->queue, node);
-			param->type = BUS1_MSG_NODE_DESTROY;
-			param->node_destroy.handle =
-				bus1_handle_from_queue(node, peer_info, true);
+			bus1_peer_dequeue_destruction(peer_info, param, node);
 			mutex_unlock(&peer_info->lock);
 			return 0;
 		default:
@@ -655,11 +1512,13 @@ static int bus1_peer_dequeue(struct bus1_peer_info *peer_info,
 	return 0;
 }
 
-static void bus1_peer_peek(struct bus1_peer_info *peer_info,
-			   struct bus1_cmd_recv *param)
+static int bus1_peer_peek(struct bus1_peer_info *peer_info,
+			  struct bus1_cmd_recv *param)
 {
 	struct bus1_queue_node *node;
 	struct bus1_message *message;
+	size_t n = 1;
+	int r = 0;
 
 	mutex_lock(&peer_info->lock);
 	if (param->flags & BUS1_RECV_FLAG_SEED)
@@ -671,15 +1530,33 @@ static void bus1_peer_peek(struct bus1_peer_info *peer_info,
 		case BUS1_QUEUE_NODE_MESSAGE_NORMAL:
 		case BUS1_QUEUE_NODE_MESSAGE_SILENT:
 			message = bus1_message_from_node(node);
-			bus1_pool_publish(&peer_info->pool, message->slice);
+			r = bus1_message_pull(message, peer_info);
+			if (r < 0)
+				break;
+			bus1_message_publish(message, peer_info);
 			param->type = BUS1_MSG_DATA;
-			memcpy(&param->data, &message->data,
-			       sizeof(param->data));
+			bus1_message_export(message, &param->data);
 			break;
 		case BUS1_QUEUE_NODE_HANDLE_DESTRUCTION:
+			/*
+			 * Report the same aggregation a following RECV would
+			 * return. The slice stays cached on the peer, so later
+			 * peeks and the final RECV report it again, rather
+			 * than allocating a new one each time.
+			 */
+			if (peer_info->flags & BUS1_PEER_FLAG_AGGREGATE)
+				n = bus1_peer_aggregate(peer_info, node);
 			param->type = BUS1_MSG_NODE_DESTROY;
 			param->node_destroy.handle =
 				bus1_handle_from_queue(node, peer_info, false);
+			param->node_destroy.offset = BUS1_OFFSET_INVALID;
+			param->node_destroy.n_handles = n;
+			if (n > 1) {
+				param->node_destroy.offset =
+					peer_info->aggregate->offset;
+				bus1_pool_publish(&peer_info->pool,
+						  peer_info->aggregate);
+			}
 			break;
 		default:
 			WARN(1, "Invalid queue-node type");
@@ -687,6 +1564,88 @@ static void bus1_peer_peek(struct bus1_peer_info *peer_info,
 		}
 	}
 	mutex_unlock(&peer_info->lock);
+
+	return r;
+}
+
+/* dequeue the next message of any member, starting after the last served */
+static int bus1_peer_set_dequeue(struct bus1_peer_set *set,
+				 struct bus1_cmd_recv *param)
+{
+	struct bus1_peer_info *peer_info;
+	struct bus1_peer *member;
+	size_t i, idx, n_active = 0;
+	int r = -EAGAIN;
+
+	mutex_lock(&set->lock);
+	for (i = 0; i < set->n_members; ++i) {
+		idx = (set->i_next + i) % set->n_members;
+		member = bus1_peer_acquire(set->members[idx]);
+		if (!member)
+			continue;
+
+		++n_active;
+		peer_info = bus1_peer_dereference(member);
+
+		if (READ_ONCE(peer_info->reaper_deadline))
+			bus1_peer_info_expire(peer_info, false);
+
+		r = bus1_peer_dequeue(peer_info, param);
+		if (r >= 0) {
+			param->n_dropped =
+				atomic_xchg(&peer_info->n_dropped, 0);
+			param->n_expired =
+				atomic_xchg(&peer_info->n_expired, 0);
+			if (!param->n_dropped && !param->n_expired &&
+			    param->type == BUS1_MSG_NONE)
+				r = -EAGAIN;
+		}
+
+		bus1_peer_release(member);
+
+		if (r != -EAGAIN) {
+			param->peer_index = idx;
+			set->i_next = idx + 1;
+			break;
+		}
+	}
+	mutex_unlock(&set->lock);
+
+	return n_active ? r : -ESHUTDOWN;
+}
+
+static int bus1_peer_set_recv(struct bus1_peer *peer,
+			      struct bus1_cmd_recv *param)
+{
+	struct bus1_peer_set *set;
+	int r, n_events;
+
+	set = bus1_peer_set_find_by_id(bus1_peer_dereference(peer),
+				       param->peer_set);
+	if (!set)
+		return -ENXIO;
+
+	for (;;) {
+		/* sample the event counter first, so no wake-up is lost */
+		n_events = atomic_read(&set->n_events);
+
+		r = bus1_peer_set_dequeue(set, param);
+		if (r != -EAGAIN || !(param->flags & BUS1_RECV_FLAG_WAIT))
+			break;
+
+		r = wait_event_interruptible(peer->waitq,
+				atomic_read(&set->n_events) != n_events ||
+				bus1_active_is_deactivated(&peer->active));
+		if (r < 0)
+			break;
+		if (bus1_active_is_deactivated(&peer->active)) {
+			r = -ESHUTDOWN;
+			break;
+		}
+	}
+
+	bus1_peer_set_unref(set);
+	return r;
 }
 
 static int bus1_peer_ioctl_recv(struct bus1_peer *peer, unsigned long arg)
@@ -702,29 +1661,131 @@ static int bus1_peer_ioctl_recv(struct bus1_peer *peer, unsigned long arg)
 	if (copy_from_user(&param, (void __user *)arg, sizeof(param)))
 		return -EFAULT;
 	if (unlikely(param.flags & ~(BUS1_RECV_FLAG_PEEK |
-				     BUS1_RECV_FLAG_SEED) ||
+				     BUS1_RECV_FLAG_SEED |
+				     BUS1_RECV_FLAG_PEER_SET |
+				     BUS1_RECV_FLAG_WAIT) ||
 		     param.type != BUS1_MSG_NONE ||
-		     param.n_dropped != 0))
+		     param.n_dropped != 0 ||
+		     param.n_expired != 0 ||
+		     param.peer_index != 0))
 		return -EINVAL;
 
+	if (param.flags & BUS1_RECV_FLAG_PEER_SET) {
+		if (unlikely(param.flags & (BUS1_RECV_FLAG_PEEK |
+					    BUS1_RECV_FLAG_SEED)))
+			return -EINVAL;
+
+		r = bus1_peer_set_recv(peer, &param);
+		if (r < 0)
+			return r;
+
+		return copy_to_user((void __user *)arg,
+				    &param, sizeof(param)) ? -EFAULT : 0;
+	} else if (unlikely(param.peer_set ||
+			    (param.flags & BUS1_RECV_FLAG_WAIT))) {
+		return -EINVAL;
+	}
+
+	/* only peers with messages of pending deadlines pay for this */
+	if (!(param.flags & BUS1_RECV_FLAG_SEED) &&
+	    READ_ONCE(peer_info->reaper_deadline))
+		bus1_peer_info_expire(peer_info, false);
+
 	if (param.flags & BUS1_RECV_FLAG_PEEK) {
-		bus1_peer_peek(peer_info, &param);
+		r = bus1_peer_peek(peer_info, &param);
+		if (r < 0)
+			return r;
+
 		param.n_dropped = atomic_read(&peer_info->n_dropped);
+		param.n_expired = atomic_read(&peer_info->n_expired);
 	} else {
 		r = bus1_peer_dequeue(peer_info, &param);
 		if (r < 0)
 			return r;
 
 		param.n_dropped = atomic_xchg(&peer_info->n_dropped, 0);
+		param.n_expired = atomic_xchg(&peer_info->n_expired, 0);
 	}
 
-	if (!param.n_dropped && param.type == BUS1_MSG_NONE)
+	if (!param.n_dropped && !param.n_expired &&
+	    param.type == BUS1_MSG_NONE)
 		return -EAGAIN;
 
 	return copy_to_user((void __user *)arg,
 			    &param, sizeof(param)) ? -EFAULT : 0;
 }
 
+static int bus1_peer_ioctl_batch(struct bus1_peer *peer, unsigned long arg)
+{
+	struct bus1_batch_cmd __user *ucmds;
+	struct bus1_cmd_batch param;
+	struct bus1_batch_cmd cmd;
+	unsigned long cmd_arg;
+	size_t i;
+	int r;
+
+	lockdep_assert_held(&peer->active);
+
+	BUILD_BUG_ON(_IOC_SIZE(BUS1_CMD_BATCH) != sizeof(param));
+
+	if (copy_from_user(&param, (void __user *)arg, sizeof(param)))
+		return -EFAULT;
+	if (unlikely(param.flags))
+		return -EINVAL;
+	if (unlikely(param.n_cmds > BUS1_BATCH_MAX))
+		return -EMSGSIZE;
+
+	/* 32bit pointer validity checks */
+	if (unlikely(param.ptr_cmds != (u64)(unsigned long)param.ptr_cmds))
+		return -EFAULT;
+
+	ucmds = (struct bus1_batch_cmd __user *)(unsigned long)param.ptr_cmds;
+
+	/*
+	 * Each command is run exactly as if it was issued as ioctl on its
+	 * own, and its result is stored in the command. A failed command does
+	 * not abort the batch, as, e.g., RECV failing with EAGAIN is expected.
+	 * If the command array itself faults, we bail out with EFAULT midway.
+	 * Commands that already ran are not reverted, and user-space loses
+	 * their results if they could not be stored, just like it would with
+	 * a series of separate ioctls.
+	 */
+	for (i = 0; i < param.n_cmds; ++i) {
+		if (copy_from_user(&cmd, ucmds + i, sizeof(cmd)))
+			return -EFAULT;
+
+		cmd_arg = (unsigned long)cmd.ptr_arg;
+		if (unlikely(cmd.ptr_arg != (u64)cmd_arg)) {
+			r = -EFAULT;
+		} else {
+			switch (cmd.cmd) {
+			case BUS1_CMD_HANDLE_RELEASE:
+				r = bus1_peer_ioctl_handle_release(peer,
+								   cmd_arg);
+				break;
+			case BUS1_CMD_SLICE_RELEASE:
+				r = bus1_peer_ioctl_slice_release(peer,
+								  cmd_arg);
+				break;
+			case BUS1_CMD_SEND:
+				r = bus1_peer_ioctl_send(peer, cmd_arg);
+				break;
+			case BUS1_CMD_RECV:
+				r = bus1_peer_ioctl_recv(peer, cmd_arg);
+				break;
+			default:
+				r = -ENOTTY;
+				break;
+			}
+		}
+
+		if (put_user((s64)r, &ucmds[i].result))
+			return -EFAULT;
+	}
+
+	return 0;
+}
+
 /**
  * bus1_peer_ioctl() - handle peer ioctl
  * @peer:		peer to work on
@@ -766,6 +1827,24 @@ int bus1_peer_ioctl(struct bus1_peer *peer,
 		return bus1_peer_ioctl_send(peer, arg);
 	case BUS1_CMD_RECV:
 		return bus1_peer_ioctl_recv(peer, arg);
+	case BUS1_CMD_DEST_SET_REGISTER:
+		return bus1_peer_ioctl_dest_set_register(peer, arg);
+	case BUS1_CMD_DEST_SET_RELEASE:
+		return bus1_peer_ioctl_dest_set_release(peer, arg);
+	case BUS1_CMD_BUFFER_REGISTER:
+		return bus1_peer_ioctl_buffer_register(peer, arg);
+	case BUS1_CMD_BUFFER_RELEASE:
+		return bus1_peer_ioctl_buffer_release(peer, arg);
+	case BUS1_CMD_PEER_SET_REGISTER:
+		return bus1_peer_ioctl_peer_set_register(peer, arg);
+	case BUS1_CMD_PEER_SET_RELEASE:
+		return bus1_peer_ioctl_peer_set_release(peer, arg);
+	case BUS1_CMD_BATCH:
+		return bus1_peer_ioctl_batch(peer, arg);
+	case BUS1_CMD_NODE_ALLOCATE:
+		return bus1_peer_ioctl_node_allocate(peer, arg);
+	case BUS1_CMD_REPLY_RESERVE:
+		return bus1_peer_ioctl_reply_reserve(peer, arg);
 	}
 
 	return -ENOTTY;
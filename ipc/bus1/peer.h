@@ -19,6 +19,7 @@
 #include <linux/atomic.h>
 #include <linux/cred.h>
 #include <linux/kernel.h>
+#include <linux/kref.h>
 #include <linux/lockdep.h>
 #include <linux/mutex.h>
 #include <linux/pid_namespace.h>
@@ -27,6 +28,7 @@
 #include <linux/sched.h>
 #include <linux/seqlock.h>
 #include <linux/wait.h>
+#include <linux/workqueue.h>
 #include <uapi/linux/bus1.h>
 #include "active.h"
 #include "pool.h"
@@ -41,16 +43,35 @@ struct bus1_message;
  * @rcu:			rcu
  * @cred:			user creds
  * @pid_ns:			user pid namespace
+ * @id:				unique ID of this peer, used to coalesce messages
+ * @flags:			peer flags (BUS1_PEER_FLAG_*)
  * @user:			object owner
  * @seed:			seed message
+ * @aggregate:			cached slice of aggregated notifications
+ * @aggregate_ids:		handle IDs stored in @aggregate
+ * @n_aggregate:		number of handle IDs in @aggregate
  * @quota:			quota handling
  * @pool:			data pool
  * @queue:			message queue, rcu-accessible
  * @map_handles_by_id:		map of owned handles, by handle id
  * @map_handles_by_node:	map of owned handles, by node pointer
+ * @map_dest_sets:		map of registered destination sets, by set id
+ * @map_peer_sets:		map of registered peer sets, by set id
+ * @map_buffers:		map of registered send buffers, by buffer id
+ * @map_coalesce:		map of queued messages, by sender and coalescing key
+ * @map_deadlines:		map of queued messages, by deadline
+ * @reaper:			delayed work to drop expired messages
+ * @reaper_deadline:		deadline @reaper is armed for, or 0
  * @seqcount:			sequence counter
  * @n_dropped:			number of lost messages since last report
+ * @n_expired:			number of expired messages since last report
  * @handle_ids:			handle ID allocator
+ * @dest_set_ids:		destination set ID allocator
+ * @n_dest_sets:		number of registered destination sets
+ * @peer_set_ids:		peer set ID allocator
+ * @n_peer_sets:		number of registered peer sets
+ * @buffer_ids:			send buffer ID allocator
+ * @n_buffers:			number of registered send buffers
  * @n_allocated:		remaining quota for allocated pool memory
  * @n_messages:			remaining quota for owned messages
  * @n_handles:			remaining quota for owned handles
@@ -63,16 +84,35 @@ struct bus1_peer_info {
 	};
 	const struct cred *cred;
 	struct pid_namespace *pid_ns;
+	u64 id;
+	u64 flags;
 	struct bus1_user *user;
 	struct bus1_message *seed;
+	struct bus1_pool_slice *aggregate;
+	u64 *aggregate_ids;
+	size_t n_aggregate;
 	struct bus1_user_quota quota;
 	struct bus1_pool pool;
 	struct bus1_queue queue;
 	struct rb_root map_handles_by_id;
 	struct rb_root map_handles_by_node;
+	struct rb_root map_dest_sets;
+	struct rb_root map_peer_sets;
+	struct rb_root map_buffers;
+	struct rb_root map_coalesce;
+	struct rb_root map_deadlines;
+	struct delayed_work reaper;
+	u64 reaper_deadline;
 	struct seqcount seqcount;
 	atomic_t n_dropped;
+	atomic_t n_expired;
 	u64 handle_ids;
+	u64 dest_set_ids;
+	size_t n_dest_sets;
+	u64 peer_set_ids;
+	size_t n_peer_sets;
+	u64 buffer_ids;
+	size_t n_buffers;
 
 	size_t n_allocated;
 	size_t n_messages;
@@ -86,18 +126,57 @@ struct bus1_peer_info {
  * @waitq:		peer wide wait queue
  * @active:		active references
  * @info:		underlying peer information
+ * @set:		peer set this peer is a member of, or NULL
  */
 struct bus1_peer {
 	struct rcu_head rcu;
 	wait_queue_head_t waitq;
 	struct bus1_active active;
 	struct bus1_peer_info __rcu *info;
+	struct bus1_peer_set __rcu *set;
+};
+
+/**
+ * struct bus1_peer_set - registered peer set
+ * @ref:		object ref-count
+ * @rcu:		rcu
+ * @rb:			link into owning peer, based on ID
+ * @lock:		receive lock, protects @i_next and @members
+ * @waitq:		wait queue of the owning peer
+ * @n_events:		number of wake-ups of any member
+ * @id:			ID of this set
+ * @i_next:		index of the member to receive from next
+ * @n_members:		number of member slots
+ * @members:		member peers, or NULL if detached
+ *
+ * A peer set is a list of peers registered on an owning peer, which can then
+ * receive from any of them with a single BUS1_CMD_RECV. A set does not pin
+ * its members. Instead, each member links back to the set it is part of, and
+ * detaches itself when it is destroyed. A peer can be member of at most one
+ * set at a time.
+ *
+ * Lock order: the global set lock is taken before @lock and before the lock
+ * of the owning peer. @lock is held while dequeuing from each member, so it
+ * nests outside the peer_info lock of every member.
+ */
+struct bus1_peer_set {
+	struct kref ref;
+	struct rcu_head rcu;
+	struct rb_node rb;
+	struct mutex lock;
+	wait_queue_head_t *waitq;
+	atomic_t n_events;
+	u64 id;
+	size_t i_next;
+	size_t n_members;
+	struct bus1_peer *members[0];
 };
 
 struct bus1_peer *bus1_peer_new(void);
 struct bus1_peer *bus1_peer_free(struct bus1_peer *peer);
 int bus1_peer_disconnect(struct bus1_peer *peer);
 int bus1_peer_ioctl_init(struct bus1_peer *peer, unsigned long arg);
+void bus1_peer_info_arm_reaper(struct bus1_peer_info *peer_info, u64 deadline);
 int bus1_peer_ioctl(struct bus1_peer *peer,
 		    struct file *peer_file,
 		    unsigned int cmd,
@@ -177,11 +256,23 @@ bus1_peer_dereference(struct bus1_peer *peer)
  * bus1_peer_wake() - wake up peer
  * @peer:		peer to wake up
  *
- * This wakes up a peer and notifies user-space about poll() events.
+ * This wakes up a peer and notifies user-space about poll() events. If the
+ * peer is member of a peer set, receivers blocking on that set are woken up
+ * as well.
  */
 static inline void bus1_peer_wake(struct bus1_peer *peer)
 {
+	struct bus1_peer_set *set;
+
 	wake_up_interruptible(&peer->waitq);
+
+	rcu_read_lock();
+	set = rcu_dereference(peer->set);
+	if (set) {
+		atomic_inc(&set->n_events);
+		wake_up_interruptible(set->waitq);
+	}
+	rcu_read_unlock();
 }
 
 #endif /* __BUS1_PEER_H */
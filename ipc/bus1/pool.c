@@ -10,12 +10,16 @@
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 #include <linux/aio.h>
 #include <linux/err.h>
+#include <linux/falloc.h>
 #include <linux/file.h>
 #include <linux/fs.h>
 #include <linux/highmem.h>
 #include <linux/kernel.h>
+#include <linux/kref.h>
 #include <linux/lockdep.h>
 #include <linux/mm.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
 #include <linux/pagemap.h>
 #include <linux/rbtree.h>
 #include <linux/sched.h>
@@ -26,6 +30,7 @@
 #include <linux/uio.h>
 #include "peer.h"
 #include "pool.h"
+#include "share.h"
 
 /* lockdep assertion to verify the parent peer is locked */
 #define bus1_pool_assert_held(_pool) \
@@ -152,47 +157,59 @@ bus1_pool_slice_find_by_offset(struct bus1_pool *pool, size_t offset)
 	return NULL;
 }
 
-/**
- * bus1_pool_create_internal() - create memory pool
- * @pool:	(uninitialized) pool to operate on
- * @size:	size of the pool
- *
- * Initialize a new pool object. This allocates a backing shmem object with the
- * given name and size.
- *
- * Note that all pools must be embedded into a parent bus1_peer_info object. The
- * code works fine, if you don't, but the lockdep-annotations will fail
- * horribly. They rely on container_of() to be valid on every pool. Use the
- * bus1_pool_create_for_peer() macro to make sure you never violate this rule.
- *
- * Return: 0 on success, negative error code on failure.
+static void bus1_pool_group_free(struct kref *ref)
+{
+	struct bus1_pool_group *group;
+
+	group = container_of(ref, struct bus1_pool_group, ref);
+
+	WARN_ON(!list_empty(&group->pools));
+	mutex_destroy(&group->lock);
+	kfree(group);
+}
+
+/*
+ * Unlink @pool from its group. If other pools still share the shmem object @f,
+ * the memory of @pool is punched out of it first. This frees its pages right
+ * away, and the next pool placed into the region starts out zeroed. It is done
+ * before unlinking, so the region cannot be reused concurrently.
  */
-int bus1_pool_create_internal(struct bus1_pool *pool, size_t size)
+static void bus1_pool_group_unlink(struct bus1_pool *pool, struct file *f)
 {
-	struct bus1_pool_slice *slice;
-	struct page *p;
-	struct file *f;
+	struct bus1_pool_group *group = pool->group;
 	int r;
 
-	/* cannot calculate width of bitfields, so hardcode '4' as flag-size */
-	BUILD_BUG_ON(BUS1_POOL_SLICE_SIZE_BITS + 4 > 32);
-	BUILD_BUG_ON(BUS1_POOL_SIZE_MAX >=
-		     (1ULL <<
-		      (sizeof(((struct bus1_pool_slice *)0)->offset) * 8)));
+	mutex_lock(&group->lock);
+	if (!list_is_singular(&group->pools)) {
+		r = vfs_fallocate(f, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				  pool->base, PAGE_ALIGN(pool->size));
+		WARN_ON(r < 0);
+	}
+	list_del(&pool->group_entry);
+	mutex_unlock(&group->lock);
 
-	size = ALIGN(size, 8);
-	if (size == 0 || size > BUS1_POOL_SIZE_MAX)
-		return -EMSGSIZE;
+	kref_put(&group->ref, bus1_pool_group_free);
+	pool->group = NULL;
+}
 
-	f = shmem_file_setup(KBUILD_MODNAME "-peer", size, 0);
-	if (IS_ERR(f))
-		return PTR_ERR(f);
+/*
+ * Initialize @pool to manage @size bytes at @base of @f. The pool must already
+ * be linked into its group. Consumes @f and the group reference of @pool.
+ */
+static int bus1_pool_init(struct bus1_pool *pool,
+			  struct file *f,
+			  size_t base,
+			  size_t size)
+{
+	struct bus1_pool_slice *slice;
+	struct page *p;
+	int r;
 
 	r = get_write_access(file_inode(f));
 	if (r < 0)
 		goto error_put_file;
 
-	slice = bus1_pool_slice_new(0, size);
+	slice = bus1_pool_slice_new(base, size);
 	if (IS_ERR(slice)) {
 		r = PTR_ERR(slice);
 		goto error_put_write;
@@ -203,11 +220,15 @@ int bus1_pool_create_internal(struct bus1_pool *pool, size_t size)
 	slice->ref_user = false;
 
 	pool->f = f;
+	pool->base = base;
 	pool->size = size;
 	pool->allocated_size = 0;
 	INIT_LIST_HEAD(&pool->slices);
 	pool->slices_free = RB_ROOT;
 	pool->slices_busy = RB_ROOT;
+	spin_lock_init(&pool->shares_lock);
+	pool->shares = RB_ROOT;
+	pool->shares_offset = BUS1_POOL_SHARES_OFFSET;
 
 	list_add(&slice->entry, &pool->slices);
 	bus1_pool_slice_link_free(slice, pool);
@@ -218,7 +239,8 @@ int bus1_pool_create_internal(struct bus1_pool *pool, size_t size)
 	 * really just an optimization to avoid some random peaks in common
 	 * paths. It is not meant as ultimate protection.
 	 */
-	p = shmem_read_mapping_page(file_inode(f)->i_mapping, 0);
+	p = shmem_read_mapping_page(file_inode(f)->i_mapping,
+				    base >> PAGE_SHIFT);
 	if (!IS_ERR(p))
 		put_page(p);
 
@@ -227,10 +249,134 @@ int bus1_pool_create_internal(struct bus1_pool *pool, size_t size)
 error_put_write:
 	put_write_access(file_inode(f));
 error_put_file:
+	bus1_pool_group_unlink(pool, f);
 	fput(f);
 	return r;
 }
 
+/**
+ * bus1_pool_create_internal() - create memory pool
+ * @pool:	(uninitialized) pool to operate on
+ * @size:	size of the pool
+ *
+ * Initialize a new pool object. This allocates a backing shmem object with the
+ * given name and size.
+ *
+ * Note that all pools must be embedded into a parent bus1_peer_info object. The
+ * code works fine, if you don't, but the lockdep-annotations will fail
+ * horribly. They rely on container_of() to be valid on every pool. Use the
+ * bus1_pool_create_for_peer() macro to make sure you never violate this rule.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int bus1_pool_create_internal(struct bus1_pool *pool, size_t size)
+{
+	struct bus1_pool_group *group;
+	struct file *f;
+
+	/* cannot calculate width of bitfields, so hardcode '4' as flag-size */
+	BUILD_BUG_ON(BUS1_POOL_SLICE_SIZE_BITS + 4 > 32);
+	BUILD_BUG_ON(BUS1_POOL_SIZE_MAX >=
+		     (1ULL <<
+		      (sizeof(((struct bus1_pool_slice *)0)->offset) * 8)));
+	BUILD_BUG_ON(!PAGE_ALIGNED(BUS1_POOL_SHARES_OFFSET));
+
+	size = ALIGN(size, 8);
+	if (size == 0 || size > BUS1_POOL_SIZE_MAX)
+		return -EMSGSIZE;
+
+	group = kmalloc(sizeof(*group), GFP_KERNEL);
+	if (!group)
+		return -ENOMEM;
+
+	kref_init(&group->ref);
+	mutex_init(&group->lock);
+	INIT_LIST_HEAD(&group->pools);
+
+	f = shmem_file_setup(KBUILD_MODNAME "-peer", size, 0);
+	if (IS_ERR(f)) {
+		kref_put(&group->ref, bus1_pool_group_free);
+		return PTR_ERR(f);
+	}
+
+	pool->group = group;
+	pool->base = 0;
+	pool->size = size;
+	list_add(&pool->group_entry, &group->pools);
+
+	return bus1_pool_init(pool, f, 0, size);
+}
+
+/**
+ * bus1_pool_create_shared_internal() - create memory pool in existing pool
+ * @pool:	(uninitialized) pool to operate on
+ * @parent:	pool to share the backing shmem object with
+ * @size:	size of the pool
+ *
+ * Initialize a new pool object, similar to bus1_pool_create_internal().
+ * However, rather than allocating a new shmem object, the shmem object of
+ * @parent is shared. The new pool manages a page-aligned region of it, which
+ * is either the first gap left by a destroyed pool of the group that is big
+ * enough, or appended to the shmem object. Each pool takes its own reference
+ * to the shmem object. Hence, @parent can be destroyed independently of @pool.
+ * The regions of all pools sharing a shmem object never overlap.
+ *
+ * Just like bus1_pool_create_internal(), this must only be used via the
+ * bus1_pool_create_shared_for_peer() macro.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int bus1_pool_create_shared_internal(struct bus1_pool *pool,
+				     struct bus1_pool *parent,
+				     size_t size)
+{
+	struct bus1_pool_group *group = parent->group;
+	struct inode *inode = file_inode(parent->f);
+	struct iattr attr = {};
+	struct bus1_pool *p;
+	loff_t base = 0;
+	int r = 0;
+
+	size = ALIGN(size, 8);
+	if (size == 0 || size > BUS1_POOL_SIZE_MAX)
+		return -EMSGSIZE;
+
+	/* the group lock serializes parallel clones of the same object */
+	mutex_lock(&group->lock);
+
+	/* find the first gap big enough, @p is the pool following it */
+	list_for_each_entry(p, &group->pools, group_entry) {
+		if (base + size <= p->base)
+			break;
+		base = PAGE_ALIGN(p->base + p->size);
+	}
+
+	if (base + size > BUS1_POOL_SIZE_MAX) {
+		r = -EMSGSIZE;
+	} else if (base + size > i_size_read(inode)) {
+		attr.ia_valid = ATTR_SIZE;
+		attr.ia_size = base + size;
+		inode_lock(inode);
+		r = notify_change(parent->f->f_path.dentry, &attr, NULL);
+		inode_unlock(inode);
+	}
+
+	if (r >= 0) {
+		kref_get(&group->ref);
+		pool->group = group;
+		pool->base = base;
+		pool->size = size;
+		/* link before @p, or at the tail if there is no gap */
+		list_add_tail(&pool->group_entry, &p->group_entry);
+	}
+
+	mutex_unlock(&group->lock);
+	if (r < 0)
+		return r;
+
+	return bus1_pool_init(pool, get_file(parent->f), base, size);
+}
+
 /**
  * bus1_pool_destroy() - pool to destroy
  * @pool:	pool to destroy, or NULL
@@ -239,16 +385,25 @@ error_put_file:
  * NULL is passed, or if @pool->f is NULL (i.e., the pool was initialized to 0
  * but not created via bus1_pool_create(), yet), then this is a no-op.
  *
- * The caller must make sure that no kernel reference to any slice exists. Any
- * pending user-space reference to any slice is dropped by this function.
+ * The caller must make sure that no kernel reference to any slice, or view of
+ * a shared payload, exists. Any pending user-space reference to either is
+ * dropped by this function.
  */
 void bus1_pool_destroy(struct bus1_pool *pool)
 {
+	struct bus1_pool_share *ps, *t;
 	struct bus1_pool_slice *slice;
 
 	if (!pool || !pool->f)
 		return;
 
+	rbtree_postorder_for_each_entry_safe(ps, t, &pool->shares, rb) {
+		WARN_ON(ps->ref_kernel);
+		bus1_share_unref(ps->share);
+		kfree(ps);
+	}
+	pool->shares = RB_ROOT;
+
 	while ((slice = list_first_entry_or_null(&pool->slices,
 						 struct bus1_pool_slice,
 						 entry))) {
@@ -257,11 +412,48 @@ void bus1_pool_destroy(struct bus1_pool *pool)
 		bus1_pool_slice_free(slice);
 	}
 
+	bus1_pool_group_unlink(pool, pool->f);
 	put_write_access(file_inode(pool->f));
 	fput(pool->f);
 	pool->f = NULL;
 }
 
+/* claim the first @slice_size bytes of free slice @slice, return them busy */
+static struct bus1_pool_slice *
+bus1_pool_slice_claim(struct bus1_pool *pool,
+		      struct bus1_pool_slice *slice,
+		      size_t slice_size)
+{
+	struct bus1_pool_slice *ps;
+
+	/* split slice if it doesn't match exactly */
+	if (slice_size < slice->size) {
+		ps = bus1_pool_slice_new(slice->offset + slice_size,
+					 slice->size - slice_size);
+		if (IS_ERR(ps))
+			return ERR_CAST(ps);
+
+		ps->free = true;
+		ps->ref_kernel = false;
+		ps->ref_user = false;
+
+		list_add(&ps->entry, &slice->entry); /* add after @slice */
+		bus1_pool_slice_link_free(ps, pool);
+
+		slice->size = slice_size;
+	}
+
+	/* move from free-tree to busy-tree */
+	rb_erase(&slice->rb, &pool->slices_free);
+	bus1_pool_slice_link_busy(slice, pool);
+
+	slice->ref_kernel = true;
+	slice->ref_user = false;
+	slice->free = false;
+
+	return slice;
+}
+
 /**
  * bus1_pool_alloc() - allocate memory
  * @pool:	pool to allocate memory from
@@ -287,7 +479,7 @@ void bus1_pool_destroy(struct bus1_pool *pool)
  */
 struct bus1_pool_slice *bus1_pool_alloc(struct bus1_pool *pool, size_t size)
 {
-	struct bus1_pool_slice *slice, *ps;
+	struct bus1_pool_slice *slice;
 	size_t slice_size;
 
 	bus1_pool_assert_held(pool);
@@ -301,10 +493,64 @@ struct bus1_pool_slice *bus1_pool_alloc(struct bus1_pool *pool, size_t size)
 	if (!slice)
 		return ERR_PTR(-EXFULL);
 
-	/* split slice if it doesn't match exactly */
-	if (slice_size < slice->size) {
-		ps = bus1_pool_slice_new(slice->offset + slice_size,
-					 slice->size - slice_size);
+	return bus1_pool_slice_claim(pool, slice, slice_size);
+}
+
+/**
+ * bus1_pool_alloc_aligned() - allocate page-aligned memory
+ * @pool:	pool to allocate memory from
+ * @size:	number of bytes to allocate
+ *
+ * This is similar to bus1_pool_alloc(), but the returned slice starts at a
+ * page-aligned offset, and its size is rounded up to a multiple of the page
+ * size. Hence, user-space can use the slice for page-granular operations
+ * (like O_DIRECT or vmsplice()) on the pool mapping, without copying it.
+ *
+ * Any unaligned head of the free slice that is used stays free. Note that this
+ * scans all free slices big enough for @size, so it should only be used for
+ * large allocations, where the scan is negligible compared to the copy.
+ *
+ * Return: Pointer to new slice, or ERR_PTR on failure.
+ */
+struct bus1_pool_slice *bus1_pool_alloc_aligned(struct bus1_pool *pool,
+						size_t size)
+{
+	struct bus1_pool_slice *slice = NULL, *prev, *ps;
+	size_t slice_size, head = 0;
+	struct rb_node *n;
+
+	bus1_pool_assert_held(pool);
+
+	slice_size = ALIGN(size, PAGE_SIZE);
+	if (slice_size == 0 || slice_size > BUS1_POOL_SLICE_SIZE_MAX)
+		return ERR_PTR(-EMSGSIZE);
+
+	/* find smallest free slice big enough, ignoring alignment */
+	n = pool->slices_free.rb_node;
+	while (n) {
+		ps = container_of(n, struct bus1_pool_slice, rb);
+		if (slice_size <= ps->size) {
+			slice = ps;
+			n = n->rb_left;
+		} else {
+			n = n->rb_right;
+		}
+	}
+
+	/* walk towards bigger slices until one fits with alignment */
+	for (n = slice ? &slice->rb : NULL; n; n = rb_next(n)) {
+		slice = container_of(n, struct bus1_pool_slice, rb);
+		head = ALIGN(slice->offset, PAGE_SIZE) - slice->offset;
+		if (head + slice_size <= slice->size)
+			break;
+	}
+	if (!n)
+		return ERR_PTR(-EXFULL);
+
+	/* split off the unaligned head, it stays free */
+	if (head > 0) {
+		ps = bus1_pool_slice_new(slice->offset + head,
+					 slice->size - head);
 		if (IS_ERR(ps))
 			return ERR_CAST(ps);
 
@@ -312,21 +558,59 @@ struct bus1_pool_slice *bus1_pool_alloc(struct bus1_pool *pool, size_t size)
 		ps->ref_kernel = false;
 		ps->ref_user = false;
 
+		rb_erase(&slice->rb, &pool->slices_free);
+		slice->size = head;
+		bus1_pool_slice_link_free(slice, pool);
+
 		list_add(&ps->entry, &slice->entry); /* add after @slice */
 		bus1_pool_slice_link_free(ps, pool);
+		slice = ps;
+	}
 
-		slice->size = slice_size;
+	ps = bus1_pool_slice_claim(pool, slice, slice_size);
+	if (IS_ERR(ps) && head > 0) {
+		/* merge the head back, so no two free slices are adjacent */
+		prev = list_prev_entry(slice, entry);
+		rb_erase(&prev->rb, &pool->slices_free);
+		rb_erase(&slice->rb, &pool->slices_free);
+		list_del(&slice->entry);
+		prev->size += slice->size;
+		bus1_pool_slice_link_free(prev, pool);
+		bus1_pool_slice_free(slice);
 	}
 
-	/* move from free-tree to busy-tree */
-	rb_erase(&slice->rb, &pool->slices_free);
-	bus1_pool_slice_link_busy(slice, pool);
+	return ps;
+}
 
-	slice->ref_kernel = true;
-	slice->ref_user = false;
-	slice->free = false;
+/**
+ * bus1_pool_alloc_partial() - allocate memory, possibly less than requested
+ * @pool:	pool to allocate memory from
+ * @size:	maximum number of bytes to allocate
+ *
+ * This is similar to bus1_pool_alloc(), but if no free slice can hold @size
+ * bytes, the largest free slice is allocated instead. Hence, the returned
+ * slice might be smaller than @size. This is used to scatter data across
+ * multiple slices, if the pool is fragmented.
+ *
+ * Return: Pointer to new slice, or ERR_PTR on failure.
+ */
+struct bus1_pool_slice *bus1_pool_alloc_partial(struct bus1_pool *pool,
+						size_t size)
+{
+	struct bus1_pool_slice *slice;
+	struct rb_node *n;
 
-	return slice;
+	bus1_pool_assert_held(pool);
+
+	/* the free-tree is sorted by size, so the last entry is the largest */
+	n = rb_last(&pool->slices_free);
+	if (!n)
+		return ERR_PTR(-EXFULL);
+
+	slice = container_of(n, struct bus1_pool_slice, rb);
+	size = min_t(size_t, ALIGN(size, 8), slice->size);
+
+	return bus1_pool_alloc(pool, size);
 }
 
 static void bus1_pool_free(struct bus1_pool *pool,
@@ -423,6 +707,41 @@ void bus1_pool_publish(struct bus1_pool *pool, struct bus1_pool_slice *slice)
 	slice->ref_user = true;
 }
 
+static struct bus1_pool_share *
+bus1_pool_share_find_by_offset(struct bus1_pool *pool, u64 offset)
+{
+	struct bus1_pool_share *ps;
+	struct rb_node *n;
+
+	n = pool->shares.rb_node;
+	while (n) {
+		ps = container_of(n, struct bus1_pool_share, rb);
+		if (offset < ps->offset)
+			n = n->rb_left;
+		else if (offset > ps->offset)
+			n = n->rb_right;
+		else
+			return ps;
+	}
+
+	return NULL;
+}
+
+static void bus1_pool_share_free(struct bus1_pool *pool,
+				 struct bus1_pool_share *ps)
+{
+	/* don't free the view if either has a reference */
+	if (ps->ref_kernel || ps->ref_user)
+		return;
+
+	spin_lock(&pool->shares_lock);
+	rb_erase(&ps->rb, &pool->shares);
+	spin_unlock(&pool->shares_lock);
+
+	bus1_share_unref(ps->share);
+	kfree(ps);
+}
+
 /**
  * bus1_pool_release_user() - release a public slice
  * @pool:	pool to operate on
@@ -430,19 +749,32 @@ void bus1_pool_publish(struct bus1_pool *pool, struct bus1_pool_slice *slice)
  *
  * Release the user-space reference to a pool-slice, specified via the offset
  * of the slice. If both, the user-space reference *and* the kernel-space
- * reference to the slice are gone, the slice will be actually freed.
+ * reference to the slice are gone, the slice will be actually freed. Offsets
+ * from BUS1_POOL_SHARES_OFFSET on refer to views of shared payloads, which are
+ * released the same way.
  *
  * If no slice exists with the given offset, or if there is no user-space
  * reference to the specified slice, an error is returned.
  *
  * Return: 0 on success, negative error code on failure.
  */
-int bus1_pool_release_user(struct bus1_pool *pool, size_t offset)
+int bus1_pool_release_user(struct bus1_pool *pool, u64 offset)
 {
 	struct bus1_pool_slice *slice;
+	struct bus1_pool_share *ps;
 
 	bus1_pool_assert_held(pool);
 
+	if (offset >= BUS1_POOL_SHARES_OFFSET) {
+		ps = bus1_pool_share_find_by_offset(pool, offset);
+		if (!ps || !ps->ref_user)
+			return -ENXIO;
+
+		ps->ref_user = false;
+		bus1_pool_share_free(pool, ps);
+		return 0;
+	}
+
 	slice = bus1_pool_slice_find_by_offset(pool, offset);
 	if (!slice || !slice->ref_user)
 		return -ENXIO;
@@ -457,12 +789,13 @@ int bus1_pool_release_user(struct bus1_pool *pool, size_t offset)
  * bus1_pool_flush() - flush all user references
  * @pool:	pool to flush
  *
- * This flushes all user-references to any slice in @pool. Kernel references
- * are left untouched.
+ * This flushes all user-references to any slice, and any view of a shared
+ * payload, in @pool. Kernel references are left untouched.
  */
 void bus1_pool_flush(struct bus1_pool *pool)
 {
 	struct bus1_pool_slice *slice;
+	struct bus1_pool_share *ps;
 	struct rb_node *node, *t;
 
 	bus1_pool_assert_held(pool);
@@ -483,6 +816,140 @@ void bus1_pool_flush(struct bus1_pool *pool)
 		slice->ref_user = false;
 		bus1_pool_free(pool, slice);
 	}
+
+	for (node = rb_first(&pool->shares);
+	     node && ((t = rb_next(node)), true);
+	     node = t) {
+		ps = container_of(node, struct bus1_pool_share, rb);
+		if (!ps->ref_user)
+			continue;
+
+		ps->ref_user = false;
+		bus1_pool_share_free(pool, ps);
+	}
+}
+
+/**
+ * bus1_pool_share_link() - link view of a shared payload into a pool
+ * @pool:	pool to operate on
+ * @share:	shared payload to link
+ *
+ * This allocates a new view of @share in @pool. The view is placed at a
+ * page-aligned offset beyond BUS1_POOL_SHARES_OFFSET, and offsets are never
+ * reused. The view pins @share until both its kernel and user reference are
+ * dropped, just like a pool slice (see bus1_pool_alloc()).
+ *
+ * Return: Pointer to new view, or ERR_PTR on failure.
+ */
+struct bus1_pool_share *bus1_pool_share_link(struct bus1_pool *pool,
+					     struct bus1_share *share)
+{
+	struct bus1_pool_share *ps, *iter;
+	struct rb_node **n, *prev = NULL;
+
+	bus1_pool_assert_held(pool);
+
+	ps = kmalloc(sizeof(*ps), GFP_KERNEL);
+	if (!ps)
+		return ERR_PTR(-ENOMEM);
+
+	ps->offset = pool->shares_offset;
+	ps->share = bus1_share_ref(share);
+	ps->ref_kernel = true;
+	ps->ref_user = false;
+	pool->shares_offset += (u64)share->n_pages << PAGE_SHIFT;
+
+	spin_lock(&pool->shares_lock);
+	n = &pool->shares.rb_node;
+	while (*n) {
+		prev = *n;
+		iter = container_of(prev, struct bus1_pool_share, rb);
+		if (ps->offset < iter->offset)
+			n = &prev->rb_left;
+		else
+			n = &prev->rb_right;
+	}
+	rb_link_node(&ps->rb, prev, n);
+	rb_insert_color(&ps->rb, &pool->shares);
+	spin_unlock(&pool->shares_lock);
+
+	return ps;
+}
+
+/**
+ * bus1_pool_share_release_kernel() - release kernel-owned view reference
+ * @pool:	pool to operate on
+ * @ps:		view to release, or NULL
+ *
+ * This is the equivalent of bus1_pool_release_kernel() for views of shared
+ * payloads.
+ *
+ * Return: NULL is returned.
+ */
+struct bus1_pool_share *
+bus1_pool_share_release_kernel(struct bus1_pool *pool,
+			       struct bus1_pool_share *ps)
+{
+	if (!ps || WARN_ON(!ps->ref_kernel))
+		return NULL;
+
+	bus1_pool_assert_held(pool);
+
+	ps->ref_kernel = false;
+	bus1_pool_share_free(pool, ps);
+
+	return NULL;
+}
+
+/**
+ * bus1_pool_share_publish() - publish a view
+ * @pool:	pool to operate on
+ * @ps:		view to publish
+ *
+ * This is the equivalent of bus1_pool_publish() for views of shared payloads.
+ * Once published, user-space can map the view via mmap() at its offset.
+ */
+void bus1_pool_share_publish(struct bus1_pool *pool,
+			     struct bus1_pool_share *ps)
+{
+	bus1_pool_assert_held(pool);
+
+	/* kernel must own a ref to @ps to publish it */
+	WARN_ON(!ps->ref_kernel);
+	ps->ref_user = true;
+}
+
+/**
+ * bus1_pool_share_mmap() - map a view of a shared payload
+ * @pool:	pool to operate on
+ * @vma:	read-only mapping to fill
+ *
+ * This looks up the published view at the offset of @vma and maps the shared
+ * payload into @vma. This is called from mmap() with mmap_sem held, hence, it
+ * must not take the peer lock. Views are looked up under @pool->shares_lock
+ * instead.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int bus1_pool_share_mmap(struct bus1_pool *pool, struct vm_area_struct *vma)
+{
+	struct bus1_share *share = NULL;
+	struct bus1_pool_share *ps;
+	int r;
+
+	spin_lock(&pool->shares_lock);
+	ps = bus1_pool_share_find_by_offset(pool,
+					(u64)vma->vm_pgoff << PAGE_SHIFT);
+	if (ps && ps->ref_user)
+		share = bus1_share_ref(ps->share);
+	spin_unlock(&pool->shares_lock);
+
+	if (!share)
+		return -ENXIO;
+
+	r = bus1_share_mmap(share, vma);
+	bus1_share_unref(share);
+	return r;
 }
 
 /**
@@ -560,3 +1027,122 @@ ssize_t bus1_pool_write_kvec(struct bus1_pool *pool,
 
 	return (len >= 0 && len != total_len) ? -EFAULT : len;
 }
+
+/*
+ * User-space payloads of at least this many bytes are copied into the pool
+ * with non-temporal stores, 0 disables this. The sender never reads the pool
+ * of its destination, and the receiver usually runs on another CPU, so
+ * pulling large payloads through the cache of the sender merely evicts its
+ * working set.
+ */
+static unsigned int bus1_pool_nocache_threshold = SZ_256K;
+module_param_named(pool_nocache_threshold, bus1_pool_nocache_threshold,
+		   uint, 0644);
+MODULE_PARM_DESC(pool_nocache_threshold,
+		 "Minimum payload size copied with cache-bypassing stores");
+
+/*
+ * This follows generic_perform_write(): the source is faulted in first, and
+ * then copied with page-faults disabled while the target page is locked. The
+ * source might be a mapping of this very pool, so faulting it in with the
+ * page locked could deadlock.
+ */
+static ssize_t bus1_pool_write_iter_nocache(struct bus1_pool *pool,
+					    loff_t offset,
+					    struct iov_iter *iter,
+					    size_t total_len)
+{
+	struct address_space *mapping = file_inode(pool->f)->i_mapping;
+	size_t n, pos, copied, total = 0;
+	bool short_copy = false;
+	struct page *page;
+	void *addr;
+
+	while (total < total_len) {
+		pos = offset & ~PAGE_MASK;
+		n = min_t(size_t, PAGE_SIZE - pos, total_len - total);
+
+		/*
+		 * After a short copy, the source was paged out again before we
+		 * got to it. Retry with the first segment only, in case the
+		 * rest of it is not accessible at all.
+		 */
+		if (unlikely(short_copy))
+			n = min_t(size_t, n, iov_iter_single_seg_count(iter));
+
+		if (unlikely(iov_iter_fault_in_readable(iter, n)))
+			return -EFAULT;
+
+		page = shmem_read_mapping_page(mapping, offset >> PAGE_SHIFT);
+		if (IS_ERR(page))
+			return PTR_ERR(page);
+
+		lock_page(page);
+		addr = kmap_atomic(page);
+		copied = copy_from_iter_nocache(addr + pos, n, iter);
+		kunmap_atomic(addr);
+		flush_dcache_page(page);
+		set_page_dirty(page);
+		unlock_page(page);
+		put_page(page);
+
+		short_copy = (copied == 0);
+		offset += copied;
+		total += copied;
+	}
+
+	return total;
+}
+
+/**
+ * bus1_pool_write_iter() - copy data from an iterator to a slice
+ * @pool:		pool to operate on
+ * @slice:		slice to write to
+ * @offset:		relative offset into slice memory
+ * @iter:		iterator to copy data from
+ * @total_len:		total number of bytes to copy
+ *
+ * This copies @total_len bytes from @iter into the memory slice @slice at
+ * relative offset @offset (relative to begin of slice). @iter is advanced by
+ * the number of bytes copied, but is otherwise left untouched. Hence, a single
+ * iterator can be spread across multiple slices.
+ *
+ * The caller must have set up the address space for @iter.
+ *
+ * Large copies from user-space bypass the CPU caches, see
+ * bus1_pool_nocache_threshold. Kernel memory is always copied regularly, as
+ * it is only written by the receiver itself, which is about to read it.
+ *
+ * Return: Numbers of bytes copied, negative error code on failure.
+ */
+ssize_t bus1_pool_write_iter(struct bus1_pool *pool,
+			     struct bus1_pool_slice *slice,
+			     loff_t offset,
+			     struct iov_iter *iter,
+			     size_t total_len)
+{
+	size_t count = iov_iter_count(iter);
+	unsigned int threshold;
+	ssize_t len;
+
+	if (WARN_ON(offset + total_len < offset) ||
+	    WARN_ON(offset + total_len > slice->size) ||
+	    WARN_ON(total_len > count))
+		return -EFAULT;
+
+	offset += slice->offset;
+	iov_iter_truncate(iter, total_len);
+
+	threshold = READ_ONCE(bus1_pool_nocache_threshold);
+	if (threshold > 0 && total_len >= threshold &&
+	    !(iter->type & (ITER_KVEC | ITER_BVEC)))
+		len = bus1_pool_write_iter_nocache(pool, offset, iter,
+						   total_len);
+	else
+		len = vfs_iter_write(pool->f, iter, &offset);
+
+	/* restore the tail that was cut off above */
+	iov_iter_reexpand(iter, iov_iter_count(iter) + count - total_len);
+
+	return (len >= 0 && len != total_len) ? -EFAULT : len;
+}
@@ -31,7 +31,23 @@
  * During message transactions, a sender copies the message directly into a
  * pool-slice allocated in the pool of the receiver. There is no in-flight
  * buffer, as such, only a single copy operation is needed to transfer the
- * message.
+ * message. Large payloads are copied with non-temporal stores, so they do not
+ * evict the cache of the sender.
+ *
+ * Payloads shared across multiple destinations are not copied into the pool.
+ * Instead, a read-only view of the shared pages is linked into the pool, at an
+ * offset beyond the end of any pool memory (see BUS1_POOL_SHARES_OFFSET).
+ * Views are mapped and released just like slices, via their offset.
+ *
+ * A peer can be cloned with BUS1_PEER_FLAG_SHARED_POOL. In this case, no new
+ * shmem object is created for the clone. Instead, the shmem object of the
+ * cloning peer is grown, and the clone manages the appended memory region as
+ * its pool. Slice offsets are always relative to the shmem object, so a single
+ * mapping gives access to the pools of all peers sharing the object. Apart
+ * from that, each pool still has its own allocator, protected by its own peer
+ * lock, and accounted separately. Once a pool of such a group is destroyed,
+ * its memory is punched out of the shmem object, and its region is reused by
+ * the next clone that fits into it.
  *
  * Note that no-one has direct write-access to pool memory. Furthermore, only
  * the owner of a pool has read-access. Any data that is written into the pool
@@ -41,13 +57,22 @@
 
 #include <linux/fs.h>
 #include <linux/kernel.h>
+#include <linux/kref.h>
 #include <linux/list.h>
+#include <linux/mutex.h>
 #include <linux/rbtree.h>
+#include <linux/spinlock.h>
 #include <linux/uio.h>
 
+struct bus1_share;
+struct vm_area_struct;
+
 /* internal: maximum offset, which implies the maximum pool size */
 #define BUS1_POOL_SIZE_MAX U32_MAX
 
+/* internal: offset of the first view of a shared payload */
+#define BUS1_POOL_SHARES_OFFSET ((u64)BUS1_POOL_SIZE_MAX + 1)
+
 /* internal: number of bits available to slice size */
 #define BUS1_POOL_SLICE_SIZE_BITS (28)
 #define BUS1_POOL_SLICE_SIZE_MAX ((1 << BUS1_POOL_SLICE_SIZE_BITS) - 1)
@@ -75,36 +100,92 @@ struct bus1_pool_slice {
 	struct rb_node rb;
 };
 
+/**
+ * struct bus1_pool_share - view of a shared payload
+ * @rb:			link into the pool, based on offset
+ * @offset:		offset of the view, beyond the end of the pool
+ * @share:		pinned shared payload
+ * @ref_kernel:		whether a kernel reference exists
+ * @ref_user:		whether a user reference exists
+ */
+struct bus1_pool_share {
+	struct rb_node rb;
+	u64 offset;
+	struct bus1_share *share;
+	bool ref_kernel : 1;
+	bool ref_user : 1;
+};
+
+/**
+ * struct bus1_pool_group - pools sharing a shmem object
+ * @ref:		reference count, one per pool
+ * @lock:		protects @pools, and the size of the shmem object
+ * @pools:		all pools in the group, sorted by base
+ */
+struct bus1_pool_group {
+	struct kref ref;
+	struct mutex lock;
+	struct list_head pools;
+};
+
 /**
  * struct bus1_pool - client pool
  * @f:			backing shmem file
- * @size:		size of the file
+ * @group:		group of pools sharing @f
+ * @group_entry:	link into @group, sorted by @base
+ * @base:		offset of the pool memory in @f
+ * @size:		size of the pool memory
  * @allocated_size:	currently allocated memory in bytes
  * @slices:		all slices sorted by address
  * @slices_busy:	tree of allocated slices
  * @slices_free:	tree of free slices
+ * @shares_lock:	protects @shares against lookups from mmap()
+ * @shares:		views of shared payloads, sorted by offset
+ * @shares_offset:	offset of the next view
  */
 struct bus1_pool {
 	struct file *f;
+	struct bus1_pool_group *group;
+	struct list_head group_entry;
+	size_t base;
 	size_t size;
 	size_t allocated_size;
 	struct list_head slices;
 	struct rb_root slices_busy;
 	struct rb_root slices_free;
+	spinlock_t shares_lock;
+	struct rb_root shares;
+	u64 shares_offset;
 };
 
 #define BUS1_POOL_NULL ((struct bus1_pool){ })
 
 int bus1_pool_create_internal(struct bus1_pool *pool, size_t size);
+int bus1_pool_create_shared_internal(struct bus1_pool *pool,
+				     struct bus1_pool *parent,
+				     size_t size);
 void bus1_pool_destroy(struct bus1_pool *pool);
 
 struct bus1_pool_slice *bus1_pool_alloc(struct bus1_pool *pool, size_t size);
+struct bus1_pool_slice *bus1_pool_alloc_aligned(struct bus1_pool *pool,
+						size_t size);
+struct bus1_pool_slice *bus1_pool_alloc_partial(struct bus1_pool *pool,
+						size_t size);
 struct bus1_pool_slice *
 bus1_pool_release_kernel(struct bus1_pool *pool, struct bus1_pool_slice *slice);
 void bus1_pool_publish(struct bus1_pool *pool, struct bus1_pool_slice *slice);
-int bus1_pool_release_user(struct bus1_pool *pool, size_t offset);
+int bus1_pool_release_user(struct bus1_pool *pool, u64 offset);
 void bus1_pool_flush(struct bus1_pool *pool);
 
+struct bus1_pool_share *bus1_pool_share_link(struct bus1_pool *pool,
+					     struct bus1_share *share);
+struct bus1_pool_share *
+bus1_pool_share_release_kernel(struct bus1_pool *pool,
+			       struct bus1_pool_share *ps);
+void bus1_pool_share_publish(struct bus1_pool *pool,
+			     struct bus1_pool_share *ps);
+int bus1_pool_share_mmap(struct bus1_pool *pool, struct vm_area_struct *vma);
+
 ssize_t bus1_pool_write_iovec(struct bus1_pool *pool,
 			      struct bus1_pool_slice *slice,
 			      loff_t offset,
@@ -117,10 +198,22 @@ ssize_t bus1_pool_write_kvec(struct bus1_pool *pool,
 			     struct kvec *iov,
 			     size_t n_iov,
 			     size_t total_len);
+ssize_t bus1_pool_write_iter(struct bus1_pool *pool,
+			     struct bus1_pool_slice *slice,
+			     loff_t offset,
+			     struct iov_iter *iter,
+			     size_t total_len);
 
 /* see bus1_pool_create_internal() for details */
 #define bus1_pool_create_for_peer(_peer, _size) ({		\
 		bus1_pool_create_internal(&(_peer)->pool, (_size));	\
 	})
 
+/* see bus1_pool_create_shared_internal() for details */
+#define bus1_pool_create_shared_for_peer(_peer, _parent, _size) ({	\
+		bus1_pool_create_shared_internal(&(_peer)->pool,	\
+						 &(_parent)->pool,	\
+						 (_size));		\
+	})
+
 #endif /* __BUS1_POOL_H */
@@ -97,6 +97,7 @@ void bus1_queue_init_internal(struct bus1_queue *queue)
 {
 	queue->messages = RB_ROOT;
 	rcu_assign_pointer(queue->front, NULL);
+	queue->last = NULL;
 	queue->n_committed = 0;
 	queue->clock = 0;
 }
@@ -121,6 +122,7 @@ void bus1_queue_destroy(struct bus1_queue *queue)
 
 	WARN_ON(queue->n_committed);
 	WARN_ON(rcu_access_pointer(queue->front));
+	WARN_ON(queue->last);
 	WARN_ON(!RB_EMPTY_ROOT(&queue->messages));
 }
 
@@ -144,6 +146,7 @@ void bus1_queue_post_flush(struct bus1_queue *queue)
 
 	queue->messages = RB_ROOT;
 	rcu_assign_pointer(queue->front, NULL);
+	queue->last = NULL;
 	queue->n_committed = 0;
 }
 
@@ -174,7 +177,7 @@ bool bus1_queue_stage(struct bus1_queue *queue,
 {
 	struct rb_node *front, *n, **slot;
 	struct bus1_queue_node *iter;
-	bool is_leftmost, readable;
+	bool is_leftmost, is_rightmost, readable;
 	u64 ts;
 
 	bus1_queue_assert_held(queue);
@@ -229,29 +232,55 @@ bool bus1_queue_stage(struct bus1_queue *queue,
 	}
 
 	if (!RB_EMPTY_NODE(&node->rb)) {
+		if (queue->last == &node->rb)
+			queue->last = rb_prev(&node->rb);
 		rb_erase(&node->rb, &queue->messages);
 		/* must be staging, so no need to adjust queue->n_committed */
 	}
 
-	/* re-insert into sorted rb-tree with new timestamp */
-	slot = &queue->messages.rb_node;
-	n = NULL;
-	is_leftmost = true;
-	while (*slot) {
-		n = *slot;
+	/*
+	 * Fast-path: If we order behind the last entry, we can link directly
+	 * as its right child, as the last entry never has one. This is the
+	 * common case for commits, as their timestamps are synchronized with
+	 * the queue clock.
+	 */
+	n = queue->last;
+	if (n) {
 		iter = container_of(n, struct bus1_queue_node, rb);
 		ts = bus1_queue_node_get_timestamp(iter);
-		if (timestamp < ts || (timestamp == ts && node < iter)) {
-			slot = &n->rb_left;
-		} else {
-			slot = &n->rb_right;
-			is_leftmost = false;
+		if (timestamp < ts || (timestamp == ts && node < iter))
+			n = NULL;
+	}
+
+	if (n) {
+		slot = &n->rb_right;
+		is_leftmost = false;
+		is_rightmost = true;
+	} else {
+		/* re-insert into sorted rb-tree with new timestamp */
+		slot = &queue->messages.rb_node;
+		is_leftmost = true;
+		is_rightmost = true;
+		while (*slot) {
+			n = *slot;
+			iter = container_of(n, struct bus1_queue_node, rb);
+			ts = bus1_queue_node_get_timestamp(iter);
+			if (timestamp < ts ||
+			    (timestamp == ts && node < iter)) {
+				slot = &n->rb_left;
+				is_rightmost = false;
+			} else {
+				slot = &n->rb_right;
+				is_leftmost = false;
+			}
 		}
 	}
 
 	rb_link_node(&node->rb, n, slot);
 	rb_insert_color(&node->rb, &queue->messages);
 	bus1_queue_node_set_timestamp(node, timestamp);
+	if (is_rightmost)
+		queue->last = &node->rb;
 
 	if (!(timestamp & 1)) {
 		if (!bus1_queue_node_is_silent(node))
@@ -312,6 +341,9 @@ bool bus1_queue_remove(struct bus1_queue *queue,
 		rcu_assign_pointer(queue->front, n);
 	}
 
+	if (queue->last == &node->rb)
+		queue->last = rb_prev(&node->rb);
+
 	rb_erase(&node->rb, &queue->messages);
 	RB_CLEAR_NODE(&node->rb);
 	if (!(bus1_queue_node_get_timestamp(node) & 1) &&
@@ -350,6 +382,39 @@ struct bus1_queue_node *bus1_queue_peek(struct bus1_queue *queue)
 	return container_of(n, struct bus1_queue_node, rb);
 }
 
+/**
+ * bus1_queue_peek_next() - peek entry following an available entry
+ * @queue:	queue to operate on
+ * @node:	available entry to start at
+ *
+ * This returns a pointer to the entry that directly follows @node in the given
+ * queue, if it is ready to be dequeued. That is, it is the entry that
+ * bus1_queue_peek() would return once @node was removed. @node must be an
+ * available entry, as returned by bus1_queue_peek() or this function.
+ *
+ * The caller must hold the read-side peer-lock of the parent peer.
+ *
+ * Return: Pointer to next available entry, NULL if none available.
+ */
+struct bus1_queue_node *bus1_queue_peek_next(struct bus1_queue *queue,
+					     struct bus1_queue_node *node)
+{
+	struct bus1_queue_node *next;
+	struct rb_node *n;
+
+	bus1_queue_assert_held(queue);
+
+	n = rb_next(&node->rb);
+	if (!n)
+		return NULL;
+
+	next = container_of(n, struct bus1_queue_node, rb);
+	if (bus1_queue_node_get_timestamp(next) & 1)
+		return NULL;
+
+	return next;
+}
+
 /**
  * bus1_queue_node_init() - initialize queue node
  * @node:		node to initialize
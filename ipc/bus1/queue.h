@@ -84,6 +84,19 @@
  * even timestamp). If the first entry is not ready to be dequeued, or if the
  * queue is empty, the front pointer is NULL.
  *
+ * Additionally, the last entry of the rb-tree is cached. Commit timestamps are
+ * taken from the synchronized clocks, so almost every commit orders behind all
+ * other entries of a queue. Such entries are appended directly to the last
+ * entry, rather than descending the whole tree.
+ *
+ * Peers created with BUS1_PEER_FLAG_UNORDERED accept messages that opt out of
+ * the global order. Those skip the synchronization with the sender clock, and
+ * the separate staging pass across all destinations. Instead, each destination
+ * ticks its own clock, stages the message at the new timestamp minus one, and
+ * commits it at the new timestamp. As the clock is never behind any entry of
+ * its queue, such messages are always appended to the last entry. They still
+ * respect in-flight conflicts, though.
+ *
  * The queue itself must be embedded into the parent peer structure. We do not
  * access any of the peer-data from within the queue, but we rely on the
  * peer-lock to be held by the caller (see each function for details of which
@@ -107,12 +120,14 @@ enum {
  * struct bus1_queue - message queue
  * @messages:		queued messages
  * @front:		cached front entry
+ * @last:		cached last entry
  * @n_committed:	number of committed, non-silent entries
  * @clock:		local clock (used for Lamport Timestamps)
  */
 struct bus1_queue {
 	struct rb_root messages;
 	struct rb_node __rcu *front;
+	struct rb_node *last;
 	size_t n_committed;
 	u64 clock;
 };
@@ -141,6 +156,8 @@ bool bus1_queue_stage(struct bus1_queue *queue,
 bool bus1_queue_remove(struct bus1_queue *queue,
 		       struct bus1_queue_node *node);
 struct bus1_queue_node *bus1_queue_peek(struct bus1_queue *queue);
+struct bus1_queue_node *bus1_queue_peek_next(struct bus1_queue *queue,
+					     struct bus1_queue_node *node);
 
 /* nodes */
 void bus1_queue_node_init(struct bus1_queue_node *node, unsigned int type);
@@ -196,32 +213,6 @@ static inline u64 bus1_queue_sync(struct bus1_queue *queue, u64 timestamp)
 	return queue->clock;
 }
 
-/**
- * bus1_queue_peek_rcu() - peek first available entry
- * @queue:	queue to operate on
- *
- * This returns a pointer to the first available entry in the given queue, or
- * NULL if there is none. The queue stays unmodified and the returned entry
- * remains on the queue.
- *
- * The caller must be inside an rcu read-side crictical section, and the
- * returned pointer is only valid for that critical section. Furthermore, the
- * caller must only access fields of the queue-entry that are explicitly
- * available for rcu-access.
- *
- * If the caller needs to operate on the queue entry, it better lock the peer
- * and call bus1_queue_peek(). This fast-path should only be used for poll()
- * callbacks and alike.
- *
- * Return: Pointer to first available entry, NULL if none available.
- */
-static inline struct bus1_queue_node *
-bus1_queue_peek_rcu(struct bus1_queue *queue)
-{
-	return rb_entry_safe(rcu_dereference(queue->front),
-			     struct bus1_queue_node, rb);
-}
-
 /**
  * bus1_queue_is_readable() - check whether a queue is readable
  * @queue:	queue to operate on
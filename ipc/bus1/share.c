@@ -0,0 +1,171 @@
+/*
+ * Copyright (C) 2013-2016 Red Hat, Inc.
+ *
+ * bus1 is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2.1 of the License, or (at
+ * your option) any later version.
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+#include <linux/err.h>
+#include <linux/gfp.h>
+#include <linux/highmem.h>
+#include <linux/kernel.h>
+#include <linux/kref.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/uio.h>
+#include <linux/vmalloc.h>
+#include "share.h"
+
+static void bus1_share_free(struct kref *ref)
+{
+	struct bus1_share *share = container_of(ref, struct bus1_share, ref);
+	size_t i;
+
+	for (i = 0; i < share->n_pages; ++i)
+		put_page(share->pages[i]);
+	kvfree(share->pages);
+	kfree(share);
+}
+
+/**
+ * bus1_share_new() - copy payload into a new shared payload
+ * @iter:		iterator to copy the payload from
+ *
+ * This allocates kernel-owned pages for the remaining data of @iter and copies
+ * it over. The tail of the last page is cleared, as it becomes visible to
+ * user-space once mapped.
+ *
+ * Return: Pointer to new shared payload, or ERR_PTR on failure.
+ */
+struct bus1_share *bus1_share_new(struct iov_iter *iter)
+{
+	struct bus1_share *share;
+	size_t n, n_pages, n_bytes;
+	struct page *page;
+	int r;
+
+	n_bytes = iov_iter_count(iter);
+	n_pages = DIV_ROUND_UP(n_bytes, PAGE_SIZE);
+
+	share = kmalloc(sizeof(*share), GFP_KERNEL);
+	if (!share)
+		return ERR_PTR(-ENOMEM);
+
+	kref_init(&share->ref);
+	share->n_bytes = n_bytes;
+	share->n_pages = 0;
+
+	share->pages = kmalloc(n_pages * sizeof(*share->pages),
+			       GFP_KERNEL | __GFP_NOWARN);
+	if (!share->pages)
+		share->pages = vmalloc(n_pages * sizeof(*share->pages));
+	if (!share->pages) {
+		kfree(share);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	while (share->n_pages < n_pages) {
+		page = alloc_page(GFP_HIGHUSER | __GFP_ACCOUNT);
+		if (!page) {
+			r = -ENOMEM;
+			goto error;
+		}
+
+		share->pages[share->n_pages++] = page;
+
+		n = min_t(size_t, n_bytes, PAGE_SIZE);
+		if (copy_page_from_iter(page, 0, n, iter) != n) {
+			r = -EFAULT;
+			goto error;
+		}
+		if (n < PAGE_SIZE)
+			zero_user_segment(page, n, PAGE_SIZE);
+
+		n_bytes -= n;
+	}
+
+	return share;
+
+error:
+	bus1_share_unref(share);
+	return ERR_PTR(r);
+}
+
+/**
+ * bus1_share_ref() - acquire shared payload reference
+ * @share:		shared payload to operate on, or NULL
+ *
+ * This acquires a new reference to @share. If NULL is passed, this is a no-op.
+ *
+ * Return: @share is returned.
+ */
+struct bus1_share *bus1_share_ref(struct bus1_share *share)
+{
+	if (share)
+		kref_get(&share->ref);
+	return share;
+}
+
+/**
+ * bus1_share_unref() - release shared payload reference
+ * @share:		shared payload to operate on, or NULL
+ *
+ * This drops a reference to @share. If it was the last reference, all pages
+ * are released. Pages that are still mapped somewhere stay around until they
+ * are unmapped. If NULL is passed, this is a no-op.
+ *
+ * Return: NULL is returned.
+ */
+struct bus1_share *bus1_share_unref(struct bus1_share *share)
+{
+	if (share)
+		kref_put(&share->ref, bus1_share_free);
+	return NULL;
+}
+
+static int bus1_share_vm_fault(struct vm_area_struct *vma,
+			       struct vm_fault *vmf)
+{
+	/* all pages are inserted on mmap(), anything else is out of range */
+	return VM_FAULT_SIGBUS;
+}
+
+static const struct vm_operations_struct bus1_share_vm_ops = {
+	.fault = bus1_share_vm_fault,
+};
+
+/**
+ * bus1_share_mmap() - map shared payload
+ * @share:		shared payload to map
+ * @vma:		read-only mapping to fill
+ *
+ * This maps the pages of @share into @vma, starting with the first page. The
+ * mapping must not be larger than the payload, and cannot be expanded later
+ * on. Each mapped page is pinned by the mapping itself, so the caller can
+ * drop its reference to @share once this returns.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int bus1_share_mmap(struct bus1_share *share, struct vm_area_struct *vma)
+{
+	unsigned long i;
+	int r;
+
+	if (vma_pages(vma) > share->n_pages)
+		return -EINVAL;
+
+	vma->vm_flags |= VM_DONTEXPAND;
+	vma->vm_ops = &bus1_share_vm_ops;
+
+	for (i = 0; i < vma_pages(vma); ++i) {
+		r = vm_insert_page(vma, vma->vm_start + i * PAGE_SIZE,
+				   share->pages[i]);
+		if (r < 0)
+			return r;
+	}
+
+	return 0;
+}
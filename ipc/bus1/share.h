@@ -0,0 +1,53 @@
+#ifndef __BUS1_SHARE_H
+#define __BUS1_SHARE_H
+
+/*
+ * Copyright (C) 2013-2016 Red Hat, Inc.
+ *
+ * bus1 is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2.1 of the License, or (at
+ * your option) any later version.
+ */
+
+/**
+ * DOC: Shared Payloads
+ *
+ * Usually, the payload of a message is copied into the pool of each
+ * destination. For large multicasts, memory and copy bandwidth thus scale with
+ * the number of destinations. If a message is sent with BUS1_SEND_FLAG_SHARED,
+ * its payload is instead copied exactly once, into a set of kernel-owned
+ * pages. Each destination pool gets a read-only view of those pages, placed
+ * beyond the end of the pool memory. It can be mapped via mmap() on the peer
+ * file-descriptor, just like the pool itself.
+ *
+ * A shared payload is ref-counted. Each pool holds a reference as long as its
+ * view is allocated, and each mapping pins the pages it maps. Hence, the
+ * memory is freed once the last receiver released its view and unmapped it.
+ */
+
+#include <linux/kernel.h>
+#include <linux/kref.h>
+#include <linux/mm_types.h>
+#include <linux/uio.h>
+
+/**
+ * struct bus1_share - shared payload
+ * @ref:		object ref-count
+ * @n_bytes:		size of the payload in bytes
+ * @n_pages:		number of pages backing the payload
+ * @pages:		pages backing the payload
+ */
+struct bus1_share {
+	struct kref ref;
+	size_t n_bytes;
+	size_t n_pages;
+	struct page **pages;
+};
+
+struct bus1_share *bus1_share_new(struct iov_iter *iter);
+struct bus1_share *bus1_share_ref(struct bus1_share *share);
+struct bus1_share *bus1_share_unref(struct bus1_share *share);
+int bus1_share_mmap(struct bus1_share *share, struct vm_area_struct *vma);
+
+#endif /* __BUS1_SHARE_H */
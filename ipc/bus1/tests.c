@@ -326,6 +326,8 @@ static void bus1_test_pool(void)
 	WARN_ON(bus1_pool_alloc(pool, BUS1_POOL_SLICE_SIZE_MAX + 1) !=
 		ERR_PTR(-EMSGSIZE));
 	WARN_ON(bus1_pool_alloc(pool, PAGE_SIZE) != ERR_PTR(-EXFULL));
+	/* an aligned slice covers a full page, which the pool cannot hold */
+	WARN_ON(bus1_pool_alloc_aligned(pool, 8) != ERR_PTR(-EXFULL));
 
 	/* split the pool in four parts, the first three of equal size and
 	 * the reminder the same size - 1 */
@@ -399,6 +401,40 @@ static void bus1_test_pool(void)
 	slice3 = bus1_pool_release_kernel(pool, slice3);
 
 	bus1_pool_destroy(pool);
+
+	/*
+	 * Implicitly aligned messages fall back to bus1_pool_alloc() if the
+	 * aligned allocation fails with -EXFULL or -EMSGSIZE. Verify that both
+	 * can happen, while an unaligned slice of the same size still fits.
+	 */
+	WARN_ON(bus1_pool_create_for_peer(&peer, 2 * PAGE_SIZE) < 0);
+	/* occupy the head of the first page */
+	slice1 = bus1_pool_alloc(pool, 8);
+	WARN_ON(IS_ERR(slice1));
+	/* two aligned pages do not fit anymore, but the unaligned rest does */
+	WARN_ON(bus1_pool_alloc_aligned(pool, PAGE_SIZE + 8) !=
+		ERR_PTR(-EXFULL));
+	slice2 = bus1_pool_alloc(pool, PAGE_SIZE + 8);
+	WARN_ON(IS_ERR(slice2));
+	WARN_ON(slice2->offset != 8);
+	/* the failed aligned allocation left the free space intact */
+	slice2 = bus1_pool_release_kernel(pool, slice2);
+	slice2 = bus1_pool_alloc(pool, 2 * PAGE_SIZE - 8);
+	WARN_ON(IS_ERR(slice2));
+	WARN_ON(slice2->offset != 8);
+	/* a single aligned page still fits, once the tail is free again */
+	slice2 = bus1_pool_release_kernel(pool, slice2);
+	slice2 = bus1_pool_alloc_aligned(pool, 8);
+	WARN_ON(IS_ERR(slice2));
+	WARN_ON(slice2->offset != PAGE_SIZE);
+	WARN_ON(slice2->size != PAGE_SIZE);
+	slice1 = bus1_pool_release_kernel(pool, slice1);
+	slice2 = bus1_pool_release_kernel(pool, slice2);
+	/* rounding up to whole pages may exceed the slice limit */
+	WARN_ON(bus1_pool_alloc_aligned(pool, BUS1_POOL_SLICE_SIZE_MAX) !=
+		ERR_PTR(-EMSGSIZE));
+	bus1_pool_destroy(pool);
+
 	mutex_unlock(&peer.lock);
 }
 
@@ -11,9 +11,11 @@
 #include <linux/atomic.h>
 #include <linux/cred.h>
 #include <linux/err.h>
+#include <linux/fdtable.h>
 #include <linux/file.h>
 #include <linux/fs.h>
 #include <linux/kernel.h>
+#include <linux/percpu.h>
 #include <linux/pid.h>
 #include <linux/pid_namespace.h>
 #include <linux/sched.h>
@@ -23,11 +25,13 @@
 #include <linux/uio.h>
 #include <uapi/linux/bus1.h>
 #include "active.h"
+#include "buffer.h"
 #include "handle.h"
 #include "message.h"
 #include "peer.h"
 #include "pool.h"
 #include "queue.h"
+#include "share.h"
 #include "transaction.h"
 #include "user.h"
 #include "util.h"
@@ -42,16 +46,44 @@ struct bus1_transaction {
 	struct pid *tid;
 
 	/* payload */
-	struct iovec *vecs;
+	union {
+		struct iovec *vecs;
+		struct bus1_buffer_range *ranges;
+	};
 	struct file **files;
+	int *fds;
+	struct bus1_share *share;
 
 	/* transaction state */
 	size_t length_vecs;
+	bool cached;
+	bool unordered;
 	struct bus1_message *entries;
 	struct bus1_handle_transfer handles;
 	/* @handles must be last */
 };
 
+/*
+ * Most transactions carry a handful of vecs, handles and fds. They are
+ * allocated from a dedicated cache of BUS1_TRANSACTION_SMALL_SIZE objects,
+ * the size of the stack buffer this used to be placed in. Additionally, each
+ * CPU keeps a spare object around, so back-to-back sends on a CPU never hit
+ * the allocator at all. Bigger transactions are rare and allocated via
+ * kmalloc() with their exact size, rather than sizing every cached object
+ * for the worst case.
+ */
+#define BUS1_TRANSACTION_SMALL_SIZE 512
+
+static struct kmem_cache *bus1_transaction_cache;
+static DEFINE_PER_CPU(struct bus1_transaction *, bus1_transaction_spare);
+
+static size_t bus1_transaction_vec_size(struct bus1_cmd_send *param)
+{
+	if (param->flags & BUS1_SEND_FLAG_BUFFERS)
+		return sizeof(struct bus1_buffer_range);
+	return sizeof(struct iovec);
+}
+
 static size_t bus1_transaction_size(struct bus1_cmd_send *param)
 {
 	/* make sure @size cannot overflow */
@@ -63,12 +95,59 @@ static size_t bus1_transaction_size(struct bus1_cmd_send *param)
 		     __alignof(union bus1_handle_entry));
 	BUILD_BUG_ON(__alignof(union bus1_handle_entry) <
 		     __alignof(struct iovec));
+	BUILD_BUG_ON(__alignof(union bus1_handle_entry) <
+		     __alignof(struct bus1_buffer_range));
 	BUILD_BUG_ON(__alignof(struct iovec) < __alignof(struct file *));
+	BUILD_BUG_ON(__alignof(struct bus1_buffer_range) <
+		     __alignof(struct file *));
+	BUILD_BUG_ON(__alignof(struct file *) < __alignof(int));
 
 	return sizeof(struct bus1_transaction) +
 	       bus1_handle_batch_inline_size(param->n_handles) +
-	       param->n_vecs * sizeof(struct iovec) +
-	       param->n_fds * sizeof(struct file *);
+	       param->n_vecs * bus1_transaction_vec_size(param) +
+	       param->n_fds * (sizeof(struct file *) + sizeof(int));
+}
+
+/**
+ * bus1_transaction_cache_create() - create transaction cache
+ *
+ * This creates the cache small transaction objects are allocated from. It
+ * must be called once on module initialization.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int bus1_transaction_cache_create(void)
+{
+	bus1_transaction_cache =
+		kmem_cache_create(KBUILD_MODNAME "-transaction",
+				  BUS1_TRANSACTION_SMALL_SIZE, 0, 0, NULL);
+	if (!bus1_transaction_cache)
+		return -ENOMEM;
+
+	return 0;
+}
+
+/**
+ * bus1_transaction_cache_destroy() - destroy transaction cache
+ *
+ * This releases the spare transaction objects of all CPUs and destroys the
+ * cache created by bus1_transaction_cache_create(). No transaction must be
+ * alive when this is called.
+ */
+void bus1_transaction_cache_destroy(void)
+{
+	struct bus1_transaction *transaction;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		transaction = per_cpu(bus1_transaction_spare, cpu);
+		if (transaction)
+			kmem_cache_free(bus1_transaction_cache, transaction);
+		per_cpu(bus1_transaction_spare, cpu) = NULL;
+	}
+
+	kmem_cache_destroy(bus1_transaction_cache);
+	bus1_transaction_cache = NULL;
 }
 
 static void bus1_transaction_init(struct bus1_transaction *transaction,
@@ -84,14 +163,36 @@ static void bus1_transaction_init(struct bus1_transaction *transaction,
 
 	transaction->vecs = (void *)((u8 *)(transaction + 1) +
 			bus1_handle_batch_inline_size(param->n_handles));
-	transaction->files = (void *)(transaction->vecs + param->n_vecs);
-	memset(transaction->files, 0, param->n_vecs * sizeof(struct file *));
-
+	transaction->files = (void *)((u8 *)transaction->vecs +
+			param->n_vecs * bus1_transaction_vec_size(param));
+	transaction->fds = (void *)(transaction->files + param->n_fds);
+	memset(transaction->files, 0, param->n_fds * sizeof(struct file *));
+	if (param->flags & BUS1_SEND_FLAG_BUFFERS)
+		memset(transaction->ranges, 0,
+		       param->n_vecs * sizeof(struct bus1_buffer_range));
+
+	transaction->share = NULL;
 	transaction->length_vecs = 0;
+	transaction->unordered = param->flags & BUS1_SEND_FLAG_UNORDERED;
 	transaction->entries = NULL;
 	bus1_handle_transfer_init(&transaction->handles, param->n_handles);
 }
 
+static void bus1_transaction_return_reply(struct bus1_message *message,
+					  struct bus1_peer_info *peer_info,
+					  struct bus1_handle_dest *dest)
+{
+	/*
+	 * A reserved reply slice is only consumed by a committed message. If
+	 * the message is dropped before, give the reservation back to the
+	 * destination node, so a following message can use it.
+	 */
+	if (dest && message->reserved && message->slice) {
+		bus1_handle_dest_return_reply(dest, peer_info, message->slice);
+		message->slice = NULL;
+	}
+}
+
 static void bus1_transaction_destroy(struct bus1_transaction *transaction)
 {
 	struct bus1_peer_info *peer_info;
@@ -100,17 +201,18 @@ static void bus1_transaction_destroy(struct bus1_transaction *transaction)
 	size_t i;
 
 	while ((message = transaction->entries)) {
-		transaction->entries = message->transaction.next;
-		dest = message->transaction.dest;
+		transaction->entries = message->next;
+		dest = message->dest;
 		bus1_active_lockdep_acquired(&dest.raw_peer->active);
 		peer_info = bus1_peer_dereference(dest.raw_peer);
 
-		message->transaction.next = NULL;
-		message->transaction.dest = (struct bus1_handle_dest){};
+		message->next = NULL;
+		RB_CLEAR_NODE(&message->rb_coalesce); /* overwrites @dest */
 
 		mutex_lock(&peer_info->lock);
 		if (bus1_queue_remove(&peer_info->queue, &message->qnode))
 			bus1_peer_wake(dest.raw_peer);
+		bus1_transaction_return_reply(message, peer_info, &dest);
 		bus1_message_deallocate(message, peer_info);
 		mutex_unlock(&peer_info->lock);
 
@@ -123,6 +225,12 @@ static void bus1_transaction_destroy(struct bus1_transaction *transaction)
 		if (transaction->files[i])
 			fput(transaction->files[i]);
 
+	if (transaction->param->flags & BUS1_SEND_FLAG_BUFFERS)
+		bus1_buffer_release_ranges(transaction->ranges,
+					   transaction->param->n_vecs);
+
+	transaction->share = bus1_share_unref(transaction->share);
+
 	bus1_handle_transfer_destroy(&transaction->handles,
 				     transaction->peer_info);
 }
@@ -130,13 +238,44 @@ static void bus1_transaction_destroy(struct bus1_transaction *transaction)
 static int bus1_transaction_import_vecs(struct bus1_transaction *transaction)
 {
 	struct bus1_cmd_send *param = transaction->param;
+	const struct bus1_buffer_vec __user *ptr_ranges;
 	const struct iovec __user *ptr_vecs;
 
+	if (param->flags & BUS1_SEND_FLAG_BUFFERS) {
+		ptr_ranges = (const struct bus1_buffer_vec __user *)
+						(unsigned long)param->ptr_vecs;
+		return bus1_buffer_import_ranges(transaction->peer_info,
+						 transaction->ranges,
+						 &transaction->length_vecs,
+						 ptr_ranges, param->n_vecs);
+	}
+
 	ptr_vecs = (const struct iovec __user *)(unsigned long)param->ptr_vecs;
 	return bus1_import_vecs(transaction->vecs, &transaction->length_vecs,
 				ptr_vecs, param->n_vecs);
 }
 
+static int bus1_transaction_import_share(struct bus1_transaction *transaction)
+{
+	struct bus1_cmd_send *param = transaction->param;
+	struct bus1_share *share;
+	struct iov_iter iter;
+
+	if (!(param->flags & (BUS1_SEND_FLAG_SHARED | BUS1_SEND_FLAG_PULL)) ||
+	    transaction->length_vecs == 0)
+		return 0;
+
+	/* copy the payload once, rather than once per destination */
+	iov_iter_init(&iter, WRITE, transaction->vecs, param->n_vecs,
+		      transaction->length_vecs);
+	share = bus1_share_new(&iter);
+	if (IS_ERR(share))
+		return PTR_ERR(share);
+
+	transaction->share = share;
+	return 0;
+}
+
 static int bus1_transaction_import_handles(struct bus1_transaction *transaction)
 {
 	struct bus1_cmd_send *param = transaction->param;
@@ -158,7 +297,10 @@ static int bus1_transaction_import_files(struct bus1_transaction *transaction)
 
 	ptr_fds = (const int __user *)(unsigned long)param->ptr_fds;
 	for (i = 0; i < param->n_fds; ++i) {
-		f = bus1_import_fd(ptr_fds + i);
+		if (get_user(transaction->fds[i], ptr_fds + i))
+			return -EFAULT;
+
+		f = bus1_import_fd(transaction->fds[i]);
 		if (IS_ERR(f))
 			return PTR_ERR(f);
 
@@ -168,18 +310,35 @@ static int bus1_transaction_import_files(struct bus1_transaction *transaction)
 	return 0;
 }
 
+static void bus1_transaction_close_files(struct bus1_transaction *transaction)
+{
+	struct file *f;
+	size_t i;
+
+	/*
+	 * The FD numbers captured on import are only closed if they still
+	 * refer to the file we transferred. If user-space modified its FD
+	 * table in parallel, the FD is simply left alone.
+	 */
+	for (i = 0; i < transaction->param->n_fds; ++i) {
+		rcu_read_lock();
+		f = fcheck(transaction->fds[i]);
+		rcu_read_unlock();
+
+		if (f == transaction->files[i])
+			__close_fd(current->files, transaction->fds[i]);
+	}
+}
+
 /**
  * bus1_transaction_new_from_user() - create new transaction
- * @stack_buffer:		stack buffer to use as backing memory
- * @stack_size:			size of @stack_buffer in bytes
  * @peer:			origin of this transaction
  * @param:			transaction parameters
  *
  * This allocates a new transaction object for a user-transaction as specified
- * via @param. The transaction is optionally put onto the stack, if the passed
- * buffer @stack_buffer is big enough. Otherwise, the memory is allocated. The
- * caller must make sure to pass the same stack-pointer to
- * bus1_transaction_free().
+ * via @param. If it fits, the spare transaction object of the local CPU is
+ * used, or a new object is allocated from the transaction cache. Bigger
+ * transactions are allocated via kmalloc().
  *
  * The transaction object imports all its data from user-space. If anything
  * fails, an error is returned.
@@ -188,36 +347,41 @@ static int bus1_transaction_import_files(struct bus1_transaction *transaction)
  * That is, its lifetime must be limited to your own function lifetime. You
  * must not pass pointers to transaction objects to contexts outside of this
  * lifetime. This makes it possible to optimize access to 'current' (and its
- * properties like creds and pids), and to place the transaction on the stack,
- * when it fits.
+ * properties like creds and pids).
  *
  * Return: Pointer to transaction object, or ERR_PTR on failure.
  */
 struct bus1_transaction *
-bus1_transaction_new_from_user(u8 *stack_buffer,
-			       size_t stack_size,
-			       struct bus1_peer *peer,
+bus1_transaction_new_from_user(struct bus1_peer *peer,
 			       struct bus1_cmd_send *param)
 {
 	struct bus1_transaction *transaction;
 	size_t size;
 	int r;
 
-	/* use caller-provided stack buffer, if possible */
 	size = bus1_transaction_size(param);
-	if (unlikely(size > stack_size)) {
-		transaction = kmalloc(size, GFP_TEMPORARY);
+	if (likely(size <= BUS1_TRANSACTION_SMALL_SIZE)) {
+		transaction = this_cpu_xchg(bus1_transaction_spare, NULL);
 		if (!transaction)
-			return ERR_PTR(-ENOMEM);
+			transaction = kmem_cache_alloc(bus1_transaction_cache,
+						       GFP_KERNEL);
 	} else {
-		transaction = (void *)stack_buffer;
+		transaction = kmalloc(size, GFP_TEMPORARY);
 	}
+	if (!transaction)
+		return ERR_PTR(-ENOMEM);
+
+	transaction->cached = size <= BUS1_TRANSACTION_SMALL_SIZE;
 	bus1_transaction_init(transaction, peer, param);
 
 	r = bus1_transaction_import_vecs(transaction);
 	if (r < 0)
 		goto error;
 
+	r = bus1_transaction_import_share(transaction);
+	if (r < 0)
+		goto error;
+
 	r = bus1_transaction_import_handles(transaction);
 	if (r < 0)
 		goto error;
@@ -229,67 +393,121 @@ bus1_transaction_new_from_user(u8 *stack_buffer,
 	return transaction;
 
 error:
-	bus1_transaction_free(transaction, stack_buffer);
+	bus1_transaction_free(transaction);
 	return ERR_PTR(r);
 }
 
 /**
  * bus1_transaction_free() - free transaction
  * @transaction:	transaction to free, or NULL
- * @stack_buffer:	stack buffer passed to constructor
  *
  * This releases a transaction and all associated memory. If the transaction
  * failed, any in-flight messages are dropped and pinned peers are released. If
  * the transaction was successfull, this just releases the temporary data that
- * was used for the transmission.
+ * was used for the transmission. A cached transaction object is kept as spare
+ * object of the local CPU, unless there already is one.
  *
  * If NULL is passed, this is a no-op.
  *
  * Return: NULL is returned.
  */
 struct bus1_transaction *
-bus1_transaction_free(struct bus1_transaction *transaction, u8 *stack_buffer)
+bus1_transaction_free(struct bus1_transaction *transaction)
 {
 	if (!transaction)
 		return NULL;
 
 	bus1_transaction_destroy(transaction);
 
-	if (transaction != (void *)stack_buffer)
+	if (!transaction->cached)
 		kfree(transaction);
+	else if (this_cpu_cmpxchg(bus1_transaction_spare, NULL, transaction))
+		kmem_cache_free(bus1_transaction_cache, transaction);
 
 	return NULL;
 }
 
+static size_t bus1_transaction_header_size(struct bus1_transaction *transaction)
+{
+	if (transaction->param->flags & BUS1_SEND_FLAG_HEADERS)
+		return transaction->param->header_size;
+	return 0;
+}
+
+static int bus1_transaction_write_header(struct bus1_transaction *transaction,
+					 struct bus1_message *message,
+					 struct bus1_peer_info *peer_info,
+					 size_t index)
+{
+	size_t size = bus1_transaction_header_size(transaction);
+	struct iov_iter iter;
+	struct iovec vec;
+
+	vec.iov_base = (void __user *)(unsigned long)
+				transaction->param->ptr_headers + index * size;
+	vec.iov_len = size;
+	iov_iter_init(&iter, WRITE, &vec, 1, size);
+
+	return bus1_message_write(message, peer_info, 0, &iter);
+}
+
 /**
  * bus1_transaction_instantiate_message() - instantiate message
  * @transaction:	transaction to operate on
  * @peer_info:		destination peer to instantiate message for
+ * @dest:		destination context, or NULL
+ * @index:		index of the destination in the transaction
  *
  * This instantiates a single bus1_message object for @peer_info. It is not
  * linked into any queue or parent context. It is exclusively owned by the
  * caller.
  *
+ * If the transaction carries per-destination headers, the header at @index is
+ * placed in front of the common payload. If the destination node has a reply
+ * slice reserved, and the message fits into it, the message takes the
+ * reservation. It is only consumed once the message is committed, and given
+ * back to the node if the message is dropped before.
+ *
  * Return: Message on success, ERR_PTR on failure.
  */
 struct bus1_message *
 bus1_transaction_instantiate_message(struct bus1_transaction *transaction,
-				     struct bus1_peer_info *peer_info)
+				     struct bus1_peer_info *peer_info,
+				     struct bus1_handle_dest *dest,
+				     size_t index)
 {
+	size_t i, header_size = bus1_transaction_header_size(transaction);
+	struct bus1_pool_slice *reply = NULL;
 	struct bus1_message *message;
-	size_t i;
+	struct iov_iter iter;
+	struct file **files;
 	int r;
 
-	message = bus1_message_new(transaction->length_vecs,
+	message = bus1_message_new(header_size + transaction->length_vecs,
 			transaction->param->n_fds,
 			transaction->param->n_handles,
 			transaction->param->flags & BUS1_SEND_FLAG_SILENT);
 	if (IS_ERR(message))
 		return message;
 
+	message->share = bus1_share_ref(transaction->share);
+	message->pull = message->share &&
+			(transaction->param->flags & BUS1_SEND_FLAG_PULL);
+	message->page_aligned = transaction->param->flags &
+				BUS1_SEND_FLAG_PAGE_ALIGNED;
+	message->deadline = transaction->param->deadline;
+	if (transaction->param->flags & BUS1_SEND_FLAG_COALESCE) {
+		message->coalesce.sender = transaction->peer_info->id;
+		message->coalesce.key = transaction->param->coalesce_key;
+	}
+
 	mutex_lock(&peer_info->lock);
+	if (dest)
+		reply = bus1_handle_dest_take_reply(dest, peer_info);
 	r = bus1_message_allocate(message, peer_info,
-				  transaction->peer_info->user);
+				  transaction->peer_info->user, reply);
+	if (reply && !message->reserved)
+		bus1_handle_dest_return_reply(dest, peer_info, reply);
 	mutex_unlock(&peer_info->lock);
 	if (r < 0) {
 		/*
@@ -304,12 +522,21 @@ bus1_transaction_instantiate_message(struct bus1_transaction *transaction,
 		goto error;
 	}
 
-	r = bus1_pool_write_iovec(&peer_info->pool,	/* pool to write */
-				  message->slice,	/* slice to write to */
-				  0,			/* offset into slice */
-				  transaction->vecs,	/* vectors */
-				  transaction->param->n_vecs, /* #n vectors */
-				  transaction->length_vecs); /* total length */
+	if (message->share) {
+		r = 0; /* payload is already in place, or pulled on RECV */
+	} else if (transaction->param->flags & BUS1_SEND_FLAG_BUFFERS) {
+		r = bus1_buffer_write_ranges(transaction->ranges,
+					     transaction->param->n_vecs,
+					     message, peer_info);
+	} else {
+		iov_iter_init(&iter, WRITE, transaction->vecs,
+			      transaction->param->n_vecs,
+			      transaction->length_vecs);
+		r = bus1_message_write(message, peer_info, header_size, &iter);
+		if (r >= 0 && header_size > 0)
+			r = bus1_transaction_write_header(transaction, message,
+							  peer_info, index);
+	}
 	if (r < 0)
 		goto error;
 
@@ -318,21 +545,23 @@ bus1_transaction_instantiate_message(struct bus1_transaction *transaction,
 	if (r < 0)
 		goto error;
 
-	message->data.uid = from_kuid_munged(peer_info->cred->user_ns,
+	message->uid = from_kuid_munged(peer_info->cred->user_ns,
 					     transaction->cred->uid);
-	message->data.gid = from_kgid_munged(peer_info->cred->user_ns,
+	message->gid = from_kgid_munged(peer_info->cred->user_ns,
 					     transaction->cred->gid);
-	message->data.pid = pid_nr_ns(transaction->pid, peer_info->pid_ns);
-	message->data.tid = pid_nr_ns(transaction->tid, peer_info->pid_ns);
+	message->pid = pid_nr_ns(transaction->pid, peer_info->pid_ns);
+	message->tid = pid_nr_ns(transaction->tid, peer_info->pid_ns);
 
+	files = bus1_message_files(message);
 	for (i = 0; i < transaction->param->n_fds; ++i)
-		message->files[i] = get_file(transaction->files[i]);
+		files[i] = get_file(transaction->files[i]);
 
 	return message;
 
 error:
 	if (message) {
 		mutex_lock(&peer_info->lock);
+		bus1_transaction_return_reply(message, peer_info, dest);
 		bus1_message_deallocate(message, peer_info);
 		mutex_unlock(&peer_info->lock);
 	}
@@ -343,25 +572,31 @@ error:
 	return message;
 }
 
-static struct bus1_message *
-bus1_transaction_instantiate(struct bus1_transaction *transaction,
-			     struct bus1_handle_dest *dest,
-			     u64 __user *idp)
+static int bus1_transaction_instantiate(struct bus1_transaction *transaction,
+					struct bus1_handle_dest *dest,
+					size_t index)
 {
-	struct bus1_peer_info *peer_info = NULL;
+	struct bus1_peer_info *peer_info;
 	struct bus1_message *message;
-	int r;
-
-	r = bus1_handle_dest_import(dest, transaction->peer, idp);
-	if (r < 0)
-		return ERR_PTR(r);
 
 	bus1_active_lockdep_acquired(&dest->raw_peer->active);
 	peer_info = bus1_peer_dereference(dest->raw_peer);
-	message = bus1_transaction_instantiate_message(transaction, peer_info);
+	message = bus1_transaction_instantiate_message(transaction, peer_info,
+						       dest, index);
 	bus1_active_lockdep_released(&dest->raw_peer->active);
 
-	return message;
+	if (IS_ERR(message))
+		return PTR_ERR(message);
+
+	/* a single ordered destination orders the whole transaction */
+	if (!(peer_info->flags & BUS1_PEER_FLAG_UNORDERED))
+		transaction->unordered = false;
+
+	message->next = transaction->entries;
+	message->dest = *dest; /* consume */
+	transaction->entries = message;
+
+	return 0;
 }
 
 /**
@@ -381,20 +616,59 @@ int bus1_transaction_instantiate_for_id(struct bus1_transaction *transaction,
 					u64 __user *idp)
 {
 	struct bus1_handle_dest dest;
-	struct bus1_message *message;
+	u64 __user *ptr_dest;
 	int r;
 
+	/* @idp always points into the destination array */
+	ptr_dest = (u64 __user *)(unsigned long)
+					transaction->param->ptr_destinations;
+
 	bus1_handle_dest_init(&dest);
 
-	message = bus1_transaction_instantiate(transaction, &dest, idp);
-	if (IS_ERR(message)) {
-		r = PTR_ERR(message);
+	r = bus1_handle_dest_import(&dest, transaction->peer, idp);
+	if (r < 0)
 		goto error;
-	}
 
-	message->transaction.next = transaction->entries;
-	message->transaction.dest = dest; /* consume */
-	transaction->entries = message;
+	r = bus1_transaction_instantiate(transaction, &dest, idp - ptr_dest);
+	if (r < 0)
+		goto error;
+
+	return 0;
+
+error:
+	bus1_handle_dest_destroy(&dest, transaction->peer_info);
+	return r;
+}
+
+/**
+ * bus1_transaction_instantiate_for_set() - instantiate a message
+ * @transaction:	transaction to work with
+ * @set:		destination set to use
+ * @index:		index of the destination in @set
+ *
+ * This is the same as bus1_transaction_instantiate_for_id(), but uses the
+ * pre-resolved destination handle at position @index of the destination set
+ * @set, rather than looking up a handle ID.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int bus1_transaction_instantiate_for_set(struct bus1_transaction *transaction,
+					 struct bus1_handle_set *set,
+					 size_t index)
+{
+	struct bus1_handle_dest dest;
+	int r;
+
+	bus1_handle_dest_init(&dest);
+
+	r = bus1_handle_dest_import_from_set(&dest, transaction->peer, set,
+					     index);
+	if (r < 0)
+		goto error;
+
+	r = bus1_transaction_instantiate(transaction, &dest, index);
+	if (r < 0)
+		goto error;
 
 	return 0;
 
@@ -407,7 +681,8 @@ static bool
 bus1_transaction_commit_one(struct bus1_transaction *transaction,
 			    struct bus1_message *message,
 			    struct bus1_handle_dest *dest,
-			    u64 timestamp)
+			    u64 timestamp,
+			    struct bus1_message **replacedp)
 {
 	struct bus1_peer_info *peer_info;
 	u64 id;
@@ -426,14 +701,18 @@ bus1_transaction_commit_one(struct bus1_transaction *transaction,
 
 	if (id == BUS1_HANDLE_INVALID) {
 		bus1_queue_remove(&peer_info->queue, &message->qnode);
+		bus1_transaction_return_reply(message, peer_info, dest);
 		bus1_message_deallocate(message, peer_info);
 		return false;
 	}
 
-	message->data.destination = id;
+	message->destination = id;
 	if (bus1_queue_stage(&peer_info->queue, &message->qnode, timestamp))
 		bus1_peer_wake(dest->raw_peer);
 
+	bus1_message_link_deadline(message, peer_info);
+	bus1_peer_info_arm_reaper(peer_info, message->deadline);
+	*replacedp = bus1_message_coalesce(message, peer_info);
 	return true;
 }
 
@@ -458,13 +737,23 @@ bus1_transaction_commit_one(struct bus1_transaction *transaction,
  * written back to the caller. Errors due to racing node destructions are
  * silently ignored.
  *
+ * A transaction without any instantiated message (e.g., because all its
+ * destinations were gone and BUS1_SEND_FLAG_CONTINUE was given) is committed
+ * just the same. Nothing is queued, but the passed handles are transferred
+ * (and moved) as if there was a destination.
+ *
+ * If BUS1_SEND_FLAG_MOVE_FDS was given, the transferred file descriptors are
+ * closed in the calling task once the transaction is committed. This is the
+ * last step, so they are closed if, and only if, this returns 0.
+ *
  * Return: 0 on success, negative error code on failure.
  */
 int bus1_transaction_commit(struct bus1_transaction *transaction)
 {
 	struct bus1_cmd_send *param = transaction->param;
 	struct bus1_peer_info *peer_info;
-	struct bus1_message *message, *list;
+	struct bus1_message *message, *list, *replaced;
+	struct bus1_handle_attach attach;
 	struct bus1_handle_dest dest;
 	struct bus1_peer *peer;
 	u64 id, timestamp;
@@ -472,14 +761,19 @@ int bus1_transaction_commit(struct bus1_transaction *transaction)
 	bool res;
 	int r;
 
-	if (!transaction->entries)
-		return 0;
-
 	list = transaction->entries;
 	timestamp = 0;
 
-	for (message = list; message; message = message->transaction.next) {
-		peer = message->transaction.dest.raw_peer;
+	/*
+	 * Unordered transactions are not synchronized with the sender clock,
+	 * nor across destinations. Each destination stages the message with a
+	 * fresh tick of its own clock when exporting the destination handle
+	 * below, and commits it with that very timestamp.
+	 */
+	for (message = list;
+	     message && !transaction->unordered;
+	     message = message->next) {
+		peer = message->dest.raw_peer;
 		bus1_active_lockdep_acquired(&peer->active);
 		peer_info = bus1_peer_dereference(peer);
 
@@ -494,23 +788,38 @@ int bus1_transaction_commit(struct bus1_transaction *transaction)
 		bus1_active_lockdep_released(&peer->active);
 	}
 
-	mutex_lock(&transaction->peer_info->lock);
-	timestamp = bus1_queue_sync(&transaction->peer_info->queue, timestamp);
-	timestamp = bus1_queue_tick(&transaction->peer_info->queue);
-	bus1_handle_transfer_install(&transaction->handles, transaction->peer);
-	mutex_unlock(&transaction->peer_info->lock);
+	/*
+	 * Unordered transactions cannot carry handles, so neither the sender
+	 * clock nor any handle transfer of the sender needs to be touched.
+	 */
+	if (!transaction->unordered) {
+		mutex_lock(&transaction->peer_info->lock);
+		timestamp = bus1_queue_sync(&transaction->peer_info->queue,
+					    timestamp);
+		timestamp = bus1_queue_tick(&transaction->peer_info->queue);
+		bus1_handle_transfer_install(&transaction->handles,
+					     transaction->peer);
+		mutex_unlock(&transaction->peer_info->lock);
+	}
 
-	for (message = list; message; message = message->transaction.next) {
-		peer = message->transaction.dest.raw_peer;
-		idp = message->transaction.dest.idp;
+	for (message = list; message; message = message->next) {
+		peer = message->dest.raw_peer;
+		idp = message->dest.idp;
 		bus1_active_lockdep_acquired(&peer->active);
 		peer_info = bus1_peer_dereference(peer);
 
 		mutex_lock(&peer_info->lock);
 
-		bus1_queue_sync(&peer_info->queue, timestamp);
+		if (transaction->unordered) {
+			timestamp = bus1_queue_tick(&peer_info->queue);
+			if (bus1_queue_stage(&peer_info->queue, &message->qnode,
+					     timestamp - 1))
+				bus1_peer_wake(peer);
+		} else {
+			bus1_queue_sync(&peer_info->queue, timestamp);
+		}
 
-		id = bus1_handle_dest_export(&message->transaction.dest,
+		id = bus1_handle_dest_export(&message->dest,
 					     peer_info, timestamp,
 					     false);
 		r = (idp && put_user(id, idp)) ? -EFAULT : 0;
@@ -523,38 +832,64 @@ int bus1_transaction_commit(struct bus1_transaction *transaction)
 			return r;
 	}
 
-	idp = (u64 __user *)(unsigned long)param->ptr_handles;
-	mutex_lock(&transaction->peer_info->lock);
-	r = bus1_handle_transfer_export(&transaction->handles,
-					transaction->peer_info,
-					idp, param->n_handles);
-	mutex_unlock(&transaction->peer_info->lock);
-	if (r < 0)
-		return r;
+	if (!transaction->unordered) {
+		idp = (u64 __user *)(unsigned long)param->ptr_handles;
+		mutex_lock(&transaction->peer_info->lock);
+		r = bus1_handle_transfer_export(&transaction->handles,
+				transaction->peer_info, idp, param->n_handles,
+				param->flags & BUS1_SEND_FLAG_MOVE_HANDLES);
+		mutex_unlock(&transaction->peer_info->lock);
+		if (r < 0)
+			return r;
+
+		/*
+		 * Attach the new handles of all destinations in one go, so the
+		 * owner of each node is locked once, rather than once per
+		 * destination. Messages without slice are dropped on commit,
+		 * so there is no need to attach their handles at all.
+		 */
+		bus1_handle_attach_init(&attach);
+		for (message = list; message; message = message->next)
+			if (message->slice)
+				bus1_handle_inflight_attach(&message->handles,
+						message->dest.raw_peer,
+						&attach);
+		bus1_handle_attach_destroy(&attach);
+	}
 
 	while ((message = transaction->entries)) {
-		transaction->entries = message->transaction.next;
-		dest = message->transaction.dest;
+		transaction->entries = message->next;
+		dest = message->dest;
 
-		message->transaction.next = NULL;
-		message->transaction.dest = (struct bus1_handle_dest){};
+		message->next = NULL;
+		RB_CLEAR_NODE(&message->rb_coalesce); /* overwrites @dest */
 
 		bus1_active_lockdep_acquired(&dest.raw_peer->active);
 		peer_info = bus1_peer_dereference(dest.raw_peer);
 
-		bus1_handle_inflight_install(&message->handles, dest.raw_peer);
+		if (message->slice && !transaction->unordered)
+			bus1_handle_inflight_install(&message->handles,
+						     dest.raw_peer);
 
+		replaced = NULL;
 		mutex_lock(&peer_info->lock);
+		if (transaction->unordered)
+			timestamp = bus1_queue_node_get_timestamp(
+						&message->qnode) + 1;
 		res = bus1_transaction_commit_one(transaction, message, &dest,
-						  timestamp);
+						  timestamp, &replaced);
 		mutex_unlock(&peer_info->lock);
 
 		if (!res)
 			bus1_message_free(message, peer_info);
+		bus1_message_free(replaced, peer_info);
 		bus1_active_lockdep_released(&dest.raw_peer->active);
 		bus1_handle_dest_destroy(&dest, transaction->peer_info);
 	}
 
+	if (param->flags & BUS1_SEND_FLAG_MOVE_FDS)
+		bus1_transaction_close_files(transaction);
+
 	return 0;
 }
 
@@ -562,19 +897,23 @@ int bus1_transaction_commit(struct bus1_transaction *transaction)
  * bus1_transaction_commit_for_id() - instantiate and commit unicast
  * @transaction:	transaction to use
  * @idp:		user-space pointer with destination ID
+ * @cont:		whether to commit even if the destination is gone
  *
  * This is a fast-path for unicast messages. It is equivalent to calling
  * bus1_transaction_instantiate_for_id(), followed by bus1_transaction_commit().
+ * If the destination is gone and @cont is true, the transaction is committed
+ * without any message, see bus1_transaction_commit().
  *
  * Return: 0 on success, negative error code on failure.
  */
 int bus1_transaction_commit_for_id(struct bus1_transaction *transaction,
-				   u64 __user *idp)
+				   u64 __user *idp,
+				   bool cont)
 {
 	int r;
 
 	r = bus1_transaction_instantiate_for_id(transaction, idp);
-	if (r < 0)
+	if (r < 0 && (r != -ENXIO || !cont))
 		return r;
 
 	return bus1_transaction_commit(transaction);
@@ -19,25 +19,34 @@
 #include <linux/kernel.h>
 #include <uapi/linux/bus1.h>
 
+struct bus1_handle_dest;
+struct bus1_handle_set;
 struct bus1_peer;
 struct bus1_peer_info;
 struct bus1_transaction;
 
+int bus1_transaction_cache_create(void);
+void bus1_transaction_cache_destroy(void);
+
 struct bus1_transaction *
-bus1_transaction_new_from_user(u8 *stack_buffer,
-			       size_t stack_size,
-			       struct bus1_peer *peer,
+bus1_transaction_new_from_user(struct bus1_peer *peer,
 			       struct bus1_cmd_send *param);
 struct bus1_transaction *
-bus1_transaction_free(struct bus1_transaction *transaction, u8 *stack_buffer);
+bus1_transaction_free(struct bus1_transaction *transaction);
 
 struct bus1_message *
 bus1_transaction_instantiate_message(struct bus1_transaction *transaction,
-				     struct bus1_peer_info *peer_info);
+				     struct bus1_peer_info *peer_info,
+				     struct bus1_handle_dest *dest,
+				     size_t index);
 int bus1_transaction_instantiate_for_id(struct bus1_transaction *transaction,
 					u64 __user *idp);
+int bus1_transaction_instantiate_for_set(struct bus1_transaction *transaction,
+					 struct bus1_handle_set *set,
+					 size_t index);
 int bus1_transaction_commit(struct bus1_transaction *transaction);
 int bus1_transaction_commit_for_id(struct bus1_transaction *transaction,
-				   u64 __user *idp);
+				   u64 __user *idp,
+				   bool cont);
 
 #endif /* __BUS1_TRANSACTION_H */
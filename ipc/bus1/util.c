@@ -142,11 +142,11 @@ int bus1_import_vecs(struct iovec *out_vecs,
 
 /**
  * bus1_import_fd() - import file descriptor from user
- * @user_fd:	pointer to user-supplied file descriptor
+ * @fd:		user-supplied file descriptor
  *
  * This imports a file-descriptor from the current user-context. The FD number
- * is copied into kernel-space, then resolved to a file and returned to the
- * caller. If something goes wrong, an error is returned.
+ * is resolved to a file and returned to the caller. If something goes wrong,
+ * an error is returned.
  *
  * Neither bus1, nor UDS files are allowed. If those are supplied, EOPNOTSUPP
  * is returned. Those would require expensive garbage-collection if they're
@@ -154,15 +154,12 @@ int bus1_import_vecs(struct iovec *out_vecs,
  *
  * Return: Pointer to pinned file, ERR_PTR on failure.
  */
-struct file *bus1_import_fd(const u32 __user *user_fd)
+struct file *bus1_import_fd(int fd)
 {
 	struct file *f, *ret;
 	struct socket *sock;
 	struct inode *inode;
-	int fd;
 
-	if (unlikely(get_user(fd, user_fd)))
-		return ERR_PTR(-EFAULT);
 	if (unlikely(fd < 0))
 		return ERR_PTR(-EBADF);
 
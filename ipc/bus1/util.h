@@ -28,7 +28,7 @@ int bus1_import_vecs(struct iovec *out_vecs,
 		     size_t *out_length,
 		     const void __user *vecs,
 		     size_t n_vecs);
-struct file *bus1_import_fd(const u32 __user *user_fd);
+struct file *bus1_import_fd(int fd);
 struct file *bus1_clone_file(struct file *file);
 
 /**
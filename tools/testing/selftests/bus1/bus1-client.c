@@ -256,6 +256,46 @@ _public_ int bus1_client_node_destroy(struct bus1_client *client,
 	return bus1_client_ioctl(client, BUS1_CMD_NODE_DESTROY, &handle);
 }
 
+_public_ int bus1_client_node_allocate(struct bus1_client *client,
+				       uint64_t *ids,
+				       size_t n_ids)
+{
+	struct bus1_cmd_node_allocate node_allocate;
+
+	static_assert(_IOC_SIZE(BUS1_CMD_NODE_ALLOCATE) ==
+		      sizeof(node_allocate),
+		      "ioctl is called with invalid argument size");
+
+	node_allocate.flags = 0;
+	node_allocate.ptr_ids = (uintptr_t)ids;
+	node_allocate.n_ids = n_ids;
+	return bus1_client_ioctl(client, BUS1_CMD_NODE_ALLOCATE,
+				 &node_allocate);
+}
+
+_public_ int bus1_client_reply_reserve(struct bus1_client *client,
+				       uint64_t size,
+				       uint64_t *idp)
+{
+	struct bus1_cmd_reply_reserve reply_reserve;
+	int r;
+
+	static_assert(_IOC_SIZE(BUS1_CMD_REPLY_RESERVE) ==
+		      sizeof(reply_reserve),
+		      "ioctl is called with invalid argument size");
+
+	reply_reserve.flags = 0;
+	reply_reserve.id = 0;
+	reply_reserve.size = size;
+	r = bus1_client_ioctl(client, BUS1_CMD_REPLY_RESERVE, &reply_reserve);
+	if (r < 0)
+		return r;
+
+	if (idp)
+		*idp = reply_reserve.id;
+	return 0;
+}
+
 _public_ int bus1_client_handle_release(struct bus1_client *client,
 					uint64_t handle)
 {
@@ -274,6 +314,108 @@ _public_ int bus1_client_slice_release(struct bus1_client *client,
 	return bus1_client_ioctl(client, BUS1_CMD_SLICE_RELEASE, &offset);
 }
 
+_public_ int bus1_client_dest_set_register(struct bus1_client *client,
+					   uint64_t *idp,
+					   const uint64_t *destinations,
+					   size_t n_destinations)
+{
+	struct bus1_cmd_dest_set dest_set;
+	int r;
+
+	static_assert(_IOC_SIZE(BUS1_CMD_DEST_SET_REGISTER) == sizeof(dest_set),
+		      "ioctl is called with invalid argument size");
+
+	dest_set.flags = 0;
+	dest_set.id = 0;
+	dest_set.ptr_destinations = (uintptr_t)destinations;
+	dest_set.n_destinations = n_destinations;
+	r = bus1_client_ioctl(client, BUS1_CMD_DEST_SET_REGISTER, &dest_set);
+	if (r < 0)
+		return r;
+
+	assert(dest_set.id != 0);
+
+	*idp = dest_set.id;
+	return 0;
+}
+
+_public_ int bus1_client_dest_set_release(struct bus1_client *client,
+					  uint64_t id)
+{
+	static_assert(_IOC_SIZE(BUS1_CMD_DEST_SET_RELEASE) == sizeof(id),
+		      "ioctl is called with invalid argument size");
+
+	return bus1_client_ioctl(client, BUS1_CMD_DEST_SET_RELEASE, &id);
+}
+
+_public_ int bus1_client_buffer_register(struct bus1_client *client,
+					 uint64_t *idp,
+					 void *ptr,
+					 size_t size)
+{
+	struct bus1_cmd_buffer buffer;
+	int r;
+
+	static_assert(_IOC_SIZE(BUS1_CMD_BUFFER_REGISTER) == sizeof(buffer),
+		      "ioctl is called with invalid argument size");
+
+	buffer.flags = 0;
+	buffer.id = 0;
+	buffer.ptr = (uintptr_t)ptr;
+	buffer.size = size;
+	r = bus1_client_ioctl(client, BUS1_CMD_BUFFER_REGISTER, &buffer);
+	if (r < 0)
+		return r;
+
+	assert(buffer.id != 0);
+
+	*idp = buffer.id;
+	return 0;
+}
+
+_public_ int bus1_client_buffer_release(struct bus1_client *client,
+					uint64_t id)
+{
+	static_assert(_IOC_SIZE(BUS1_CMD_BUFFER_RELEASE) == sizeof(id),
+		      "ioctl is called with invalid argument size");
+
+	return bus1_client_ioctl(client, BUS1_CMD_BUFFER_RELEASE, &id);
+}
+
+_public_ int bus1_client_peer_set_register(struct bus1_client *client,
+					   uint64_t *idp,
+					   const int *fds,
+					   size_t n_fds)
+{
+	struct bus1_cmd_peer_set peer_set;
+	int r;
+
+	static_assert(_IOC_SIZE(BUS1_CMD_PEER_SET_REGISTER) == sizeof(peer_set),
+		      "ioctl is called with invalid argument size");
+
+	peer_set.flags = 0;
+	peer_set.id = 0;
+	peer_set.ptr_fds = (uintptr_t)fds;
+	peer_set.n_fds = n_fds;
+	r = bus1_client_ioctl(client, BUS1_CMD_PEER_SET_REGISTER, &peer_set);
+	if (r < 0)
+		return r;
+
+	assert(peer_set.id != 0);
+
+	*idp = peer_set.id;
+	return 0;
+}
+
+_public_ int bus1_client_peer_set_release(struct bus1_client *client,
+					  uint64_t id)
+{
+	static_assert(_IOC_SIZE(BUS1_CMD_PEER_SET_RELEASE) == sizeof(id),
+		      "ioctl is called with invalid argument size");
+
+	return bus1_client_ioctl(client, BUS1_CMD_PEER_SET_RELEASE, &id);
+}
+
 _public_ void *bus1_client_slice_from_offset(struct bus1_client *client,
 					     uint64_t offset)
 {
@@ -57,9 +57,30 @@ int bus1_client_clone(struct bus1_client *client,
 		      int *fdp,
 		      size_t pool_size);
 
+int bus1_client_node_allocate(struct bus1_client *client,
+			      uint64_t *ids,
+			      size_t n_ids);
+int bus1_client_reply_reserve(struct bus1_client *client,
+			      uint64_t size,
+			      uint64_t *idp);
 int bus1_client_node_destroy(struct bus1_client *client, uint64_t handle);
 int bus1_client_handle_release(struct bus1_client *client, uint64_t handle);
 int bus1_client_slice_release(struct bus1_client *client, uint64_t offset);
+int bus1_client_dest_set_register(struct bus1_client *client,
+				  uint64_t *idp,
+				  const uint64_t *destinations,
+				  size_t n_destinations);
+int bus1_client_dest_set_release(struct bus1_client *client, uint64_t id);
+int bus1_client_buffer_register(struct bus1_client *client,
+				uint64_t *idp,
+				void *ptr,
+				size_t size);
+int bus1_client_buffer_release(struct bus1_client *client, uint64_t id);
+int bus1_client_peer_set_register(struct bus1_client *client,
+				  uint64_t *idp,
+				  const int *fds,
+				  size_t n_fds);
+int bus1_client_peer_set_release(struct bus1_client *client, uint64_t id);
 
 void *bus1_client_slice_from_offset(struct bus1_client *client,
 				    uint64_t offset);
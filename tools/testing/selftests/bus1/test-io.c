@@ -8,7 +8,9 @@
  */
 
 #define _GNU_SOURCE
+#include <pthread.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <time.h>
 #include "test.h"
@@ -57,16 +59,58 @@ static int client_slice_release(struct bus1_client *client, void *slice)
 				bus1_client_slice_to_offset(client, slice));
 }
 
+static int client_clone(struct bus1_client *parent,
+			struct bus1_client **clientp,
+			uint64_t *handlep,
+			uint64_t flags,
+			size_t pool_size)
+{
+	struct bus1_cmd_peer_clone clone = {
+		.flags = flags,
+		.pool_size = pool_size,
+		.node = BUS1_HANDLE_INVALID,
+		.handle = BUS1_HANDLE_INVALID,
+		.fd = (uint64_t)-1,
+	};
+	int r;
+
+	r = bus1_client_ioctl(parent, BUS1_CMD_PEER_CLONE, &clone);
+	if (r < 0)
+		return r;
+
+	r = bus1_client_new_from_fd(clientp, clone.fd);
+	if (r < 0)
+		return r;
+
+	r = bus1_client_mmap(*clientp);
+	if (r < 0)
+		return r;
+
+	if (handlep)
+		*handlep = clone.handle;
+	return 0;
+}
+
+static inline uint64_t nsec_from_clock(clockid_t clock)
+{
+	struct timespec ts;
+	int r;
+
+	r = clock_gettime(clock, &ts);
+	assert(r >= 0);
+	return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
 static void test_basic(void)
 {
 	struct bus1_client *sender, *receiver1, *receiver2;
-	uint64_t node, handles[2], aux;
+	uint64_t handles[2], aux;
 	struct bus1_cmd_send send;
 	struct bus1_cmd_recv recv;
 	char *payload = "WOOFWOOF";
 	char *reply_payload;
 	size_t reply_len;
-	int r, fd;
+	int r;
 
 	/* create parent */
 	r = bus1_client_new_from_path(&sender, test_path);
@@ -76,14 +120,8 @@ static void test_basic(void)
 	assert(r >= 0);
 
 	/* create first child */
-	r = bus1_client_clone(sender, &node, handles, &fd,
-			      BUS1_CLIENT_POOL_SIZE);
-	assert(r >= 0);
-
-	r = bus1_client_new_from_fd(&receiver1, fd);
-	assert(r >= 0);
-
-	r = bus1_client_mmap(receiver1);
+	r = client_clone(sender, &receiver1, handles, 0,
+			 BUS1_CLIENT_POOL_SIZE);
 	assert(r >= 0);
 
 	/* unicast */
@@ -100,14 +138,8 @@ static void test_basic(void)
 	assert(r >= 0);
 
 	/* create second child */
-	r = bus1_client_clone(sender, &node, handles + 1, &fd,
-			      BUS1_CLIENT_POOL_SIZE);
-	assert(r >= 0);
-
-	r = bus1_client_new_from_fd(&receiver2, fd);
-	assert(r >= 0);
-
-	r = bus1_client_mmap(receiver2);
+	r = client_clone(sender, &receiver2, handles + 1, 0,
+			 BUS1_CLIENT_POOL_SIZE);
 	assert(r >= 0);
 
 	/* multicast */
@@ -172,79 +204,1467 @@ static void test_basic(void)
 	receiver2 = bus1_client_free(receiver2);
 }
 
-static inline uint64_t nsec_from_clock(clockid_t clock)
+static void test_dest_set(void)
 {
-	struct timespec ts;
+	struct bus1_client *sender, *receivers[2];
+	struct bus1_cmd_send send;
+	char *payload = "WOOFWOOF";
+	char *reply_payload;
+	uint64_t handles[2], set;
+	size_t i, reply_len;
 	int r;
 
-	r = clock_gettime(clock, &ts);
+	r = bus1_client_new_from_path(&sender, test_path);
 	assert(r >= 0);
-	return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+
+	r = bus1_client_init(sender, BUS1_CLIENT_POOL_SIZE);
+	assert(r >= 0);
+
+	for (i = 0; i < 2; ++i) {
+		r = client_clone(sender, receivers + i, handles + i, 0,
+				 BUS1_CLIENT_POOL_SIZE);
+		assert(r >= 0);
+	}
+
+	/* multicast via destination set */
+	r = bus1_client_dest_set_register(sender, &set, handles, 2);
+	assert(r >= 0);
+
+	send = (struct bus1_cmd_send) {
+		.flags = BUS1_SEND_FLAG_DEST_SET,
+		.ptr_vecs = (unsigned long)&(struct iovec){
+			.iov_base = payload,
+			.iov_len = strlen(payload) + 1,
+		},
+		.n_vecs = 1,
+		.dest_set = set,
+	};
+	r = bus1_client_send(sender, &send);
+	assert(r >= 0);
+
+	for (i = 0; i < 2; ++i) {
+		r = client_recv(receivers[i], (void**)&reply_payload,
+				&reply_len);
+		assert(r >= 0);
+		assert(reply_len == strlen(payload) + 1);
+		assert(!memcmp(payload, reply_payload, strlen(payload) + 1));
+
+		r = client_slice_release(receivers[i], reply_payload);
+		assert(r >= 0);
+	}
+
+	/* released sets cannot be used anymore */
+	r = bus1_client_dest_set_release(sender, set);
+	assert(r >= 0);
+
+	r = bus1_client_send(sender, &send);
+	assert(r == -ENXIO);
+
+	sender = bus1_client_free(sender);
+	for (i = 0; i < 2; ++i)
+		receivers[i] = bus1_client_free(receivers[i]);
 }
 
-static uint64_t test_iterate(unsigned int iterations,
-			     unsigned int n_destinations,
-			     size_t n_bytes)
+static void test_buffers(void)
 {
-	struct bus1_client *sender, *receivers[n_destinations];
-	uint64_t handles[n_destinations];
-	char payload[n_bytes];
+	struct bus1_client *sender, *receiver;
+	struct bus1_buffer_vec buffer_vec;
+	struct bus1_cmd_send send;
+	char buffer_payload[] = "MEOWMEOW";
 	char *reply_payload;
+	uint64_t handle, buffer;
 	size_t reply_len;
-	unsigned int j, i;
-	uint64_t node, time_start, time_end;
-	int r, fd;
+	int r;
 
-	/* create parent */
 	r = bus1_client_new_from_path(&sender, test_path);
 	assert(r >= 0);
 
 	r = bus1_client_init(sender, BUS1_CLIENT_POOL_SIZE);
 	assert(r >= 0);
 
-	/* create children */
-	for (i = 0; i < n_destinations; i++) {
-		r = bus1_client_clone(sender, &node, handles + i,
-				      &fd, BUS1_CLIENT_POOL_SIZE);
+	r = client_clone(sender, &receiver, &handle, 0, BUS1_CLIENT_POOL_SIZE);
+	assert(r >= 0);
+
+	/* unicast from registered buffer */
+	r = bus1_client_buffer_register(sender, &buffer, buffer_payload,
+					sizeof(buffer_payload));
+	assert(r >= 0);
+
+	buffer_vec = (struct bus1_buffer_vec) {
+		.buffer = buffer,
+		.offset = 4,
+		.length = sizeof(buffer_payload) - 4,
+	};
+	send = (struct bus1_cmd_send) {
+		.flags = BUS1_SEND_FLAG_BUFFERS,
+		.ptr_destinations = (unsigned long)&handle,
+		.n_destinations = 1,
+		.ptr_vecs = (unsigned long)&buffer_vec,
+		.n_vecs = 1,
+	};
+	r = bus1_client_send(sender, &send);
+	assert(r >= 0);
+
+	r = client_recv(receiver, (void**)&reply_payload, &reply_len);
+	assert(r >= 0);
+	assert(reply_len == sizeof(buffer_payload) - 4);
+	assert(memcmp(buffer_payload + 4, reply_payload, reply_len) == 0);
+
+	r = client_slice_release(receiver, reply_payload);
+	assert(r >= 0);
+
+	/* ranges must stay within the buffer */
+	buffer_vec.length = sizeof(buffer_payload);
+	r = bus1_client_send(sender, &send);
+	assert(r == -EFAULT);
+
+	/* released buffers cannot be used anymore */
+	r = bus1_client_buffer_release(sender, buffer);
+	assert(r >= 0);
+
+	buffer_vec.length = 0;
+	r = bus1_client_send(sender, &send);
+	assert(r == -ENXIO);
+
+	sender = bus1_client_free(sender);
+	receiver = bus1_client_free(receiver);
+}
+
+static void test_scatter(void)
+{
+	struct bus1_client *sender, *receiver;
+	struct bus1_msg_slice *slices;
+	struct bus1_cmd_recv recv;
+	uint64_t handle, offsets[3];
+	size_t i, n_bytes, pos, quarter;
+	char *payload, *reply_payload;
+	int r;
+
+	quarter = sysconf(_SC_PAGESIZE) / 4;
+	n_bytes = quarter * 2 + quarter / 2;
+	payload = malloc(n_bytes);
+	assert(payload);
+	for (i = 0; i < n_bytes; ++i)
+		payload[i] = i & 0xff;
+
+	r = bus1_client_new_from_path(&sender, test_path);
+	assert(r >= 0);
+
+	r = bus1_client_init(sender, BUS1_CLIENT_POOL_SIZE);
+	assert(r >= 0);
+
+	/* create a receiver with a single-page pool, accepting scatter */
+	r = client_clone(sender, &receiver, &handle, BUS1_PEER_FLAG_SCATTER,
+			 sysconf(_SC_PAGESIZE));
+	assert(r >= 0);
+
+	/* fill the first three quarters, then punch holes at both ends */
+	for (i = 0; i < 3; ++i) {
+		r = client_send(sender, &handle, 1, payload, quarter);
+		assert(r >= 0);
+
+		recv = (struct bus1_cmd_recv){};
+		r = bus1_client_recv(receiver, &recv);
+		assert(r >= 0);
+		assert(recv.type == BUS1_MSG_DATA);
+		assert(recv.data.n_slices == 0);
+		offsets[i] = recv.data.offset;
+	}
+
+	r = bus1_client_slice_release(receiver, offsets[0]);
+	assert(r >= 0);
+	r = bus1_client_slice_release(receiver, offsets[2]);
+	assert(r >= 0);
+
+	/* no single hole fits, so the payload must be scattered */
+	r = client_send(sender, &handle, 1, payload, n_bytes);
+	assert(r >= 0);
+
+	recv = (struct bus1_cmd_recv){};
+	r = bus1_client_recv(receiver, &recv);
+	assert(r >= 0);
+	assert(recv.type == BUS1_MSG_DATA);
+	assert(recv.data.n_bytes == n_bytes);
+	assert(recv.data.n_slices == 2);
+
+	slices = bus1_client_slice_from_offset(receiver, recv.data.offset);
+	for (i = 0, pos = 0; i < recv.data.n_slices; ++i) {
+		reply_payload = bus1_client_slice_from_offset(receiver,
+							      slices[i].offset);
+		assert(!memcmp(payload + pos, reply_payload,
+			       slices[i].n_bytes));
+		pos += slices[i].n_bytes;
+
+		r = bus1_client_slice_release(receiver, slices[i].offset);
+		assert(r >= 0);
+	}
+	assert(pos == n_bytes);
+
+	r = bus1_client_slice_release(receiver, recv.data.offset);
+	assert(r >= 0);
+	r = bus1_client_slice_release(receiver, offsets[1]);
+	assert(r >= 0);
+
+	sender = bus1_client_free(sender);
+	receiver = bus1_client_free(receiver);
+	free(payload);
+}
+
+static void test_page_aligned(void)
+{
+	struct bus1_client *sender, *receiver;
+	struct bus1_cmd_send send;
+	struct bus1_cmd_recv recv;
+	char *payload = "WOOFWOOF";
+	uint64_t handle;
+	int r;
+
+	r = bus1_client_new_from_path(&sender, test_path);
+	assert(r >= 0);
+
+	r = bus1_client_init(sender, BUS1_CLIENT_POOL_SIZE);
+	assert(r >= 0);
+
+	r = client_clone(sender, &receiver, &handle, 0, BUS1_CLIENT_POOL_SIZE);
+	assert(r >= 0);
+
+	/* unicast with page-aligned payload */
+	send = (struct bus1_cmd_send) {
+		.flags = BUS1_SEND_FLAG_PAGE_ALIGNED,
+		.ptr_destinations = (unsigned long)&handle,
+		.n_destinations = 1,
+		.ptr_vecs = (unsigned long)&(struct iovec){
+			.iov_base = payload,
+			.iov_len = strlen(payload) + 1,
+		},
+		.n_vecs = 1,
+	};
+	r = bus1_client_send(sender, &send);
+	assert(r >= 0);
+
+	recv = (struct bus1_cmd_recv){};
+	r = bus1_client_recv(receiver, &recv);
+	assert(r >= 0);
+	assert(recv.type == BUS1_MSG_DATA);
+	assert(recv.data.offset % sysconf(_SC_PAGESIZE) == 0);
+	assert(!memcmp(payload,
+		       bus1_client_slice_from_offset(receiver,
+						     recv.data.offset),
+		       strlen(payload) + 1));
+
+	r = bus1_client_slice_release(receiver, recv.data.offset);
+	assert(r >= 0);
+
+	sender = bus1_client_free(sender);
+	receiver = bus1_client_free(receiver);
+}
+
+static void test_timestamps(void)
+{
+	struct bus1_client *sender, *receiver;
+	struct bus1_cmd_recv recv;
+	char *payload = "WOOFWOOF";
+	uint64_t handle, timestamp = 0;
+	size_t i;
+	int r;
+
+	r = bus1_client_new_from_path(&sender, test_path);
+	assert(r >= 0);
+
+	r = bus1_client_init(sender, BUS1_CLIENT_POOL_SIZE);
+	assert(r >= 0);
+
+	r = client_clone(sender, &receiver, &handle, 0, BUS1_CLIENT_POOL_SIZE);
+	assert(r >= 0);
+
+	/* commit timestamps are non-zero and increase with each message */
+	for (i = 0; i < 2; ++i) {
+		r = client_send(sender, &handle, 1, payload,
+				strlen(payload) + 1);
 		assert(r >= 0);
+	}
 
-		r = bus1_client_new_from_fd(receivers + i, fd);
+	for (i = 0; i < 2; ++i) {
+		recv = (struct bus1_cmd_recv){};
+		r = bus1_client_recv(receiver, &recv);
 		assert(r >= 0);
+		assert(recv.type == BUS1_MSG_DATA);
+		assert(recv.data.timestamp > timestamp);
+		timestamp = recv.data.timestamp;
 
-		r = bus1_client_mmap(receivers[i]);
+		r = bus1_client_slice_release(receiver, recv.data.offset);
 		assert(r >= 0);
 	}
 
-	time_start = nsec_from_clock(CLOCK_THREAD_CPUTIME_ID);
-	for (j = 0; j < iterations; j++) {
-		/* send */
-		r = client_send(sender, handles, n_destinations, payload, n_bytes);
+	sender = bus1_client_free(sender);
+	receiver = bus1_client_free(receiver);
+}
+
+static void test_coalesce(void)
+{
+	struct bus1_client *sender, *receiver;
+	struct bus1_cmd_send send;
+	char *payloads[] = { "OLD", "OTHER", "NEW" };
+	char *reply_payload;
+	size_t i, reply_len;
+	uint64_t handle;
+	int r;
+
+	r = bus1_client_new_from_path(&sender, test_path);
+	assert(r >= 0);
+
+	r = bus1_client_init(sender, BUS1_CLIENT_POOL_SIZE);
+	assert(r >= 0);
+
+	r = client_clone(sender, &receiver, &handle, 0, BUS1_CLIENT_POOL_SIZE);
+	assert(r >= 0);
+
+	/* coalesce queued messages with the same key */
+	for (i = 0; i < 3; ++i) {
+		send = (struct bus1_cmd_send) {
+			.flags = BUS1_SEND_FLAG_COALESCE,
+			.ptr_destinations = (unsigned long)&handle,
+			.n_destinations = 1,
+			.ptr_vecs = (unsigned long)&(struct iovec){
+				.iov_base = payloads[i],
+				.iov_len = strlen(payloads[i]) + 1,
+			},
+			.n_vecs = 1,
+			.coalesce_key = i == 1 ? 2 : 1,
+		};
+		r = bus1_client_send(sender, &send);
 		assert(r >= 0);
+	}
 
-		/* receive */
-		for (i = 0; i < n_destinations; i++) {
-			r = client_recv(receivers[i], (void**)&reply_payload,
-					&reply_len);
-			assert(r >= 0);
+	/* the replacement is queued behind the other key */
+	for (i = 1; i < 3; ++i) {
+		r = client_recv(receiver, (void**)&reply_payload, &reply_len);
+		assert(r >= 0);
+		assert(!strcmp(reply_payload, payloads[i]));
 
-			r = client_slice_release(receivers[i], reply_payload);
-			assert(r >= 0);
-		}
+		r = client_slice_release(receiver, reply_payload);
+		assert(r >= 0);
 	}
-	time_end = nsec_from_clock(CLOCK_THREAD_CPUTIME_ID);
 
-	/* cleanup */
+	r = client_recv(receiver, (void**)&reply_payload, &reply_len);
+	assert(r == -EAGAIN);
+
 	sender = bus1_client_free(sender);
+	receiver = bus1_client_free(receiver);
+}
 
-	for (i = 0; i < n_destinations; i++)
-		receivers[i] = bus1_client_free(receivers[i]);
+static void test_deadline(void)
+{
+	struct bus1_client *sender, *receiver;
+	struct bus1_cmd_send send;
+	struct bus1_cmd_recv recv;
+	char *payload = "WOOFWOOF";
+	char *reply_payload;
+	size_t reply_len;
+	uint64_t handle;
+	int r;
 
-	return (time_end - time_start) / iterations;
+	r = bus1_client_new_from_path(&sender, test_path);
+	assert(r >= 0);
+
+	r = bus1_client_init(sender, BUS1_CLIENT_POOL_SIZE);
+	assert(r >= 0);
+
+	r = client_clone(sender, &receiver, &handle, 0, BUS1_CLIENT_POOL_SIZE);
+	assert(r >= 0);
+
+	/* messages past their deadline are dropped, not delivered */
+	send = (struct bus1_cmd_send) {
+		.ptr_destinations = (unsigned long)&handle,
+		.n_destinations = 1,
+		.ptr_vecs = (unsigned long)&(struct iovec){
+			.iov_base = payload,
+			.iov_len = strlen(payload) + 1,
+		},
+		.n_vecs = 1,
+		.deadline = nsec_from_clock(CLOCK_MONOTONIC) - 1,
+	};
+	r = bus1_client_send(sender, &send);
+	assert(r >= 0);
+
+	recv = (struct bus1_cmd_recv){};
+	r = bus1_client_recv(receiver, &recv);
+	assert(r >= 0);
+	assert(recv.type == BUS1_MSG_NONE);
+	assert(recv.n_expired == 1);
+
+	send.deadline = nsec_from_clock(CLOCK_MONOTONIC) +
+			60ULL * 1000000000ULL;
+	r = bus1_client_send(sender, &send);
+	assert(r >= 0);
+
+	r = client_recv(receiver, (void**)&reply_payload, &reply_len);
+	assert(r >= 0);
+	assert(!strcmp(reply_payload, payload));
+
+	r = client_slice_release(receiver, reply_payload);
+	assert(r >= 0);
+
+	sender = bus1_client_free(sender);
+	receiver = bus1_client_free(receiver);
+}
+
+static void test_shared(void)
+{
+	struct bus1_client *sender, *receivers[2];
+	struct bus1_msg_slice *slices;
+	struct bus1_cmd_send send;
+	struct bus1_cmd_recv recv;
+	uint64_t handles[2];
+	size_t i, n_bytes;
+	struct iovec vec;
+	char *payload;
+	void *map;
+	int r;
+
+	n_bytes = sysconf(_SC_PAGESIZE) * 2 + 64;
+	payload = malloc(n_bytes);
+	assert(payload);
+	for (i = 0; i < n_bytes; ++i)
+		payload[i] = i & 0xff;
+
+	r = bus1_client_new_from_path(&sender, test_path);
+	assert(r >= 0);
+
+	r = bus1_client_init(sender, BUS1_CLIENT_POOL_SIZE);
+	assert(r >= 0);
+
+	for (i = 0; i < 2; ++i) {
+		r = client_clone(sender, receivers + i, handles + i, 0,
+				 BUS1_CLIENT_POOL_SIZE);
+		assert(r >= 0);
+	}
+
+	/* shared payloads cannot be combined with registered buffers */
+	vec = (struct iovec){ .iov_base = payload, .iov_len = n_bytes };
+	send = (struct bus1_cmd_send){
+		.flags = BUS1_SEND_FLAG_SHARED | BUS1_SEND_FLAG_BUFFERS,
+		.ptr_destinations = (uintptr_t)handles,
+		.n_destinations = 2,
+		.ptr_vecs = (uintptr_t)&vec,
+		.n_vecs = 1,
+	};
+	r = bus1_client_send(sender, &send);
+	assert(r == -EINVAL);
+
+	/* copy the payload once, and map a view of it on each receiver */
+	send.flags = BUS1_SEND_FLAG_SHARED;
+	r = bus1_client_send(sender, &send);
+	assert(r >= 0);
+
+	for (i = 0; i < 2; ++i) {
+		recv = (struct bus1_cmd_recv){};
+		r = bus1_client_recv(receivers[i], &recv);
+		assert(r >= 0);
+		assert(recv.type == BUS1_MSG_DATA);
+		assert(recv.data.n_bytes == n_bytes);
+		assert(recv.data.n_slices == 1);
+
+		slices = bus1_client_slice_from_offset(receivers[i],
+						       recv.data.offset);
+		assert(slices[0].n_bytes == n_bytes);
+		assert(slices[0].offset >=
+		       bus1_client_get_pool_size(receivers[i]));
+
+		map = mmap(NULL, n_bytes, PROT_READ, MAP_SHARED,
+			   bus1_client_get_fd(receivers[i]), slices[0].offset);
+		assert(map != MAP_FAILED);
+		assert(!memcmp(map, payload, n_bytes));
+
+		/* views are released like slices, mappings stay valid */
+		r = bus1_client_slice_release(receivers[i], slices[0].offset);
+		assert(r >= 0);
+		r = bus1_client_slice_release(receivers[i], slices[0].offset);
+		assert(r == -ENXIO);
+		assert(!memcmp(map, payload, n_bytes));
+
+		r = munmap(map, n_bytes);
+		assert(r >= 0);
+
+		r = bus1_client_slice_release(receivers[i], recv.data.offset);
+		assert(r >= 0);
+	}
+
+	/* pulled payloads end up in the pool, but only one flag is allowed */
+	send.flags = BUS1_SEND_FLAG_SHARED | BUS1_SEND_FLAG_PULL;
+	r = bus1_client_send(sender, &send);
+	assert(r == -EINVAL);
+
+	send.flags = BUS1_SEND_FLAG_PULL;
+	r = bus1_client_send(sender, &send);
+	assert(r >= 0);
+
+	for (i = 0; i < 2; ++i) {
+		recv = (struct bus1_cmd_recv){ .flags = BUS1_RECV_FLAG_PEEK };
+		r = bus1_client_recv(receivers[i], &recv);
+		assert(r >= 0);
+		assert(recv.type == BUS1_MSG_DATA);
+		assert(recv.data.n_bytes == n_bytes);
+		assert(recv.data.n_slices == 0);
+		assert(!memcmp(bus1_client_slice_from_offset(receivers[i],
+							recv.data.offset),
+			       payload, n_bytes));
+
+		recv = (struct bus1_cmd_recv){};
+		r = bus1_client_recv(receivers[i], &recv);
+		assert(r >= 0);
+		assert(!memcmp(bus1_client_slice_from_offset(receivers[i],
+							recv.data.offset),
+			       payload, n_bytes));
+
+		r = bus1_client_slice_release(receivers[i], recv.data.offset);
+		assert(r >= 0);
+	}
+
+	sender = bus1_client_free(sender);
+	for (i = 0; i < 2; ++i)
+		receivers[i] = bus1_client_free(receivers[i]);
+	free(payload);
+}
+
+static void test_shared_pool(void)
+{
+	struct bus1_client *sender, *receiver;
+	struct bus1_cmd_recv recv;
+	char *payload = "PAYLOAD";
+	size_t i, pool_size;
+	uint64_t handle;
+	int r;
+
+	r = bus1_client_new_from_path(&sender, test_path);
+	assert(r >= 0);
+
+	r = bus1_client_init(sender, BUS1_CLIENT_POOL_SIZE);
+	assert(r >= 0);
+
+	/* the pool of the clone is appended to the pool of the sender */
+	r = client_clone(sender, &receiver, &handle,
+			 BUS1_PEER_FLAG_SHARED_POOL, sysconf(_SC_PAGESIZE));
+	assert(r >= 0);
+
+	r = bus1_client_query(receiver, &pool_size);
+	assert(r >= 0);
+	assert(pool_size == BUS1_CLIENT_POOL_SIZE + sysconf(_SC_PAGESIZE));
+
+	r = client_send(sender, &handle, 1, payload, strlen(payload) + 1);
+	assert(r >= 0);
+
+	recv = (struct bus1_cmd_recv){};
+	r = bus1_client_recv(receiver, &recv);
+	assert(r >= 0);
+	assert(recv.type == BUS1_MSG_DATA);
+	assert(recv.data.offset >= BUS1_CLIENT_POOL_SIZE);
+	assert(recv.data.offset < pool_size);
+	assert(!strcmp(bus1_client_slice_from_offset(receiver,
+						     recv.data.offset),
+		       payload));
+
+	/* slices can only be released by the peer they belong to */
+	r = bus1_client_slice_release(sender, recv.data.offset);
+	assert(r == -ENXIO);
+	r = bus1_client_slice_release(receiver, recv.data.offset);
+	assert(r >= 0);
+
+	receiver = bus1_client_free(receiver);
+
+	/*
+	 * The region of a destroyed clone is reused by the next one, rather
+	 * than appended to the object, so the pool size reported to each of
+	 * these clones stays the same.
+	 */
+	for (i = 0; i < 3; ++i) {
+		r = client_clone(sender, &receiver, NULL,
+				 BUS1_PEER_FLAG_SHARED_POOL,
+				 BUS1_CLIENT_POOL_SIZE);
+		assert(r >= 0);
+
+		r = bus1_client_query(receiver, &pool_size);
+		assert(r >= 0);
+		assert(pool_size == 2 * BUS1_CLIENT_POOL_SIZE);
+
+		receiver = bus1_client_free(receiver);
+	}
+
+	sender = bus1_client_free(sender);
+}
+
+static void test_peer_set(void)
+{
+	struct bus1_client *sender, *receivers[2];
+	struct bus1_cmd_recv recv;
+	uint64_t handles[2], set, id;
+	char *payload = "PEERSET";
+	int r, fds[2];
+	size_t i;
+
+	r = bus1_client_new_from_path(&sender, test_path);
+	assert(r >= 0);
+
+	r = bus1_client_init(sender, BUS1_CLIENT_POOL_SIZE);
+	assert(r >= 0);
+
+	for (i = 0; i < 2; ++i) {
+		r = client_clone(sender, receivers + i, handles + i, 0,
+				 BUS1_CLIENT_POOL_SIZE);
+		assert(r >= 0);
+
+		fds[i] = bus1_client_get_fd(receivers[i]);
+	}
+
+	/* receive from both children via the parent */
+	r = bus1_client_peer_set_register(sender, &set, fds, 2);
+	assert(r >= 0);
+
+	r = bus1_client_peer_set_register(sender, &id, fds, 1);
+	assert(r == -EBUSY);
+
+	for (i = 0; i < 2; ++i) {
+		r = client_send(sender, handles + i, 1, payload,
+				strlen(payload) + 1);
+		assert(r >= 0);
+		r = client_send(sender, handles + i, 1, payload,
+				strlen(payload) + 1);
+		assert(r >= 0);
+	}
+
+	/* members are served round-robin */
+	for (i = 0; i < 4; ++i) {
+		recv = (struct bus1_cmd_recv){
+			.flags = BUS1_RECV_FLAG_PEER_SET | BUS1_RECV_FLAG_WAIT,
+			.peer_set = set,
+		};
+		r = bus1_client_recv(sender, &recv);
+		assert(r >= 0);
+		assert(recv.type == BUS1_MSG_DATA);
+		assert(recv.peer_index == i % 2);
+		assert(!strcmp(bus1_client_slice_from_offset(
+					receivers[recv.peer_index],
+					recv.data.offset),
+			       payload));
+
+		r = bus1_client_slice_release(receivers[recv.peer_index],
+					      recv.data.offset);
+		assert(r >= 0);
+	}
+
+	recv = (struct bus1_cmd_recv){
+		.flags = BUS1_RECV_FLAG_PEER_SET,
+		.peer_set = set,
+	};
+	r = bus1_client_recv(sender, &recv);
+	assert(r == -EAGAIN);
+
+	r = bus1_client_peer_set_release(sender, set);
+	assert(r >= 0);
+
+	r = bus1_client_recv(sender, &recv);
+	assert(r == -ENXIO);
+
+	sender = bus1_client_free(sender);
+	for (i = 0; i < 2; ++i)
+		receivers[i] = bus1_client_free(receivers[i]);
+}
+
+static void test_batch(void)
+{
+	struct bus1_client *sender, *receiver;
+	struct bus1_cmd_send send;
+	struct bus1_cmd_recv recv[3];
+	struct bus1_batch_cmd cmds[3];
+	struct bus1_cmd_batch batch;
+	uint64_t handle, offsets[2];
+	char *payload = "BATCH";
+	size_t i;
+	int r;
+
+	r = bus1_client_new_from_path(&sender, test_path);
+	assert(r >= 0);
+
+	r = bus1_client_init(sender, BUS1_CLIENT_POOL_SIZE);
+	assert(r >= 0);
+
+	r = client_clone(sender, &receiver, &handle, 0, BUS1_CLIENT_POOL_SIZE);
+	assert(r >= 0);
+
+	/* send twice with one call */
+	send = (struct bus1_cmd_send) {
+		.ptr_destinations = (unsigned long)&handle,
+		.n_destinations = 1,
+		.ptr_vecs = (unsigned long)&(struct iovec){
+			.iov_base = payload,
+			.iov_len = strlen(payload) + 1,
+		},
+		.n_vecs = 1,
+	};
+	for (i = 0; i < 2; ++i)
+		cmds[i] = (struct bus1_batch_cmd){
+			.cmd = BUS1_CMD_SEND,
+			.ptr_arg = (unsigned long)&send,
+		};
+	batch = (struct bus1_cmd_batch){
+		.ptr_cmds = (unsigned long)cmds,
+		.n_cmds = 2,
+	};
+	r = bus1_client_ioctl(sender, BUS1_CMD_BATCH, &batch);
+	assert(r >= 0);
+	assert(cmds[0].result == 0);
+	assert(cmds[1].result == 0);
+
+	/* receive both, the third receive fails but does not abort */
+	for (i = 0; i < 3; ++i) {
+		recv[i] = (struct bus1_cmd_recv){};
+		cmds[i] = (struct bus1_batch_cmd){
+			.cmd = BUS1_CMD_RECV,
+			.ptr_arg = (unsigned long)&recv[i],
+		};
+	}
+	batch.n_cmds = 3;
+	r = bus1_client_ioctl(receiver, BUS1_CMD_BATCH, &batch);
+	assert(r >= 0);
+	assert(cmds[0].result == 0);
+	assert(cmds[1].result == 0);
+	assert(cmds[2].result == -EAGAIN);
+
+	for (i = 0; i < 2; ++i) {
+		assert(recv[i].type == BUS1_MSG_DATA);
+		assert(!strcmp(bus1_client_slice_from_offset(receiver,
+							recv[i].data.offset),
+			       payload));
+		offsets[i] = recv[i].data.offset;
+		cmds[i] = (struct bus1_batch_cmd){
+			.cmd = BUS1_CMD_SLICE_RELEASE,
+			.ptr_arg = (unsigned long)&offsets[i],
+		};
+	}
+
+	/* release both slices, unsupported commands fail individually */
+	cmds[2] = (struct bus1_batch_cmd){
+		.cmd = BUS1_CMD_PEER_RESET,
+	};
+	r = bus1_client_ioctl(receiver, BUS1_CMD_BATCH, &batch);
+	assert(r >= 0);
+	assert(cmds[0].result == 0);
+	assert(cmds[1].result == 0);
+	assert(cmds[2].result == -ENOTTY);
+
+	sender = bus1_client_free(sender);
+	receiver = bus1_client_free(receiver);
+}
+
+static void test_headers(void)
+{
+	struct bus1_client *sender, *receivers[2];
+	struct bus1_cmd_send send;
+	struct bus1_cmd_recv recv;
+	uint64_t handles[2];
+	char headers[2][16], payload[64], *slice;
+	struct iovec vec;
+	size_t i;
+	int r;
+
+	for (i = 0; i < 2; ++i)
+		memset(headers[i], 'A' + i, sizeof(headers[i]));
+	memset(payload, 'x', sizeof(payload));
+
+	r = bus1_client_new_from_path(&sender, test_path);
+	assert(r >= 0);
+
+	r = bus1_client_init(sender, BUS1_CLIENT_POOL_SIZE);
+	assert(r >= 0);
+
+	for (i = 0; i < 2; ++i) {
+		r = client_clone(sender, receivers + i, handles + i, 0,
+				 BUS1_CLIENT_POOL_SIZE);
+		assert(r >= 0);
+	}
+
+	/* headers are only valid with the flag, and with a sane size */
+	vec = (struct iovec){ .iov_base = payload, .iov_len = sizeof(payload) };
+	send = (struct bus1_cmd_send){
+		.ptr_destinations = (uintptr_t)handles,
+		.n_destinations = 2,
+		.ptr_vecs = (uintptr_t)&vec,
+		.n_vecs = 1,
+		.ptr_headers = (uintptr_t)headers,
+		.header_size = sizeof(headers[0]),
+	};
+	r = bus1_client_send(sender, &send);
+	assert(r == -EINVAL);
+
+	send.flags = BUS1_SEND_FLAG_HEADERS | BUS1_SEND_FLAG_SHARED;
+	r = bus1_client_send(sender, &send);
+	assert(r == -EINVAL);
+
+	send.flags = BUS1_SEND_FLAG_HEADERS;
+	send.header_size = BUS1_HEADER_SIZE_MAX + 1;
+	r = bus1_client_send(sender, &send);
+	assert(r == -EMSGSIZE);
+
+	/* each receiver gets its own header, followed by the common body */
+	send.header_size = sizeof(headers[0]);
+	r = bus1_client_send(sender, &send);
+	assert(r >= 0);
+
+	for (i = 0; i < 2; ++i) {
+		recv = (struct bus1_cmd_recv){};
+		r = bus1_client_recv(receivers[i], &recv);
+		assert(r >= 0);
+		assert(recv.type == BUS1_MSG_DATA);
+		assert(recv.data.n_bytes ==
+		       sizeof(headers[i]) + sizeof(payload));
+
+		slice = bus1_client_slice_from_offset(receivers[i],
+						      recv.data.offset);
+		assert(!memcmp(slice, headers[i], sizeof(headers[i])));
+		assert(!memcmp(slice + sizeof(headers[i]), payload,
+			       sizeof(payload)));
+
+		r = bus1_client_slice_release(receivers[i], recv.data.offset);
+		assert(r >= 0);
+	}
+
+	sender = bus1_client_free(sender);
+	for (i = 0; i < 2; ++i)
+		receivers[i] = bus1_client_free(receivers[i]);
+}
+
+static void test_unordered(void)
+{
+	struct bus1_client *sender, *receivers[2];
+	struct bus1_cmd_send send;
+	struct bus1_cmd_recv recv;
+	uint64_t handles[2];
+	char payload[] = "0";
+	struct iovec vec;
+	size_t i;
+	int r;
+
+	r = bus1_client_new_from_path(&sender, test_path);
+	assert(r >= 0);
+
+	r = bus1_client_init(sender, BUS1_CLIENT_POOL_SIZE);
+	assert(r >= 0);
+
+	/* the first receiver accepts unordered messages, the second not */
+	r = client_clone(sender, receivers, handles, BUS1_PEER_FLAG_UNORDERED,
+			 BUS1_CLIENT_POOL_SIZE);
+	assert(r >= 0);
+
+	r = client_clone(sender, receivers + 1, handles + 1, 0,
+			 BUS1_CLIENT_POOL_SIZE);
+	assert(r >= 0);
+
+	vec = (struct iovec){ .iov_base = payload, .iov_len = sizeof(payload) };
+	send = (struct bus1_cmd_send){
+		.flags = BUS1_SEND_FLAG_UNORDERED | BUS1_SEND_FLAG_SEED,
+		.ptr_vecs = (uintptr_t)&vec,
+		.n_vecs = 1,
+	};
+	r = bus1_client_send(sender, &send);
+	assert(r == -EINVAL);
+
+	/* handles cannot be passed unordered */
+	send.flags = BUS1_SEND_FLAG_UNORDERED;
+	send.ptr_destinations = (uintptr_t)handles;
+	send.n_destinations = 1;
+	send.ptr_handles = (uintptr_t)(handles + 1);
+	send.n_handles = 1;
+	r = bus1_client_send(sender, &send);
+	assert(r == -EINVAL);
+
+	/* messages of a single sender still arrive in the order sent */
+	send.ptr_handles = 0;
+	send.n_handles = 0;
+	for (i = 0; i < 4; ++i) {
+		payload[0] = '0' + i;
+		r = bus1_client_send(sender, &send);
+		assert(r >= 0);
+	}
+
+	for (i = 0; i < 4; ++i) {
+		recv = (struct bus1_cmd_recv){};
+		r = bus1_client_recv(receivers[0], &recv);
+		assert(r >= 0);
+		assert(recv.type == BUS1_MSG_DATA);
+		assert(*(char *)bus1_client_slice_from_offset(receivers[0],
+						recv.data.offset) == '0' + i);
+
+		r = bus1_client_slice_release(receivers[0], recv.data.offset);
+		assert(r >= 0);
+	}
+
+	/* an ordered destination falls back to a fully ordered multicast */
+	send.n_destinations = 2;
+	r = bus1_client_send(sender, &send);
+	assert(r >= 0);
+
+	for (i = 0; i < 2; ++i) {
+		recv = (struct bus1_cmd_recv){};
+		r = bus1_client_recv(receivers[i], &recv);
+		assert(r >= 0);
+		assert(recv.type == BUS1_MSG_DATA);
+
+		r = bus1_client_slice_release(receivers[i], recv.data.offset);
+		assert(r >= 0);
+	}
+
+	sender = bus1_client_free(sender);
+	for (i = 0; i < 2; ++i)
+		receivers[i] = bus1_client_free(receivers[i]);
+}
+
+static void test_move_handles(void)
+{
+	struct bus1_client *sender, *receivers[2];
+	struct bus1_cmd_send send;
+	struct bus1_cmd_recv recv;
+	char *payload = "WOOFWOOF";
+	uint64_t handles[2], aux;
+	size_t i;
+	int r;
+
+	r = bus1_client_new_from_path(&sender, test_path);
+	assert(r >= 0);
+
+	r = bus1_client_init(sender, BUS1_CLIENT_POOL_SIZE);
+	assert(r >= 0);
+
+	for (i = 0; i < 2; ++i) {
+		r = client_clone(sender, receivers + i, handles + i, 0,
+				 BUS1_CLIENT_POOL_SIZE);
+		assert(r >= 0);
+	}
+
+	/* move a handle, which releases it on the sender */
+	send = (struct bus1_cmd_send) {
+		.flags = BUS1_SEND_FLAG_MOVE_HANDLES,
+		.ptr_destinations = (unsigned long)handles,
+		.n_destinations = 1,
+		.ptr_vecs = (unsigned long)&(struct iovec){
+			.iov_base = payload,
+			.iov_len = strlen(payload) + 1,
+		},
+		.n_vecs = 1,
+		.ptr_handles = (unsigned long)(handles + 1),
+		.n_handles = 1,
+	};
+	r = bus1_client_send(sender, &send);
+	assert(r >= 0);
+
+	r = bus1_client_handle_release(sender, handles[1]);
+	assert(r == -ENXIO);
+
+	recv = (struct bus1_cmd_recv){};
+	r = bus1_client_recv(receivers[0], &recv);
+	assert(r >= 0);
+	assert(recv.type == BUS1_MSG_DATA);
+	assert(recv.data.n_handles == 1);
+
+	r = bus1_client_slice_release(receivers[0], recv.data.offset);
+	assert(r >= 0);
+
+	/* handles are moved even if no destination got the message */
+	aux = BUS1_NODE_FLAG_MANAGED | BUS1_NODE_FLAG_ALLOCATE;
+	send = (struct bus1_cmd_send){
+		.flags = BUS1_SEND_FLAG_MOVE_HANDLES,
+		.ptr_handles = (unsigned long)&aux,
+		.n_handles = 1,
+	};
+	r = bus1_client_send(sender, &send);
+	assert(r >= 0);
+
+	r = bus1_client_handle_release(sender, aux);
+	assert(r == -ENXIO);
+
+	sender = bus1_client_free(sender);
+	for (i = 0; i < 2; ++i)
+		receivers[i] = bus1_client_free(receivers[i]);
+}
+
+static void test_move_fds(void)
+{
+	struct bus1_client *sender, *receiver;
+	struct bus1_cmd_send send;
+	struct bus1_cmd_recv recv;
+	char *payload = "WOOFWOOF";
+	uint64_t handle;
+	int r, fds[2];
+
+	r = bus1_client_new_from_path(&sender, test_path);
+	assert(r >= 0);
+
+	r = bus1_client_init(sender, BUS1_CLIENT_POOL_SIZE);
+	assert(r >= 0);
+
+	r = client_clone(sender, &receiver, &handle, 0, BUS1_CLIENT_POOL_SIZE);
+	assert(r >= 0);
+
+	/* move an fd, which closes it on the sender */
+	r = pipe(fds);
+	assert(r >= 0);
+
+	send = (struct bus1_cmd_send) {
+		.flags = BUS1_SEND_FLAG_MOVE_FDS,
+		.ptr_destinations = (unsigned long)&handle,
+		.n_destinations = 1,
+		.ptr_vecs = (unsigned long)&(struct iovec){
+			.iov_base = payload,
+			.iov_len = strlen(payload) + 1,
+		},
+		.n_vecs = 1,
+		.ptr_fds = (unsigned long)fds,
+		.n_fds = 1,
+	};
+	r = bus1_client_send(sender, &send);
+	assert(r >= 0);
+
+	r = fcntl(fds[0], F_GETFD);
+	assert(r < 0 && errno == EBADF);
+	close(fds[1]);
+
+	recv = (struct bus1_cmd_recv){};
+	r = bus1_client_recv(receiver, &recv);
+	assert(r >= 0);
+	assert(recv.type == BUS1_MSG_DATA);
+	assert(recv.data.n_fds == 1);
+
+	r = bus1_client_slice_release(receiver, recv.data.offset);
+	assert(r >= 0);
+
+	/* fds are moved even if no destination got the message */
+	r = pipe(fds);
+	assert(r >= 0);
+
+	send.ptr_destinations = 0;
+	send.n_destinations = 0;
+	r = bus1_client_send(sender, &send);
+	assert(r >= 0);
+
+	r = fcntl(fds[0], F_GETFD);
+	assert(r < 0 && errno == EBADF);
+	close(fds[1]);
+
+	sender = bus1_client_free(sender);
+	receiver = bus1_client_free(receiver);
+}
+
+static void test_node_allocate(void)
+{
+	struct bus1_client *sender, *receiver;
+	struct bus1_cmd_send send;
+	struct bus1_cmd_recv recv;
+	char *payload = "WOOFWOOF";
+	uint64_t handle, nodes[4];
+	size_t i;
+	int r;
+
+	r = bus1_client_new_from_path(&sender, test_path);
+	assert(r >= 0);
+
+	r = bus1_client_init(sender, BUS1_CLIENT_POOL_SIZE);
+	assert(r >= 0);
+
+	r = client_clone(sender, &receiver, &handle, 0, BUS1_CLIENT_POOL_SIZE);
+	assert(r >= 0);
+
+	/* allocate nodes in bulk, and pass one of them along */
+	r = bus1_client_node_allocate(sender, nodes, 0);
+	assert(r == -EINVAL);
+	r = bus1_client_node_allocate(sender, nodes,
+				      BUS1_NODE_ALLOCATE_MAX + 1);
+	assert(r == -EMSGSIZE);
+	r = bus1_client_node_allocate(sender, nodes, 4);
+	assert(r >= 0);
+
+	send = (struct bus1_cmd_send) {
+		.ptr_destinations = (unsigned long)&handle,
+		.n_destinations = 1,
+		.ptr_vecs = (unsigned long)&(struct iovec){
+			.iov_base = payload,
+			.iov_len = strlen(payload) + 1,
+		},
+		.n_vecs = 1,
+		.ptr_handles = (unsigned long)nodes,
+		.n_handles = 1,
+	};
+	r = bus1_client_send(sender, &send);
+	assert(r >= 0);
+	assert(nodes[0] & BUS1_NODE_FLAG_MANAGED);
+
+	recv = (struct bus1_cmd_recv){};
+	r = bus1_client_recv(receiver, &recv);
+	assert(r >= 0);
+	assert(recv.type == BUS1_MSG_DATA);
+	assert(recv.data.n_handles == 1);
+
+	r = bus1_client_slice_release(receiver, recv.data.offset);
+	assert(r >= 0);
+
+	/* the others are distinct, and released like any other handle */
+	for (i = 1; i < 4; ++i) {
+		assert(nodes[i] != nodes[i - 1]);
+		r = bus1_client_handle_release(sender, nodes[i]);
+		assert(r >= 0);
+		r = bus1_client_handle_release(sender, nodes[i]);
+		assert(r == -ENXIO);
+	}
+
+	sender = bus1_client_free(sender);
+	receiver = bus1_client_free(receiver);
+}
+
+static void test_reply(void)
+{
+	struct bus1_client *client, *server;
+	struct bus1_cmd_send send;
+	struct bus1_cmd_recv recv;
+	uint64_t handle, reply, *ids;
+	char request[] = "REQUEST", response[] = "RESPONSE";
+	struct iovec vec;
+	void *slice;
+	int r;
+
+	r = bus1_client_new_from_path(&client, test_path);
+	assert(r >= 0);
+
+	r = bus1_client_init(client, BUS1_CLIENT_POOL_SIZE);
+	assert(r >= 0);
+
+	r = bus1_client_mmap(client);
+	assert(r >= 0);
+
+	r = client_clone(client, &server, &handle, 0, BUS1_CLIENT_POOL_SIZE);
+	assert(r >= 0);
+
+	r = bus1_client_reply_reserve(client, 0, &reply);
+	assert(r == -EINVAL);
+	r = bus1_client_reply_reserve(client, 64, &reply);
+	assert(r >= 0);
+	assert(reply & BUS1_NODE_FLAG_MANAGED);
+
+	/* pass the reply node along with the request */
+	vec = (struct iovec){ .iov_base = request, .iov_len = sizeof(request) };
+	send = (struct bus1_cmd_send){
+		.ptr_destinations = (uintptr_t)&handle,
+		.n_destinations = 1,
+		.ptr_vecs = (uintptr_t)&vec,
+		.n_vecs = 1,
+		.ptr_handles = (uintptr_t)&reply,
+		.n_handles = 1,
+	};
+	r = bus1_client_send(client, &send);
+	assert(r >= 0);
+
+	recv = (struct bus1_cmd_recv){};
+	r = bus1_client_recv(server, &recv);
+	assert(r >= 0);
+	assert(recv.type == BUS1_MSG_DATA);
+	assert(recv.data.n_handles == 1);
+
+	slice = bus1_client_slice_from_offset(server, recv.data.offset);
+	assert(!memcmp(slice, request, sizeof(request)));
+	ids = (uint64_t *)((char *)slice + ((sizeof(request) + 7) & ~7));
+	handle = *ids;
+
+	r = bus1_client_slice_release(server, recv.data.offset);
+	assert(r >= 0);
+
+	/* the response lands in the reserved slice, later ones do not */
+	vec = (struct iovec){ .iov_base = response,
+			      .iov_len = sizeof(response) };
+	send = (struct bus1_cmd_send){
+		.ptr_destinations = (uintptr_t)&handle,
+		.n_destinations = 1,
+		.ptr_vecs = (uintptr_t)&vec,
+		.n_vecs = 1,
+	};
+	r = bus1_client_send(server, &send);
+	assert(r >= 0);
+	r = bus1_client_send(server, &send);
+	assert(r >= 0);
+
+	recv = (struct bus1_cmd_recv){};
+	r = bus1_client_recv(client, &recv);
+	assert(r >= 0);
+	assert(recv.type == BUS1_MSG_DATA);
+	assert(recv.data.destination == reply);
+	assert(recv.data.n_bytes == sizeof(response));
+	assert(!memcmp(bus1_client_slice_from_offset(client, recv.data.offset),
+		       response, sizeof(response)));
+
+	r = bus1_client_slice_release(client, recv.data.offset);
+	assert(r >= 0);
+
+	recv = (struct bus1_cmd_recv){};
+	r = bus1_client_recv(client, &recv);
+	assert(r >= 0);
+	assert(recv.type == BUS1_MSG_DATA);
+	assert(recv.data.destination == reply);
+
+	r = bus1_client_slice_release(client, recv.data.offset);
+	assert(r >= 0);
+
+	/* an unused reservation is released along with its node */
+	r = bus1_client_reply_reserve(client, 64, &reply);
+	assert(r >= 0);
+	r = bus1_client_node_destroy(client, reply);
+	assert(r >= 0);
+
+	client = bus1_client_free(client);
+	server = bus1_client_free(server);
+}
+
+static void test_aggregate(void)
+{
+	struct bus1_client *owner, *holder;
+	struct bus1_cmd_send send;
+	struct bus1_cmd_recv recv;
+	uint64_t handle, nodes[4], handles[4], *ids;
+	char payload[] = "NODES";
+	uint64_t offset;
+	struct iovec vec;
+	void *slice;
+	size_t i, j;
+	int r;
+
+	r = bus1_client_new_from_path(&owner, test_path);
+	assert(r >= 0);
+
+	r = bus1_client_init(owner, BUS1_CLIENT_POOL_SIZE);
+	assert(r >= 0);
+
+	r = client_clone(owner, &holder, &handle, BUS1_PEER_FLAG_AGGREGATE,
+			 BUS1_CLIENT_POOL_SIZE);
+	assert(r >= 0);
+
+	/* pass a handle to each of the owner's nodes to the holder */
+	r = bus1_client_node_allocate(owner, nodes, 4);
+	assert(r >= 0);
+
+	vec = (struct iovec){ .iov_base = payload, .iov_len = sizeof(payload) };
+	send = (struct bus1_cmd_send){
+		.ptr_destinations = (uintptr_t)&handle,
+		.n_destinations = 1,
+		.ptr_vecs = (uintptr_t)&vec,
+		.n_vecs = 1,
+		.ptr_handles = (uintptr_t)nodes,
+		.n_handles = 4,
+	};
+	r = bus1_client_send(owner, &send);
+	assert(r >= 0);
+
+	recv = (struct bus1_cmd_recv){};
+	r = bus1_client_recv(holder, &recv);
+	assert(r >= 0);
+	assert(recv.type == BUS1_MSG_DATA);
+	assert(recv.data.n_handles == 4);
+
+	slice = bus1_client_slice_from_offset(holder, recv.data.offset);
+	memcpy(handles, (char *)slice + ((sizeof(payload) + 7) & ~7),
+	       sizeof(handles));
+
+	r = bus1_client_slice_release(holder, recv.data.offset);
+	assert(r >= 0);
+
+	/* tearing down the owner yields a single event for all handles */
+	owner = bus1_client_free(owner);
+
+	/* repeated peeks report the same aggregation, in the same slice */
+	recv = (struct bus1_cmd_recv){ .flags = BUS1_RECV_FLAG_PEEK };
+	r = bus1_client_recv(holder, &recv);
+	assert(r >= 0);
+	assert(recv.type == BUS1_MSG_NODE_DESTROY);
+	assert(recv.node_destroy.n_handles == 4);
+	assert(recv.node_destroy.offset != BUS1_OFFSET_INVALID);
+	offset = recv.node_destroy.offset;
+
+	r = bus1_client_slice_release(holder, offset);
+	assert(r >= 0);
+
+	for (i = 0; i < 2; ++i) {
+		recv = (struct bus1_cmd_recv){ .flags = BUS1_RECV_FLAG_PEEK };
+		r = bus1_client_recv(holder, &recv);
+		assert(r >= 0);
+		assert(recv.type == BUS1_MSG_NODE_DESTROY);
+		assert(recv.node_destroy.offset == offset);
+	}
+
+	/* it is handed out once, no matter how often it was peeked at */
+	r = bus1_client_slice_release(holder, offset);
+	assert(r >= 0);
+	r = bus1_client_slice_release(holder, offset);
+	assert(r == -ENXIO);
+
+	/* the dequeue hands over the slice of the peeks */
+	recv = (struct bus1_cmd_recv){};
+	r = bus1_client_recv(holder, &recv);
+	assert(r >= 0);
+	assert(recv.type == BUS1_MSG_NODE_DESTROY);
+	assert(recv.node_destroy.n_handles == 4);
+	assert(recv.node_destroy.offset == offset);
+
+	ids = bus1_client_slice_from_offset(holder, recv.node_destroy.offset);
+	assert(recv.node_destroy.handle == ids[0]);
+	for (i = 0; i < 4; ++i) {
+		for (j = 0; j < 4; ++j)
+			if (ids[i] == handles[j])
+				break;
+		assert(j < 4);
+	}
+
+	r = bus1_client_slice_release(holder, recv.node_destroy.offset);
+	assert(r >= 0);
+	r = bus1_client_slice_release(holder, recv.node_destroy.offset);
+	assert(r == -ENXIO);
+
+	holder = bus1_client_free(holder);
+}
+
+static uint64_t test_iterate(unsigned int iterations,
+			     unsigned int n_destinations,
+			     size_t n_bytes)
+{
+	struct bus1_client *sender, *receivers[n_destinations];
+	uint64_t handles[n_destinations];
+	char payload[n_bytes];
+	char *reply_payload;
+	size_t reply_len;
+	unsigned int j, i;
+	uint64_t time_start, time_end;
+	int r;
+
+	/* create parent */
+	r = bus1_client_new_from_path(&sender, test_path);
+	assert(r >= 0);
+
+	r = bus1_client_init(sender, BUS1_CLIENT_POOL_SIZE);
+	assert(r >= 0);
+
+	/* create children */
+	for (i = 0; i < n_destinations; i++) {
+		r = client_clone(sender, receivers + i, handles + i, 0,
+				 BUS1_CLIENT_POOL_SIZE);
+		assert(r >= 0);
+	}
+
+	time_start = nsec_from_clock(CLOCK_THREAD_CPUTIME_ID);
+	for (j = 0; j < iterations; j++) {
+		/* send */
+		r = client_send(sender, handles, n_destinations, payload, n_bytes);
+		assert(r >= 0);
+
+		/* receive */
+		for (i = 0; i < n_destinations; i++) {
+			r = client_recv(receivers[i], (void**)&reply_payload,
+					&reply_len);
+			assert(r >= 0);
+
+			r = client_slice_release(receivers[i], reply_payload);
+			assert(r >= 0);
+		}
+	}
+	time_end = nsec_from_clock(CLOCK_THREAD_CPUTIME_ID);
+
+	/* cleanup */
+	sender = bus1_client_free(sender);
+
+	for (i = 0; i < n_destinations; i++)
+		receivers[i] = bus1_client_free(receivers[i]);
+
+	return (time_end - time_start) / iterations;
+}
+
+struct test_corunner {
+	pthread_t thread;
+	volatile bool stop;
+	char *buffer;
+	size_t size;
+	uint64_t n_walks;
+	uint64_t nsec;
+};
+
+static void *test_corunner_fn(void *userdata)
+{
+	struct test_corunner *corunner = userdata;
+	uint64_t time_start;
+	size_t i;
+
+	/* walk the buffer a cache line at a time, until told to stop */
+	do {
+		time_start = nsec_from_clock(CLOCK_MONOTONIC);
+		for (i = 0; i < corunner->size; i += 64)
+			++corunner->buffer[i];
+		corunner->nsec += nsec_from_clock(CLOCK_MONOTONIC) -
+				  time_start;
+		++corunner->n_walks;
+	} while (!corunner->stop);
+
+	return NULL;
+}
+
+/*
+ * Run test_iterate() for a single destination, while a second thread keeps
+ * walking a buffer the size of the last-level cache. Returns the average time
+ * the co-runner took for a single walk of its buffer. Copies that go through
+ * the cache evict its buffer, and thus slow it down, while non-temporal
+ * copies should leave it alone. If @iterations is 0, the co-runner runs on
+ * its own for a moment, to get a baseline.
+ */
+static uint64_t test_corun(unsigned int iterations, size_t n_bytes)
+{
+	struct test_corunner corunner = {};
+	long llc_size;
+	int r;
+
+	llc_size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+	corunner.size = llc_size > 0 ? llc_size : 8 * 1024 * 1024;
+	corunner.buffer = malloc(corunner.size);
+	assert(corunner.buffer);
+	memset(corunner.buffer, 0, corunner.size);
+
+	r = pthread_create(&corunner.thread, NULL, test_corunner_fn,
+			   &corunner);
+	assert(r == 0);
+
+	if (iterations > 0)
+		test_iterate(iterations, 1, n_bytes);
+	else
+		usleep(100 * 1000);
+
+	corunner.stop = true;
+	r = pthread_join(corunner.thread, NULL);
+	assert(r == 0);
+
+	free(corunner.buffer);
+	return corunner.nsec / corunner.n_walks;
 }
 
 int test_io(void)
 {
 	test_basic();
+	test_dest_set();
+	test_buffers();
+	test_scatter();
+	test_page_aligned();
+	test_timestamps();
+	test_coalesce();
+	test_deadline();
+	test_shared();
+	test_shared_pool();
+	test_peer_set();
+	test_batch();
+	test_headers();
+	test_unordered();
+	test_move_handles();
+	test_move_fds();
+	test_node_allocate();
+	test_reply();
+	test_aggregate();
 	fprintf(stderr, "it took %lu ns to send nothing to no one\n",
 		test_iterate(10000, 0, 0));
 	fprintf(stderr, "it took %lu ns for no dests\n",
@@ -257,6 +1677,21 @@ int test_io(void)
 		test_iterate(10000, 64, 1024) / 64);
 	fprintf(stderr, "it took %lu ns per dest for 1000 dests\n",
 		test_iterate(1000, 1000, 1024) / 1000);
+	/* the default pool_nocache_threshold of the module is 256KiB */
+	fprintf(stderr, "it took %lu ns for one dest with 64KiB "
+		"(below the default nocache threshold, cached copy)\n",
+		test_iterate(1000, 1, 64 * 1024));
+	fprintf(stderr, "it took %lu ns for one dest with 1MiB "
+		"(above the default nocache threshold, non-temporal copy)\n",
+		test_iterate(1000, 1, 1024 * 1024));
+	fprintf(stderr, "a cache-sized co-runner took %lu ns per walk on "
+		"its own\n", test_corun(0, 0));
+	fprintf(stderr, "a cache-sized co-runner took %lu ns per walk "
+		"next to 64KiB sends (cached copy)\n",
+		test_corun(1000, 64 * 1024));
+	fprintf(stderr, "a cache-sized co-runner took %lu ns per walk "
+		"next to 1MiB sends (non-temporal copy)\n",
+		test_corun(1000, 1024 * 1024));
 
 	fprintf(stderr, "\n\n");
 